@@ -69,10 +69,16 @@
 #define DPA_PREFIX_SIZE 0
 #define DPA_MAX_ORDER_SIZE SIZE_MAX
 #define DPA_MAX_CTX_CNT 1
+#define DPA_RMA_IOV_LIMIT 16
+#define DPA_INJECT_SIZE 4096
 
 #define DPA_MSG_CAP (FI_MSG | FI_RECV | FI_SEND)
-#define DPA_RMA_CAP (FI_RMA | FI_READ | FI_WRITE | FI_REMOTE_READ | FI_REMOTE_WRITE)
-#define DPA_EP_MSG_CAP (DPA_MSG_CAP | DPA_RMA_CAP)
+#define DPA_RMA_CAP (FI_RMA | FI_READ | FI_WRITE | FI_REMOTE_READ | FI_REMOTE_WRITE | \
+                     FI_RMA_EVENT)
+#define DPA_ATOMIC_CAP FI_ATOMIC
+#define DPA_EP_MSG_CAP (DPA_MSG_CAP | DPA_RMA_CAP | DPA_ATOMIC_CAP)
+/* atomics travel as control messages on a connection's ring, so they
+ * need FI_MSG and are only offered on connected endpoints */
 #define DPA_EP_RDM_CAP DPA_RMA_CAP
 
 #define NO_FLAGS 0
@@ -88,9 +94,30 @@ extern struct fi_provider dpa_provider;
 EXTERN_ENV_CONST(dpa_adapterno_t, localAdapterNo);
 extern dpa_nodeid_t localNodeId;
 
+/* Adapters (rails) in use, dpaRails[0] is localAdapterNo and carries
+ * connection setup and MR events; endpoints, with their interrupts, are
+ * spread over all of them. With FI_DPA_RAIL_EMULATE missing adapters
+ * are stood in for by localAdapterNo, so the same adapter may appear
+ * more than once. */
+#define DPA_MAX_RAILS 4
+extern dpa_adapterno_t dpaRails[DPA_MAX_RAILS];
+extern size_t dpaRailCount;
+EXTERN_ENV_CONST(dpa_nodeid_t, RAIL_NODEID_STRIDE);
+
+// node id of a peer as seen through the given rail
+static inline dpa_nodeid_t rail_node(dpa_nodeid_t nodeId, size_t rail) {
+  return nodeId + rail * RAIL_NODEID_STRIDE;
+}
+
+// whether the rail is the first one on its adapter, per adapter setup is done once
+static inline int rail_first_use(size_t rail) {
+  for (size_t i = 0; i < rail; i++)
+    if (dpaRails[i] == dpaRails[rail]) return 0;
+  return 1;
+}
+
 #include "dpa_log.h"
 #include "dpa_utils.h"
-#include "hash.h"
 #include "list.h"
 #include "enosys.h"
 
@@ -0,0 +1,472 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#define LOG_SUBSYS FI_LOG_EP_DATA
+#include "dpa_atomic.h"
+#include "dpa_msg.h"
+#include "dpa_mr.h"
+
+enum atomic_msg_type {
+  ATOMIC_REQUEST,
+  ATOMIC_RESPONSE
+};
+
+enum atomic_kind {
+  ATOMIC_WRITE_KIND,
+  ATOMIC_READWRITE_KIND,
+  ATOMIC_COMPARE_KIND
+};
+
+/* Wire format of atomic control messages. Requests carry the operands
+ * followed by the compare values, responses carry the fetched values. */
+typedef struct atomic_msg {
+  uint8_t type;
+  uint8_t op;
+  uint8_t datatype;
+  uint8_t fetch;
+  int32_t err;
+  uint32_t count;
+  uint32_t reserved;
+  uint64_t key;
+  uint64_t addr;
+  uint64_t data[0];
+} atomic_msg;
+
+// operands and compare values, must fit MSG_CONTROL_MAX_SIZE
+#define ATOMIC_MSG_MAX (sizeof(atomic_msg) + 2 * DPA_ATOMIC_MAX_COUNT * sizeof(uint64_t))
+
+static inline size_t datatype_size(enum fi_datatype datatype) {
+  switch (datatype) {
+  case FI_INT32:
+  case FI_UINT32:
+    return sizeof(uint32_t);
+  case FI_INT64:
+  case FI_UINT64:
+    return sizeof(uint64_t);
+  default:
+    return 0;
+  }
+}
+
+static inline int is_compare_op(enum fi_op op) {
+  return op >= FI_CSWAP && op <= FI_MSWAP;
+}
+
+static inline int op_valid(enum fi_op op, enum atomic_kind kind) {
+  switch (op) {
+  case FI_MIN:
+  case FI_MAX:
+  case FI_SUM:
+  case FI_PROD:
+  case FI_LOR:
+  case FI_LAND:
+  case FI_BOR:
+  case FI_BAND:
+  case FI_LXOR:
+  case FI_BXOR:
+  case FI_ATOMIC_WRITE:
+    return kind != ATOMIC_COMPARE_KIND;
+  case FI_ATOMIC_READ:
+    return kind == ATOMIC_READWRITE_KIND;
+  default:
+    return is_compare_op(op) && kind == ATOMIC_COMPARE_KIND;
+  }
+}
+
+static inline int atomic_valid(enum fi_datatype datatype, enum fi_op op,
+                               enum atomic_kind kind, size_t* count) {
+  if (!datatype_size(datatype) || !op_valid(op, kind))
+    return -FI_EOPNOTSUPP;
+  if (count) *count = DPA_ATOMIC_MAX_COUNT;
+  return FI_SUCCESS;
+}
+
+int dpa_atomic_writevalid(struct fid_ep *ep, enum fi_datatype datatype,
+                          enum fi_op op, size_t *count) {
+  return atomic_valid(datatype, op, ATOMIC_WRITE_KIND, count);
+}
+int dpa_atomic_readwritevalid(struct fid_ep *ep, enum fi_datatype datatype,
+                              enum fi_op op, size_t *count) {
+  return atomic_valid(datatype, op, ATOMIC_READWRITE_KIND, count);
+}
+int dpa_atomic_compwritevalid(struct fid_ep *ep, enum fi_datatype datatype,
+                              enum fi_op op, size_t *count) {
+  return atomic_valid(datatype, op, ATOMIC_COMPARE_KIND, count);
+}
+
+int dpa_query_atomic(struct fid_domain *domain, enum fi_datatype datatype,
+                     enum fi_op op, struct fi_atomic_attr *attr, uint64_t flags) {
+  enum atomic_kind kind = ATOMIC_WRITE_KIND;
+#ifdef FI_COMPARE_ATOMIC
+  if (flags & FI_COMPARE_ATOMIC)
+    kind = ATOMIC_COMPARE_KIND;
+  else if (flags & FI_FETCH_ATOMIC)
+    kind = ATOMIC_READWRITE_KIND;
+#endif
+  size_t count;
+  int ret = atomic_valid(datatype, op, kind, &count);
+  if (ret) return ret;
+  if (attr) {
+    attr->size = datatype_size(datatype);
+    attr->count = count;
+  }
+  return FI_SUCCESS;
+}
+
+/*
+ * Target side
+ */
+
+#define ATOMIC_CAS(type, dst, old, expr) do {                           \
+    type _new;                                                          \
+    old = __atomic_load_n(dst, __ATOMIC_ACQUIRE);                       \
+    do {                                                                \
+      _new = (expr);                                                    \
+    } while (!__atomic_compare_exchange_n(dst, &old, _new, 0,           \
+                                          __ATOMIC_ACQ_REL,             \
+                                          __ATOMIC_ACQUIRE));           \
+  } while (0)
+
+#define DEFINE_ATOMIC_EXEC(type)                                        \
+  static int atomic_exec_##type(enum fi_op op, type* dst, const type* src, \
+                                const type* cmp, type* res, size_t count) { \
+    for (size_t i = 0; i < count; i++) {                                \
+      type old, val = src ? src[i] : 0, c = cmp ? cmp[i] : 0;           \
+      switch (op) {                                                     \
+      case FI_MIN: ATOMIC_CAS(type, &dst[i], old, MIN(old, val)); break; \
+      case FI_MAX: ATOMIC_CAS(type, &dst[i], old, MAX(old, val)); break; \
+      case FI_SUM:                                                      \
+        old = __atomic_fetch_add(&dst[i], val, __ATOMIC_ACQ_REL); break; \
+      case FI_PROD: ATOMIC_CAS(type, &dst[i], old, old * val); break;   \
+      case FI_LOR: ATOMIC_CAS(type, &dst[i], old, old || val); break;   \
+      case FI_LAND: ATOMIC_CAS(type, &dst[i], old, old && val); break;  \
+      case FI_LXOR: ATOMIC_CAS(type, &dst[i], old, !old != !val); break; \
+      case FI_BOR:                                                      \
+        old = __atomic_fetch_or(&dst[i], val, __ATOMIC_ACQ_REL); break; \
+      case FI_BAND:                                                     \
+        old = __atomic_fetch_and(&dst[i], val, __ATOMIC_ACQ_REL); break; \
+      case FI_BXOR:                                                     \
+        old = __atomic_fetch_xor(&dst[i], val, __ATOMIC_ACQ_REL); break; \
+      case FI_ATOMIC_READ:                                              \
+        old = __atomic_load_n(&dst[i], __ATOMIC_ACQUIRE); break;        \
+      case FI_ATOMIC_WRITE:                                             \
+        old = __atomic_exchange_n(&dst[i], val, __ATOMIC_ACQ_REL); break; \
+      case FI_CSWAP:                                                    \
+        old = c;                                                        \
+        __atomic_compare_exchange_n(&dst[i], &old, val, 0,              \
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); \
+        break;                                                          \
+      case FI_CSWAP_NE: ATOMIC_CAS(type, &dst[i], old, c != old ? val : old); break; \
+      case FI_CSWAP_LE: ATOMIC_CAS(type, &dst[i], old, c <= old ? val : old); break; \
+      case FI_CSWAP_LT: ATOMIC_CAS(type, &dst[i], old, c < old ? val : old); break; \
+      case FI_CSWAP_GE: ATOMIC_CAS(type, &dst[i], old, c >= old ? val : old); break; \
+      case FI_CSWAP_GT: ATOMIC_CAS(type, &dst[i], old, c > old ? val : old); break; \
+      case FI_MSWAP: ATOMIC_CAS(type, &dst[i], old, (val & c) | (old & ~c)); break; \
+      default: return -FI_EOPNOTSUPP;                                   \
+      }                                                                 \
+      if (res) res[i] = old;                                            \
+    }                                                                   \
+    return FI_SUCCESS;                                                  \
+  }
+
+DEFINE_ATOMIC_EXEC(int32_t)
+DEFINE_ATOMIC_EXEC(uint32_t)
+DEFINE_ATOMIC_EXEC(int64_t)
+DEFINE_ATOMIC_EXEC(uint64_t)
+
+static inline int run_atomic(const atomic_msg* req, size_t len, void* result) {
+  size_t size = datatype_size(req->datatype);
+  if (!size || !req->count || req->count > DPA_ATOMIC_MAX_COUNT)
+    return -FI_EINVAL;
+
+  size_t data_len = req->count * size;
+  const void* operand = req->op == FI_ATOMIC_READ ? NULL : req->data;
+  const void* compare = is_compare_op(req->op) ? (void*) req->data + data_len : NULL;
+  if (len < sizeof(atomic_msg) + (operand ? data_len : 0) + (compare ? data_len : 0))
+    return -FI_EINVAL;
+
+  table_readers* readers;
+  dpa_fid_mr* mr = dpa_mr_lookup(req->key, &readers);
+  uint64_t addr = req->addr + mr_key_offset(req->key);
+  int ret = -FI_EINVAL;
+  if (!mr || addr % size || addr > mr->len || mr->len - addr < data_len)
+    goto run_atomic_end;
+  void* dst = mr->mr.mem_desc + addr;
+
+  switch (req->datatype) {
+  case FI_INT32:
+    ret = atomic_exec_int32_t(req->op, dst, operand, compare, result, req->count);
+    break;
+  case FI_UINT32:
+    ret = atomic_exec_uint32_t(req->op, dst, operand, compare, result, req->count);
+    break;
+  case FI_INT64:
+    ret = atomic_exec_int64_t(req->op, dst, operand, compare, result, req->count);
+    break;
+  case FI_UINT64:
+    ret = atomic_exec_uint64_t(req->op, dst, operand, compare, result, req->count);
+    break;
+  default:
+    ret = -FI_EOPNOTSUPP;
+  }
+ run_atomic_end:
+  dpa_mr_unlock(readers);
+  return ret;
+}
+
+static inline void execute_atomic(dpa_fid_ep* ep, const atomic_msg* req, size_t len) {
+  uint64_t msg_buf[ATOMIC_MSG_MAX / sizeof(uint64_t)];
+  atomic_msg* resp = (atomic_msg*) msg_buf;
+  *resp = *req;
+  resp->type = ATOMIC_RESPONSE;
+  resp->err = run_atomic(req, len, req->fetch ? resp->data : NULL);
+  size_t resp_len = sizeof(atomic_msg);
+  if (resp->fetch && !resp->err)
+    resp_len += req->count * datatype_size(req->datatype);
+  DPA_DEBUG("Executed atomic op %u on key %lu, result %d\n", req->op, req->key, resp->err);
+  send_control_msg(ep, resp, resp_len);
+}
+
+/*
+ * Initiator side
+ */
+
+static inline void complete_atomic(dpa_fid_ep* ep, const atomic_msg* resp, size_t len) {
+  slist* pending = &ep->atomic_pending;
+  lock_if_needed(ep, pending);
+  if (slist_empty(pending)) {
+    unlock_if_needed(ep, pending);
+    DPA_WARN("Received atomic response with no pending operation\n");
+    return;
+  }
+  slist_entry* head = slist_remove_head_unsafe(pending);
+  msg_queue_entry* entry = container_of(head, msg_queue_entry, list_entry);
+  int err = resp->err;
+  if (!err && entry->buf) {
+    if (len < sizeof(atomic_msg) + entry->len)
+      err = -FI_EIO;
+    else
+      memcpy((void*) entry->buf, resp->data, entry->len);
+  }
+  uint64_t flags = entry->flags;
+  void* context = entry->context;
+  size_t result_len = entry->len;
+  slist_insert_head_unsafe(head, &ep->atomic_free);
+  unlock_if_needed(ep, pending);
+
+  uint8_t read = (flags & FI_READ) != 0;
+  dpa_fid_cq* cq = read ? ep->read_cq : ep->write_cq;
+  dpa_fid_cntr* cntr = read ? ep->read_cntr : ep->write_cntr;
+  // injected atomics complete silently, but still count
+  if (cq && !(flags & FI_INJECT) &&
+      (err || ep_completes(ep, read ? FI_READ : FI_WRITE, flags))) {
+    struct fi_cq_err_entry completion = {
+      .op_context = context,
+      .flags = FI_ATOMIC | (read ? FI_READ : FI_WRITE),
+      .len = result_len,
+      .buf = NULL,
+      .data = 0,
+      .err = -err,
+      .prov_errno = DPA_ERR_OK,
+      .err_data = NULL
+    };
+    cq_add(cq, &completion);
+  }
+  if (cntr) {
+    if (err == FI_SUCCESS)
+      dpa_cntr_inc(cntr);
+    else
+      dpa_cntr_err_inc(cntr);
+  }
+}
+
+void dpa_atomic_handle(dpa_fid_ep* ep, const void* buf, size_t len) {
+  const atomic_msg* msg = buf;
+  if (len < sizeof(atomic_msg)) {
+    DPA_WARN("Dropping truncated atomic message\n");
+    return;
+  }
+  if (msg->type == ATOMIC_REQUEST)
+    execute_atomic(ep, msg, len);
+  else
+    complete_atomic(ep, msg, len);
+}
+
+static ssize_t post_atomic(struct fid_ep *ep, const void *buf, size_t count,
+                           const void *compare, void *result, uint64_t addr,
+                           uint64_t key, enum fi_datatype datatype, enum fi_op op,
+                           enum atomic_kind kind, void *context, uint64_t flags) {
+  size_t count_max;
+  ssize_t ret = atomic_valid(datatype, op, kind, &count_max);
+  if (ret) return ret;
+  if (!count || count > count_max) return -FI_EINVAL;
+
+  dpa_fid_ep* ep_priv = container_of(ep, dpa_fid_ep, ep);
+  if (!ep_priv->connected) return -FI_ENOTCONN;
+
+  uint64_t msg_buf[ATOMIC_MSG_MAX / sizeof(uint64_t)];
+  atomic_msg* req = (atomic_msg*) msg_buf;
+  *req = (atomic_msg) {
+    .type = ATOMIC_REQUEST,
+    .op = op,
+    .datatype = datatype,
+    .fetch = kind != ATOMIC_WRITE_KIND,
+    .err = FI_SUCCESS,
+    .count = count,
+    .key = key,
+    .addr = addr
+  };
+  size_t data_len = count * datatype_size(datatype);
+  void* data = req->data;
+  if (op != FI_ATOMIC_READ) {
+    memcpy(data, buf, data_len);
+    data += data_len;
+  }
+  if (kind == ATOMIC_COMPARE_KIND) {
+    memcpy(data, compare, data_len);
+    data += data_len;
+  }
+
+  /* responses come back in order: keep the FIFO locked until the
+   * request is on the ring, so concurrent posts cannot swap places */
+  slist* pending = &ep_priv->atomic_pending;
+  lock_if_needed(ep_priv, pending);
+  msg_queue_entry* entry = get_free_entry(ep_priv, &ep_priv->atomic_free);
+  entry->ep = ep_priv;
+  entry->buf = req->fetch ? result : NULL;
+  entry->len = req->fetch ? data_len : 0;
+  entry->flags = (req->fetch ? FI_READ : FI_WRITE) | (flags & (FI_INJECT | FI_COMPLETION));
+  entry->context = context;
+  slist_insert_tail_unsafe(&entry->list_entry, pending);
+  ret = send_control_msg(ep_priv, req, data - (void*) req);
+  unlock_if_needed(ep_priv, pending);
+  return ret;
+}
+
+static inline int check_atomic_msg(const struct fi_msg_atomic *msg) {
+  if (!msg || msg->iov_count != 1 || !msg->msg_iov ||
+      msg->rma_iov_count != 1 || !msg->rma_iov)
+    return -FI_EINVAL;
+  return FI_SUCCESS;
+}
+
+ssize_t dpa_atomic_write(struct fid_ep *ep, const void *buf, size_t count, void *desc,
+                         fi_addr_t dest_addr, uint64_t addr, uint64_t key,
+                         enum fi_datatype datatype, enum fi_op op, void *context) {
+  return post_atomic(ep, buf, count, NULL, NULL, addr, key, datatype, op,
+                     ATOMIC_WRITE_KIND, context, ep_tx_op_flags(ep));
+}
+ssize_t dpa_atomic_writev(struct fid_ep *ep, const struct fi_ioc *iov, void **desc,
+                          size_t count, fi_addr_t dest_addr, uint64_t addr, uint64_t key,
+                          enum fi_datatype datatype, enum fi_op op, void *context) {
+  if (!iov || count != 1) return -FI_EINVAL;
+  return post_atomic(ep, iov[0].addr, iov[0].count, NULL, NULL, addr, key,
+                     datatype, op, ATOMIC_WRITE_KIND, context, ep_tx_op_flags(ep));
+}
+ssize_t dpa_atomic_writemsg(struct fid_ep *ep, const struct fi_msg_atomic *msg,
+                            uint64_t flags) {
+  ssize_t ret = check_atomic_msg(msg);
+  if (ret) return ret;
+  return post_atomic(ep, msg->msg_iov[0].addr, msg->msg_iov[0].count, NULL, NULL,
+                     msg->rma_iov[0].addr, msg->rma_iov[0].key, msg->datatype,
+                     msg->op, ATOMIC_WRITE_KIND, msg->context, flags);
+}
+ssize_t dpa_atomic_inject(struct fid_ep *ep, const void *buf, size_t count,
+                          fi_addr_t dest_addr, uint64_t addr, uint64_t key,
+                          enum fi_datatype datatype, enum fi_op op) {
+  return post_atomic(ep, buf, count, NULL, NULL, addr, key, datatype, op,
+                     ATOMIC_WRITE_KIND, NULL, FI_INJECT);
+}
+
+ssize_t dpa_atomic_readwrite(struct fid_ep *ep, const void *buf, size_t count, void *desc,
+                             void *result, void *result_desc, fi_addr_t dest_addr,
+                             uint64_t addr, uint64_t key, enum fi_datatype datatype,
+                             enum fi_op op, void *context) {
+  return post_atomic(ep, buf, count, NULL, result, addr, key, datatype, op,
+                     ATOMIC_READWRITE_KIND, context, ep_tx_op_flags(ep));
+}
+ssize_t dpa_atomic_readwritev(struct fid_ep *ep, const struct fi_ioc *iov, void **desc,
+                              size_t count, struct fi_ioc *resultv, void **result_desc,
+                              size_t result_count, fi_addr_t dest_addr, uint64_t addr,
+                              uint64_t key, enum fi_datatype datatype, enum fi_op op,
+                              void *context) {
+  if (!iov || count != 1 || !resultv || result_count != 1) return -FI_EINVAL;
+  return post_atomic(ep, iov[0].addr, iov[0].count, NULL, resultv[0].addr, addr,
+                     key, datatype, op, ATOMIC_READWRITE_KIND, context, ep_tx_op_flags(ep));
+}
+ssize_t dpa_atomic_readwritemsg(struct fid_ep *ep, const struct fi_msg_atomic *msg,
+                                struct fi_ioc *resultv, void **result_desc,
+                                size_t result_count, uint64_t flags) {
+  ssize_t ret = check_atomic_msg(msg);
+  if (ret) return ret;
+  if (!resultv || result_count != 1) return -FI_EINVAL;
+  return post_atomic(ep, msg->msg_iov[0].addr, msg->msg_iov[0].count, NULL,
+                     resultv[0].addr, msg->rma_iov[0].addr, msg->rma_iov[0].key,
+                     msg->datatype, msg->op, ATOMIC_READWRITE_KIND, msg->context,
+                     flags);
+}
+
+ssize_t dpa_atomic_compwrite(struct fid_ep *ep, const void *buf, size_t count, void *desc,
+                             const void *compare, void *compare_desc, void *result,
+                             void *result_desc, fi_addr_t dest_addr, uint64_t addr,
+                             uint64_t key, enum fi_datatype datatype, enum fi_op op,
+                             void *context) {
+  return post_atomic(ep, buf, count, compare, result, addr, key, datatype, op,
+                     ATOMIC_COMPARE_KIND, context, ep_tx_op_flags(ep));
+}
+ssize_t dpa_atomic_compwritev(struct fid_ep *ep, const struct fi_ioc *iov, void **desc,
+                              size_t count, const struct fi_ioc *comparev,
+                              void **compare_desc, size_t compare_count,
+                              struct fi_ioc *resultv, void **result_desc,
+                              size_t result_count, fi_addr_t dest_addr, uint64_t addr,
+                              uint64_t key, enum fi_datatype datatype, enum fi_op op,
+                              void *context) {
+  if (!iov || count != 1 || !comparev || compare_count != 1 ||
+      !resultv || result_count != 1)
+    return -FI_EINVAL;
+  return post_atomic(ep, iov[0].addr, iov[0].count, comparev[0].addr,
+                     resultv[0].addr, addr, key, datatype, op,
+                     ATOMIC_COMPARE_KIND, context, ep_tx_op_flags(ep));
+}
+ssize_t dpa_atomic_compwritemsg(struct fid_ep *ep, const struct fi_msg_atomic *msg,
+                                const struct fi_ioc *comparev, void **compare_desc,
+                                size_t compare_count, struct fi_ioc *resultv,
+                                void **result_desc, size_t result_count, uint64_t flags) {
+  ssize_t ret = check_atomic_msg(msg);
+  if (ret) return ret;
+  if (!comparev || compare_count != 1 || !resultv || result_count != 1)
+    return -FI_EINVAL;
+  return post_atomic(ep, msg->msg_iov[0].addr, msg->msg_iov[0].count,
+                     comparev[0].addr, resultv[0].addr, msg->rma_iov[0].addr,
+                     msg->rma_iov[0].key, msg->datatype, msg->op,
+                     ATOMIC_COMPARE_KIND, msg->context, flags);
+}
@@ -0,0 +1,96 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#ifndef _DPA_ATOMIC_H
+#define _DPA_ATOMIC_H
+
+#include "dpa.h"
+#include "dpa_ep.h"
+
+/* DPAlib has no remote atomic transactions: atomics are sent as
+ * control messages on the connection ring and executed by the target
+ * on its local copy of the memory region. They are therefore only
+ * offered together with FI_MSG, on a connected endpoint. */
+#define DPA_ATOMIC_MAX_COUNT 64
+
+int dpa_query_atomic(struct fid_domain *domain, enum fi_datatype datatype,
+                     enum fi_op op, struct fi_atomic_attr *attr, uint64_t flags);
+
+ssize_t dpa_atomic_write(struct fid_ep *ep, const void *buf, size_t count, void *desc,
+                         fi_addr_t dest_addr, uint64_t addr, uint64_t key,
+                         enum fi_datatype datatype, enum fi_op op, void *context);
+ssize_t dpa_atomic_writev(struct fid_ep *ep, const struct fi_ioc *iov, void **desc,
+                          size_t count, fi_addr_t dest_addr, uint64_t addr, uint64_t key,
+                          enum fi_datatype datatype, enum fi_op op, void *context);
+ssize_t dpa_atomic_writemsg(struct fid_ep *ep, const struct fi_msg_atomic *msg,
+                            uint64_t flags);
+ssize_t dpa_atomic_inject(struct fid_ep *ep, const void *buf, size_t count,
+                          fi_addr_t dest_addr, uint64_t addr, uint64_t key,
+                          enum fi_datatype datatype, enum fi_op op);
+ssize_t dpa_atomic_readwrite(struct fid_ep *ep, const void *buf, size_t count, void *desc,
+                             void *result, void *result_desc, fi_addr_t dest_addr,
+                             uint64_t addr, uint64_t key, enum fi_datatype datatype,
+                             enum fi_op op, void *context);
+ssize_t dpa_atomic_readwritev(struct fid_ep *ep, const struct fi_ioc *iov, void **desc,
+                              size_t count, struct fi_ioc *resultv, void **result_desc,
+                              size_t result_count, fi_addr_t dest_addr, uint64_t addr,
+                              uint64_t key, enum fi_datatype datatype, enum fi_op op,
+                              void *context);
+ssize_t dpa_atomic_readwritemsg(struct fid_ep *ep, const struct fi_msg_atomic *msg,
+                                struct fi_ioc *resultv, void **result_desc,
+                                size_t result_count, uint64_t flags);
+ssize_t dpa_atomic_compwrite(struct fid_ep *ep, const void *buf, size_t count, void *desc,
+                             const void *compare, void *compare_desc, void *result,
+                             void *result_desc, fi_addr_t dest_addr, uint64_t addr,
+                             uint64_t key, enum fi_datatype datatype, enum fi_op op,
+                             void *context);
+ssize_t dpa_atomic_compwritev(struct fid_ep *ep, const struct fi_ioc *iov, void **desc,
+                              size_t count, const struct fi_ioc *comparev,
+                              void **compare_desc, size_t compare_count,
+                              struct fi_ioc *resultv, void **result_desc,
+                              size_t result_count, fi_addr_t dest_addr, uint64_t addr,
+                              uint64_t key, enum fi_datatype datatype, enum fi_op op,
+                              void *context);
+ssize_t dpa_atomic_compwritemsg(struct fid_ep *ep, const struct fi_msg_atomic *msg,
+                                const struct fi_ioc *comparev, void **compare_desc,
+                                size_t compare_count, struct fi_ioc *resultv,
+                                void **result_desc, size_t result_count, uint64_t flags);
+int dpa_atomic_writevalid(struct fid_ep *ep, enum fi_datatype datatype,
+                          enum fi_op op, size_t *count);
+int dpa_atomic_readwritevalid(struct fid_ep *ep, enum fi_datatype datatype,
+                              enum fi_op op, size_t *count);
+int dpa_atomic_compwritevalid(struct fid_ep *ep, enum fi_datatype datatype,
+                              enum fi_op op, size_t *count);
+
+void dpa_atomic_handle(dpa_fid_ep* ep, const void* buf, size_t len);
+
+#endif
@@ -55,6 +55,16 @@ extern slist free_msg_queue_entries;
 static int progress_pep_eq(dpa_fid_pep *pep, int timeout_millis);
 static int progress_ep_eq(dpa_fid_ep *ep, int timeout_millis);
 
+// once connected, the endpoint has nothing left to progress on its event queue
+static int ep_eq_pending(dpa_fid_ep* ep) {
+  return !ep->connected;
+}
+
+static inline int bind_eq_progress(dpa_fid_ep* ep) {
+  return queue_progress_bind(&ep->eq->progress, (progress_queue_t) progress_ep_eq,
+                             (progress_pending_t) ep_eq_pending, ep, 0);
+}
+
 int dpa_listen(struct fid_pep *pep) {
   dpa_fid_pep* pep_priv = container_of(pep, dpa_fid_pep, pep);
   if (!pep_priv->eq) return -FI_ENOEQ;
@@ -67,10 +77,8 @@ int dpa_listen(struct fid_pep *pep) {
     return -FI_EADDRINUSE;
   else if (error != DPA_ERR_OK)
     return -FI_EOTHER;
-  pep_priv->eq->progress.func = (progress_queue_t) progress_pep_eq;
-  pep_priv->eq->progress.arg = pep_priv;
-  
-  return FI_SUCCESS;
+  return queue_progress_bind(&pep_priv->eq->progress, (progress_queue_t) progress_pep_eq,
+                             NULL, pep_priv, 0);
 }
 
 
@@ -78,9 +86,7 @@ int dpa_accept(struct fid_ep *ep, const void *param, size_t paramlen) {
   dpa_fid_ep* ep_priv = container_of(ep, dpa_fid_ep, ep);
   if (accept_msg(ep_priv) != DPA_ERR_OK) return -FI_ECONNABORTED;
   
-  ep_priv->eq->progress.func = (progress_queue_t) progress_ep_eq;
-  ep_priv->eq->progress.arg = ep_priv;
-  return FI_SUCCESS;
+  return bind_eq_progress(ep_priv);
 }
 
 int dpa_connect(struct fid_ep *ep, const void *addr,
@@ -92,9 +98,7 @@ int dpa_connect(struct fid_ep *ep, const void *addr,
   dpa_error_t error = ctrl_connect_msg(ep_priv);
   if (error != DPA_ERR_OK) return -FI_ECONNABORTED;
   
-  ep_priv->eq->progress.func = (progress_queue_t) progress_ep_eq;
-  ep_priv->eq->progress.arg = ep_priv;
-  return FI_SUCCESS;
+  return bind_eq_progress(ep_priv);
 }
 
 int dpa_shutdown(struct fid_ep *ep, uint64_t flags) {
@@ -46,14 +46,17 @@
  */
 #include "dpa_cntr.h"
 #include "dpa_domain.h"
+#include "dpa_mr.h"
+#include "dpa_rma.h"
 #include "dpa.h"
 
 int dpa_cntr_close(struct fid* fid);
+static int dpa_cntr_control(struct fid* fid, int command, void* arg);
 static struct fi_ops dpa_cntr_fi_ops = {
   .size = sizeof(struct fi_ops),
   .close = dpa_cntr_close,
   .bind = fi_no_bind,
-  .control = fi_no_control,
+  .control = dpa_cntr_control,
   .ops_open = fi_no_ops_open
 };
 
@@ -91,12 +94,20 @@ static struct fi_ops_cntr dpa_fi_ops_cntr_safe = {
 int dpa_cntr_open(struct fid_domain *domain, struct fi_cntr_attr *attr,
                  struct fid_cntr **cntr, void *context){
   if (attr && attr->wait_obj != FI_WAIT_NONE
-      && attr->wait_obj != FI_WAIT_UNSPEC) {
-    DPA_WARN("Counter wait object can be only FI_WAIT_NONE"
-             "or FI_WAIT_UNSPEC");
+      && attr->wait_obj != FI_WAIT_UNSPEC && attr->wait_obj != FI_WAIT_FD
+      && attr->wait_obj != FI_WAIT_SET) {
+    DPA_WARN("Counter wait object can be only FI_WAIT_NONE, "
+             "FI_WAIT_UNSPEC, FI_WAIT_FD or FI_WAIT_SET");
     return -FI_EINVAL;
   }
+  if (attr && attr->wait_obj == FI_WAIT_SET && !attr->wait_set)
+    return -FI_EINVAL;
   dpa_fid_domain* domain_priv = container_of(domain, dpa_fid_domain, domain);
+  // nothing would signal the fd while the application sleeps on it
+  if (attr && attr->wait_obj == FI_WAIT_FD && !domain_async_progress(domain_priv)) {
+    DPA_WARN("FI_WAIT_FD needs FI_PROGRESS_AUTO or progress threads\n");
+    return -FI_ENOSYS;
+  }
   dpa_fid_cntr* cntr_priv = ALLOC_INIT(dpa_fid_cntr, {
       .cntr = {
         .fid = {
@@ -107,13 +118,25 @@ int dpa_cntr_open(struct fid_domain *domain, struct fi_cntr_attr *attr,
       },
       .domain = domain_priv,
       .wait_obj = attr ? attr->wait_obj : FI_WAIT_UNSPEC,
+      .wait_set = NULL,
+      .waiters = 0,
   });
         
   cntr_priv->cntr.fid.fclass = FI_CLASS_CNTR;
   cntr_priv->cntr.fid.context = context;
   cntr_priv->cntr.fid.ops = &dpa_cntr_fi_ops;
   queue_progress_init(&cntr_priv->progress);
-  if (domain_priv->threading >= FI_THREAD_COMPLETION) {
+  fastlock_init(&cntr_priv->lock);
+  fastlock_cond_init(&cntr_priv->cond);
+  wait_fd_init(&cntr_priv->wait_fd);
+  if (attr && attr->wait_obj == FI_WAIT_FD && wait_fd_open(&cntr_priv->wait_fd)) {
+    DPA_WARN("Cannot create counter wait fd\n");
+    free(cntr_priv);
+    return -FI_ENOSYS;
+  }
+  // provider threads update counters concurrently with the application
+  if (domain_priv->threading >= FI_THREAD_COMPLETION &&
+      !domain_async_producers(domain_priv)) {
     cntr_priv->counter = 0;
     cntr_priv->err = 0;
     cntr_priv->cntr.ops = &dpa_fi_ops_cntr_unsafe;
@@ -126,23 +149,61 @@ int dpa_cntr_open(struct fid_domain *domain, struct fi_cntr_attr *attr,
     cntr_priv->inc = dpa_cntr_inc_safe;
     cntr_priv->err_inc = dpa_cntr_err_inc_safe;
   }
+  // members are read through their ops, so join the set last
+  if (attr && attr->wait_obj == FI_WAIT_SET &&
+      wait_set_add(attr->wait_set, &cntr_priv->cntr.fid, &cntr_priv->wait_set)) {
+    queue_progress_destroy(&cntr_priv->progress);
+    free(cntr_priv);
+    return -FI_EINVAL;
+  }
   *cntr = &cntr_priv->cntr;
   return FI_SUCCESS;
 }
 
 int dpa_cntr_close(struct fid* fid) {
-  free(container_of(fid, dpa_fid_cntr, cntr.fid));
+  dpa_fid_cntr* cntr_priv = container_of(fid, dpa_fid_cntr, cntr.fid);
+  wait_set_del(cntr_priv->wait_set, fid);
+  queue_progress_destroy(&cntr_priv->progress);
+  fastlock_cond_destroy(&cntr_priv->cond);
+  fastlock_destroy(&cntr_priv->lock);
+  wait_fd_close(&cntr_priv->wait_fd);
+  free(cntr_priv);
+  return FI_SUCCESS;
+}
+
+static int dpa_cntr_control(struct fid* fid, int command, void* arg) {
+  dpa_fid_cntr* cntr_priv = container_of(fid, dpa_fid_cntr, cntr.fid);
+  switch (command) {
+  case FI_GETWAIT:
+    return wait_fd_get(&cntr_priv->wait_fd, arg);
+  default:
+    return -FI_ENOSYS;
+  }
+}
+
+
+static inline void make_cntr_progress(dpa_fid_cntr* cntr) {
+  make_queue_progress(&cntr->progress, 0);
+  mr_progress_domain_events(cntr->domain);
+  rma_reclaim(cntr->domain);
+}
+
+// counters have no threshold here, arming is all there is to do
+int cntr_trywait(dpa_fid_cntr* cntr) {
+  if (cntr->wait_fd.fd < 0) return -FI_EINVAL;
+  make_cntr_progress(cntr);
+  wait_fd_arm(&cntr->wait_fd);
   return FI_SUCCESS;
 }
 
 uint64_t dpa_cntr_read_unsafe(struct fid_cntr *fid_cntr){
   dpa_fid_cntr* cntr = container_of(fid_cntr, dpa_fid_cntr, cntr);
-  make_queue_progress(&cntr->progress, 0);
+  make_cntr_progress(cntr);
   return cntr->counter;
 }
 uint64_t dpa_cntr_readerr_unsafe(struct fid_cntr *fid_cntr){
   dpa_fid_cntr* cntr = container_of(fid_cntr, dpa_fid_cntr, cntr);
-  make_queue_progress(&cntr->progress, 0);
+  make_cntr_progress(cntr);
   return cntr->err;
 }
 int dpa_cntr_add_unsafe(struct fid_cntr *cntr, uint64_t value){
@@ -163,12 +224,12 @@ int dpa_cntr_set_unsafe(struct fid_cntr *cntr, uint64_t value){
 
 uint64_t dpa_cntr_read_safe(struct fid_cntr *fid_cntr){
   dpa_fid_cntr* cntr = container_of(fid_cntr, dpa_fid_cntr, cntr);
-  make_queue_progress(&cntr->progress, 0);
+  make_cntr_progress(cntr);
   return atomic_get(&cntr->counter_atomic);
 }
 uint64_t dpa_cntr_readerr_safe(struct fid_cntr *fid_cntr){
   dpa_fid_cntr* cntr = container_of(fid_cntr, dpa_fid_cntr, cntr);
-  make_queue_progress(&cntr->progress, 0);
+  make_cntr_progress(cntr);
   return atomic_get(&cntr->err_atomic);
 }
 int dpa_cntr_add_safe(struct fid_cntr *cntr, uint64_t value){
@@ -187,13 +248,76 @@ int dpa_cntr_set_safe(struct fid_cntr *cntr, uint64_t value){
 }
 
 
+// longest sleep between polls of the domain events feeding the counter
+#ifndef CNTR_WAIT_SLICE
+#define CNTR_WAIT_SLICE 1
+#endif
+
+typedef struct cntr_wait_cond {
+  dpa_fid_cntr* cntr;
+  uint64_t threshold;
+  uint64_t err;
+} cntr_wait_cond;
+
+// current values, without making progress
+static inline uint64_t cntr_value(dpa_fid_cntr* cntr) {
+  return cntr->cntr.ops == &dpa_fi_ops_cntr_safe
+    ? (uint64_t) atomic_get(&cntr->counter_atomic) : cntr->counter;
+}
+
+static inline uint64_t cntr_errors(dpa_fid_cntr* cntr) {
+  return cntr->cntr.ops == &dpa_fi_ops_cntr_safe
+    ? (uint64_t) atomic_get(&cntr->err_atomic) : cntr->err;
+}
+
+static int cntr_reached(void* arg) {
+  cntr_wait_cond* cond = arg;
+  return cntr_value(cond->cntr) >= cond->threshold ||
+    cntr_errors(cond->cntr) != cond->err;
+}
+
+static int cntr_progress_reached(void* arg) {
+  make_cntr_progress(((cntr_wait_cond*) arg)->cntr);
+  return cntr_reached(arg);
+}
+
+/**
+ * Sleep until the condition holds or the timeout expires. Unless progress
+ * workers are running, domain events are only seen when polled, so sleep
+ * a slice at a time and poll them in between.
+ */
+static void cntr_block(cntr_wait_cond* cond, int timeout) {
+  dpa_fid_cntr* cntr = cond->cntr;
+  int sliced = !cntr->domain->progress_engine.running;
+  int64_t deadline = deadline_usec(timeout);
+  while (!cntr_progress_reached(cond) && (timeout = remaining_msec(deadline))) {
+    if (sliced && (timeout < 0 || timeout > CNTR_WAIT_SLICE))
+      timeout = CNTR_WAIT_SLICE;
+    fastlock_acquire(&cntr->lock);
+    __atomic_add_fetch(&cntr->waiters, 1, __ATOMIC_SEQ_CST);
+    if (!cntr_reached(cond))
+      fastlock_wait_timeout(&cntr->cond, &cntr->lock, timeout);
+    __atomic_sub_fetch(&cntr->waiters, 1, __ATOMIC_SEQ_CST);
+    fastlock_release(&cntr->lock);
+  }
+}
+
 int dpa_cntr_wait(struct fid_cntr *fid_cntr, uint64_t threshold, int timeout) {
   dpa_fid_cntr* cntr = container_of(fid_cntr, dpa_fid_cntr, cntr);
-  struct fi_ops_cntr* ops = cntr->cntr.ops;
-  int err = ops->readerr(fid_cntr);
-  while(timeout != 0 && ops->read(fid_cntr) < threshold
-        && ops->readerr(fid_cntr) == err)
-    timeout = make_queue_progress(&cntr->progress, timeout);
-  return (timeout == 0 && cntr->counter < threshold)
-    ? -FI_ETIMEDOUT : 0;
+  cntr_wait_cond cond = {
+    .cntr = cntr,
+    .threshold = threshold,
+    .err = cntr->cntr.ops->readerr(fid_cntr)
+  };
+  if (queue_progress_bound(&cntr->progress)) {
+    int64_t deadline = deadline_usec(timeout);
+    while (!cntr_progress_reached(&cond) && (timeout = remaining_msec(deadline)))
+      make_queue_progress(&cntr->progress, timeout);
+  } else if (!fastlock_spin(cntr_progress_reached, &cond, WAIT_SPIN_USEC, &timeout) &&
+             timeout) {
+    cntr_block(&cond, timeout);
+  }
+  // an error ends the wait whether or not the threshold was reached
+  if (cntr_errors(cntr) != cond.err) return -FI_EAVAIL;
+  return cntr_reached(&cond) ? 0 : -FI_ETIMEDOUT;
 }
@@ -52,6 +52,7 @@ typedef struct dpa_fid_cntr dpa_fid_cntr;
 #include "dpa.h"
 #include "locks.h"
 #include "dpa_eq.h"
+#include "dpa_wait.h"
 #include "dpa_domain.h"
 
 struct dpa_fid_cntr {
@@ -64,18 +65,39 @@ struct dpa_fid_cntr {
   atomic_t counter_atomic;
   atomic_t err_atomic;
   queue_progress progress;
+  // threads blocked in fi_cntr_wait with automatic progress
+  fastlock_t lock;
+  fastlock_cond_t cond;
+  int waiters;
+  queue_wait_fd wait_fd;
+  dpa_fid_wait* wait_set;
   enum fi_wait_obj wait_obj;
 };
 
 int dpa_cntr_open(struct fid_domain *domain, struct fi_cntr_attr *attr,
                  struct fid_cntr **cntr, void *context);
 
+int cntr_trywait(dpa_fid_cntr* cntr);
+
+static inline void cntr_signal(dpa_fid_cntr* cntr) {
+  wait_fd_signal(&cntr->wait_fd);
+  wait_set_signal(cntr->wait_set);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&cntr->waiters, __ATOMIC_SEQ_CST)) return;
+  // each waiter has its own threshold, let all of them check
+  fastlock_acquire(&cntr->lock);
+  fastlock_signal_all(&cntr->cond);
+  fastlock_release(&cntr->lock);
+}
+
 static inline void dpa_cntr_inc(dpa_fid_cntr* cntr) {
   cntr->inc(cntr);
+  cntr_signal(cntr);
 }
 
 static inline void dpa_cntr_err_inc(dpa_fid_cntr* cntr) {
   cntr->err_inc(cntr);
+  cntr_signal(cntr);
 }
 #endif
 
@@ -34,8 +34,11 @@
 
 #include "dpa.h"
 #include "dpa_cq.h"
+#include "dpa_rma.h"
+#include "dpa_numa.h"
 
 static int dpa_cq_close(struct fid* fid);
+static int dpa_cq_control(struct fid* fid, int command, void* arg);
 static int dpa_cq_wait_data(struct fid_cq* cq, uint64_t* data, uint64_t flags);
 static int dpa_cq_ops_open(struct fid *fid, const char *name,
                            uint64_t flags, void **ops, void *context);
@@ -48,7 +51,7 @@ static struct fi_ops dpa_fid_cq_ops = {
   .size = sizeof(struct fi_ops),
   .close = dpa_cq_close,
   .bind = fi_no_bind,
-  .control = fi_no_control,
+  .control = dpa_cq_control,
   .ops_open = dpa_cq_ops_open
 };
 
@@ -71,6 +74,10 @@ struct fi_ops_cq dpa_cq_ops = {
   .strerror = dpa_cq_strerror
 };
 
+#ifndef CQ_DEFAULT_SIZE
+#define CQ_DEFAULT_SIZE 1024
+#endif
+
 int format_size(enum fi_cq_format format){
   switch(format){
 
@@ -89,6 +96,40 @@ int format_size(enum fi_cq_format format){
     return sizeof(struct fi_cq_msg_entry);
   }
 }
+
+static inline size_t ring_capacity(size_t size) {
+  size_t capacity = 1;
+  while (capacity < size) capacity <<= 1;
+  return capacity;
+}
+
+static int cq_ring_alloc(dpa_fid_cq* cq, size_t capacity) {
+  void* ring = numa_calloc(capacity * cq->entry_size, cq->numa_node);
+  fi_addr_t* ring_src = numa_calloc(capacity * sizeof(fi_addr_t), cq->numa_node);
+  if (!ring || !ring_src) {
+    free(ring);
+    free(ring_src);
+    return -FI_ENOMEM;
+  }
+  // move pending completions to the start of the new ring
+  size_t count = cq->tail - cq->head;
+  size_t first = cq->head & cq->ring_mask;
+  size_t run = MIN(count, cq->ring_mask + 1 - first);
+  if (count) {
+    memcpy(ring, cq->ring + first * cq->entry_size, run * cq->entry_size);
+    memcpy(ring + run * cq->entry_size, cq->ring, (count - run) * cq->entry_size);
+    memcpy(ring_src, cq->ring_src + first, run * sizeof(fi_addr_t));
+    memcpy(ring_src + run, cq->ring_src, (count - run) * sizeof(fi_addr_t));
+  }
+  free(cq->ring);
+  free(cq->ring_src);
+  cq->ring = ring;
+  cq->ring_src = ring_src;
+  cq->ring_mask = capacity - 1;
+  cq->head = 0;
+  cq->tail = count;
+  return FI_SUCCESS;
+}
     
   
 
@@ -100,12 +141,29 @@ int dpa_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr, struct fid_c
   case FI_WAIT_NONE:
   case FI_WAIT_UNSPEC:
     break;
+  case FI_WAIT_FD:
+    // nothing would signal the fd while the application sleeps on it
+    if (!domain_async_progress(container_of(domain, dpa_fid_domain, domain))) {
+      DPA_WARN("FI_WAIT_FD needs FI_PROGRESS_AUTO or progress threads\n");
+      return -FI_ENOSYS;
+    }
+    break;
+  case FI_WAIT_SET:
+    if (!attr->wait_set) return -FI_EINVAL;
+    break;
   default:
     VERIFY_FAIL(attr->wait_obj, FI_WAIT_NONE);
   };
+  if (attr->wait_cond != FI_CQ_COND_NONE && attr->wait_cond != FI_CQ_COND_THRESHOLD)
+    VERIFY_FAIL(attr->wait_cond, FI_CQ_COND_THRESHOLD);
   int entry_size = format_size(attr->format);
 
   DPA_DEBUG("Building completion queue\n");
+  dpa_fid_domain* domain_priv = container_of(domain, dpa_fid_domain, domain);
+  int async_producers = domain_async_producers(domain_priv);
+  int spsc = (attr->flags & FI_DPA_CQ_SPSC) && !async_producers;
+  if ((attr->flags & FI_DPA_CQ_SPSC) && !spsc)
+    DPA_INFO("Provider progress threads add completions, using a locked queue\n");
   dpa_fid_cq* cq_priv = ALLOC_INIT(dpa_fid_cq, {
       .cq = {
         .fid = {
@@ -115,119 +173,254 @@ int dpa_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr, struct fid_c
         },
         .ops = &dpa_cq_ops
       },
-      .progress = {
-        .func = NULL
-      },
       .interrupt = {
         .handle = NULL
       },
       .entry_size = entry_size,
-      .domain = container_of(domain, dpa_fid_domain, domain),
+      .domain = domain_priv,
       .wait_obj = attr->wait_obj,
+      .ring = NULL,
+      .ring_src = NULL,
+      .ring_mask = 0,
+      .head = 0,
+      .tail = 0,
+      .spsc = spsc,
+      // the ring may grow under a reader when provider threads add completions
+      .lock_needed = domain_priv->threading < FI_THREAD_COMPLETION || async_producers,
+      .overruns = 0,
+      .waiters = 0,
+      .wake_threshold = 1,
+      .forced_wakeups = 0,
+      .wait_cond = attr->wait_cond,
+      .wait_set = NULL,
   });
 
+  // completions are written by progress but consumed by the opening thread
+  cq_priv->numa_node = numa_resolve(cq_priv->domain->numa.queue_node);
+  size_t capacity = ring_capacity(attr->size ? attr->size : CQ_DEFAULT_SIZE);
+  if (cq_ring_alloc(cq_priv, capacity)) {
+    DPA_WARN("Out of memory\n");
+    free(cq_priv);
+    return -FI_ENOMEM;
+  }
+  DPA_DEBUG("%s completion queue of %zu entries on NUMA node %d\n",
+            cq_priv->spsc ? "Lock-free" : "Locked", capacity, cq_priv->numa_node);
+
+  wait_fd_init(&cq_priv->wait_fd);
+  if (attr->wait_obj == FI_WAIT_FD && wait_fd_open(&cq_priv->wait_fd)) {
+    DPA_WARN("Cannot create completion queue wait fd\n");
+    free(cq_priv->ring);
+    free(cq_priv->ring_src);
+    free(cq_priv);
+    return -FI_ENOSYS;
+  }
+  if (attr->wait_obj == FI_WAIT_SET &&
+      wait_set_add(attr->wait_set, &cq_priv->cq.fid, &cq_priv->wait_set)) {
+    free(cq_priv->ring);
+    free(cq_priv->ring_src);
+    free(cq_priv);
+    return -FI_EINVAL;
+  }
   queue_progress_init(&cq_priv->progress);
   queue_interrupt_init(&cq_priv->interrupt);
-  slist_init(&cq_priv->event_queue);
   slist_init(&cq_priv->error_queue);
-  slist_init(&cq_priv->free_list);
+  fastlock_init(&cq_priv->lock);
   fastlock_cond_init(&cq_priv->cond);
-
-  for (int i = 0; i < attr->size; i++) {
-    struct dpa_cq_event *event = calloc(1, sizeof(struct dpa_cq_event));
-    if (!event) {
-      DPA_WARN("Out of memory\n");
-      return -FI_ENOMEM;
-    }
-    slist_insert_tail_unsafe(&event->list_entry, &cq_priv->free_list);
-  }
   
   *cq = &(cq_priv->cq);
   return 0;
 }
 
-static void free_cq(struct slist* cq){
-  slist_destroy(cq, dpa_cq_event, list_entry, no_destroyer);
-}
-
 static int dpa_cq_close(struct fid* fid) {
   DPA_DEBUG("Closing completion queue\n");
   dpa_fid_cq* cq_priv = container_of(fid, dpa_fid_cq, cq.fid);
-  free_cq(&cq_priv->event_queue);
-  free_cq(&cq_priv->error_queue);
-  free_cq(&cq_priv->free_list);
+  if (cq_priv->overruns)
+    DPA_WARN("Completion queue overrun, %zu completions reported as errors\n", cq_priv->overruns);
+  wait_set_del(cq_priv->wait_set, fid);
+  slist_destroy(&cq_priv->error_queue, dpa_cq_error, list_entry, no_destroyer);
+  fastlock_destroy(&cq_priv->lock);
+  queue_progress_destroy(&cq_priv->progress);
+  wait_fd_close(&cq_priv->wait_fd);
+  free(cq_priv->ring);
+  free(cq_priv->ring_src);
   free(cq_priv);
 }
 
-static inline dpa_cq_event* get_empty_event(dpa_fid_cq* cq) {
-  slist_entry* entry = slist_remove_head_unsafe(&cq->free_list);
-  return entry
-    ? container_of(entry, dpa_cq_event, list_entry)
-    : calloc(1, sizeof(dpa_cq_event));
-}
-
 static inline void cq_lock(dpa_fid_cq* cq) {
-  if (cq->domain->threading < FI_THREAD_COMPLETION)
-    fastlock_acquire(&cq->free_list.lock);
+  if (cq->lock_needed)
+    fastlock_acquire(&cq->lock);
 }
 
 static inline void cq_unlock(dpa_fid_cq* cq) {
-  if (cq->domain->threading < FI_THREAD_COMPLETION)
-    fastlock_release(&cq->free_list.lock);
+  if (cq->lock_needed)
+    fastlock_release(&cq->lock);
 }
 
-static inline int cq_wait(dpa_fid_cq* cq, int timeout) {
-  cq_lock(cq);
-  int result = fastlock_wait_timeout(&cq->cond, &cq->free_list.lock, timeout);
-  cq_unlock(cq);
+static inline int cq_empty(dpa_fid_cq* cq) {
+  return __atomic_load_n(&cq->tail, __ATOMIC_SEQ_CST) == cq->head;
+}
+
+// errors are never held back by a threshold
+static inline int cq_reached(dpa_fid_cq* cq, size_t threshold) {
+  return __atomic_load_n(&cq->tail, __ATOMIC_SEQ_CST) -
+    __atomic_load_n(&cq->head, __ATOMIC_SEQ_CST) >= threshold ||
+    !slist_empty(&cq->error_queue);
+}
+
+typedef struct cq_wait_cond {
+  dpa_fid_cq* cq;
+  size_t threshold;
+} cq_wait_cond;
+
+static int cq_wait_reached(void* arg) {
+  cq_wait_cond* cond = arg;
+  return cq_reached(cond->cq, cond->threshold);
+}
+
+/**
+ * Waiters publish their threshold and register themselves before checking
+ * the queue once more, so producers only need to signal when the count is
+ * not zero and the least demanding waiter has enough entries.
+ */
+static inline int cq_wait(dpa_fid_cq* cq, size_t threshold, int timeout) {
+  cq_wait_cond cond = {
+    .cq = cq,
+    .threshold = threshold
+  };
+  // spin briefly first, a completion is often just about to land
+  if (fastlock_spin(cq_wait_reached, &cond, WAIT_SPIN_USEC, &timeout) || !timeout)
+    return 0;
+  int64_t deadline = deadline_usec(timeout);
+  int result = 0;
+  fastlock_acquire(&cq->lock);
+  size_t forced = cq->forced_wakeups;
+  __atomic_store_n(&cq->wake_threshold, cq->waiters
+                   ? MIN(cq->wake_threshold, threshold) : threshold, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&cq->waiters, 1, __ATOMIC_SEQ_CST);
+  while (!cq_reached(cq, threshold) && cq->forced_wakeups == forced &&
+         result != ETIMEDOUT && (timeout = remaining_msec(deadline)))
+    result = fastlock_wait_timeout(&cq->cond, &cq->lock, timeout);
+  __atomic_sub_fetch(&cq->waiters, 1, __ATOMIC_SEQ_CST);
+  fastlock_release(&cq->lock);
+  return result;
+}
+
+// forced wakeups come from fi_cq_signal and end every wait
+static inline int cq_wake(dpa_fid_cq* cq, int force) {
+  wait_fd_signal(&cq->wait_fd);
+  wait_set_signal(cq->wait_set);
+  if (queue_progress_bound(&cq->progress) || cq->interrupt.handle) return 0;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&cq->waiters, __ATOMIC_SEQ_CST)) return 0;
+  if (!force && !cq_reached(cq, __atomic_load_n(&cq->wake_threshold, __ATOMIC_SEQ_CST)))
+    return 0;
+  fastlock_acquire(&cq->lock);
+  if (force) cq->forced_wakeups++;
+  // waiters may have different thresholds, each one checks its own
+  int result = fastlock_signal_all(&cq->cond);
+  fastlock_release(&cq->lock);
   return result;
 }
 
 static inline int cq_signal(dpa_fid_cq* cq) {
-  if (!(cq->progress.func || cq->interrupt.handle))
-    return fastlock_signal(&cq->cond);
-  else return 0;
+  return cq_wake(cq, 0);
 }
 
-void cq_add_src(dpa_fid_cq* cq, struct fi_cq_err_entry* entry, fi_addr_t src_addr) {
-  DPA_DEBUG("Adding item to completion queue\n");
+static inline void cq_add_error(dpa_fid_cq* cq, struct fi_cq_err_entry* entry,
+                                fi_addr_t src_addr) {
+  dpa_cq_error* error = calloc(1, sizeof(dpa_cq_error));
+  if (!error) {
+    DPA_WARN("Out of memory, error completion lost\n");
+    return;
+  }
+  memcpy(&error->entry, entry, sizeof(struct fi_cq_err_entry));
+  error->src_addr = src_addr;
+  fastlock_acquire(&cq->lock);
+  slist_insert_tail_unsafe(&error->list_entry, &cq->error_queue);
+  fastlock_release(&cq->lock);
+}
 
-  cq_lock(cq);
+// the formats are prefixes of fi_cq_err_entry
+static inline void cq_ring_put(dpa_fid_cq* cq, size_t slot,
+                               struct fi_cq_err_entry* entry, fi_addr_t src_addr) {
+  memcpy(cq->ring + slot * cq->entry_size, entry, cq->entry_size);
+  cq->ring_src[slot] = src_addr;
+}
 
-  dpa_cq_event* event = get_empty_event(cq);
-  memcpy(&(event->entry), entry, sizeof(struct fi_cq_err_entry));
-  event->src_addr = src_addr;
-  slist* queue = entry->err ? &(cq->error_queue) : &(cq->event_queue);
-  slist_insert_tail_unsafe(&(event->list_entry), queue);
+static inline void cq_add_spsc(dpa_fid_cq* cq, struct fi_cq_err_entry* entry,
+                               fi_addr_t src_addr) {
+  size_t tail = cq->tail;
+  /* the ring cannot grow under a concurrent reader: the completion is
+   * reported as an overrun error, its context still reaches the caller */
+  if (tail - __atomic_load_n(&cq->head, __ATOMIC_ACQUIRE) > cq->ring_mask) {
+    if (!cq->overruns++)
+      DPA_WARN("Completion queue full, completions reported as overruns\n");
+    struct fi_cq_err_entry overrun = *entry;
+    overrun.err = FI_EOVERFLOW;
+    cq_add_error(cq, &overrun, src_addr);
+    return;
+  }
+  cq_ring_put(cq, tail & cq->ring_mask, entry, src_addr);
+  __atomic_store_n(&cq->tail, tail + 1, __ATOMIC_RELEASE);
+}
 
+static inline void cq_add_locked(dpa_fid_cq* cq, struct fi_cq_err_entry* entry,
+                                 fi_addr_t src_addr) {
+  cq_lock(cq);
+  if (cq->tail - cq->head <= cq->ring_mask ||
+      !cq_ring_alloc(cq, (cq->ring_mask + 1) << 1)) {
+    cq_ring_put(cq, cq->tail & cq->ring_mask, entry, src_addr);
+    __atomic_store_n(&cq->tail, cq->tail + 1, __ATOMIC_RELEASE);
+  } else DPA_WARN("Out of memory, completion lost\n");
   cq_unlock(cq);
+}
+
+void cq_add_src(dpa_fid_cq* cq, struct fi_cq_err_entry* entry, fi_addr_t src_addr) {
+  DPA_DEBUG("Adding item to completion queue\n");
+
+  if (entry->err)
+    cq_add_error(cq, entry, src_addr);
+  else if (cq->spsc)
+    cq_add_spsc(cq, entry, src_addr);
+  else
+    cq_add_locked(cq, entry, src_addr);
 
   cq_signal(cq);
 }
 
-static inline ssize_t cq_read_priv(dpa_fid_cq* cq, struct slist* event_queue,
-                                   size_t entry_size, void* buf,
+static inline ssize_t cq_read_priv(dpa_fid_cq* cq, void* buf,
                                    fi_addr_t* src_addr, size_t count) {
-  cq_lock(cq);
-
-  int i;
-  for(i = 0; i<count; i++) {
-    slist_entry* list_entry = slist_remove_head_unsafe(event_queue);
-    if (!list_entry)
-      break;
-
-    dpa_cq_event* head = container_of(list_entry, dpa_cq_event, list_entry);
-    memcpy(buf, &head->entry, entry_size);
-    buf += entry_size;
-    if (src_addr) {
-      memcpy(src_addr, &head->src_addr, sizeof(fi_addr_t));
-      src_addr++;
-    }
-    slist_insert_tail_unsafe(&head->list_entry, &cq->free_list);
+  if (!cq->spsc) cq_lock(cq);
+
+  size_t entry_size = cq->entry_size;
+  count = MIN(count, __atomic_load_n(&cq->tail, __ATOMIC_ACQUIRE) - cq->head);
+  // at most two contiguous runs, split where the ring wraps
+  size_t first = cq->head & cq->ring_mask;
+  size_t run = MIN(count, cq->ring_mask + 1 - first);
+  memcpy(buf, cq->ring + first * entry_size, run * entry_size);
+  memcpy(buf + run * entry_size, cq->ring, (count - run) * entry_size);
+  if (src_addr) {
+    memcpy(src_addr, cq->ring_src + first, run * sizeof(fi_addr_t));
+    memcpy(src_addr + run, cq->ring_src, (count - run) * sizeof(fi_addr_t));
   }
-  
-  cq_unlock(cq);
-  return i > 0 ? i : -FI_EAGAIN;
+  __atomic_store_n(&cq->head, cq->head + count, __ATOMIC_RELEASE);
+
+  if (!cq->spsc) cq_unlock(cq);
+  if (count) return count;
+  // an error ends waits like a completion does, the reader must learn of it
+  return slist_empty(&cq->error_queue) ? -FI_EAGAIN : -FI_EAVAIL;
+}
+
+static inline ssize_t cq_read_error(dpa_fid_cq* cq, struct fi_cq_err_entry* buf) {
+  fastlock_acquire(&cq->lock);
+  slist_entry* list_entry = slist_remove_head_unsafe(&cq->error_queue);
+  fastlock_release(&cq->lock);
+  if (!list_entry) return -FI_EAGAIN;
+
+  dpa_cq_error* error = container_of(list_entry, dpa_cq_error, list_entry);
+  memcpy(buf, &error->entry, sizeof(struct fi_cq_err_entry));
+  free(error);
+  return 1;
 }
 
 static ssize_t dpa_cq_read(struct fid_cq *cq, void *buf, size_t count){
@@ -241,38 +434,50 @@ static inline ssize_t dpa_cq_readfrom(struct fid_cq *cq, void *buf, size_t count
 static ssize_t dpa_cq_readerr(struct fid_cq *cq, struct fi_cq_err_entry *buf, uint64_t flags){
   DPA_DEBUG("Reading from error queue\n");
   dpa_fid_cq* cq_priv = container_of(cq, dpa_fid_cq, cq);
-  return cq_read_priv(cq_priv, &cq_priv->error_queue, sizeof(struct fi_cq_err_entry), buf, NULL, 1);
+  return cq_read_error(cq_priv, buf);
 }
    
 static ssize_t dpa_cq_sread(struct fid_cq *cq, void *buf, size_t count, const void *cond, int timeout){
   return dpa_cq_sreadfrom(cq, buf, count, NULL, cond, timeout);
 }
 static inline void make_cq_progress(dpa_fid_cq* cq, int timeout);
+
+/**
+ * Entries sread waits for: the FI_CQ_COND_THRESHOLD condition when the
+ * queue was opened with it, but never more than fit in the caller's buffer
+ * or in a ring that cannot grow.
+ */
+static inline size_t cq_threshold(dpa_fid_cq* cq, const void* cond, size_t count) {
+  if (cq->wait_cond != FI_CQ_COND_THRESHOLD || !cond) return 1;
+  size_t threshold = MIN(*(const size_t*) cond, count);
+  if (cq->spsc) threshold = MIN(threshold, cq->ring_mask + 1);
+  return MAX(threshold, 1);
+}
+
 static inline ssize_t dpa_cq_sreadfrom(struct fid_cq *cq, void *buf, size_t count, fi_addr_t *src_addr, const void *cond, int timeout){
   DPA_DEBUG("Reading from completion queue with timeout %d\n", timeout);
   dpa_fid_cq* cq_priv = container_of(cq, dpa_fid_cq, cq);
 
+  size_t threshold = cq_threshold(cq_priv, cond, count);
+
   //start with immediate progress
   make_cq_progress(cq_priv, 0);
 
-  ssize_t result = cq_read_priv(cq_priv, &cq_priv->event_queue,
-                                cq_priv->entry_size, buf, src_addr, count);
-  if (result == -FI_EAGAIN && timeout) {
-    DPA_DEBUG("Await completion queue progress\n");
-    if (cq_priv->progress.func || cq_priv->interrupt.handle)
-      make_cq_progress(cq_priv, timeout);
-    else
-      cq_wait(cq_priv, timeout);
-
-    result = cq_read_priv(cq_priv, &cq_priv->event_queue,
-                          cq_priv->entry_size, buf, src_addr, count);
+  if (timeout && !cq_reached(cq_priv, threshold)) {
+    DPA_DEBUG("Await completion queue progress, %zu entries\n", threshold);
+    if (queue_progress_bound(&cq_priv->progress) || cq_priv->interrupt.handle) {
+      int64_t deadline = deadline_usec(timeout);
+      do make_cq_progress(cq_priv, timeout);
+      while (!cq_reached(cq_priv, threshold) && (timeout = remaining_msec(deadline)));
+    } else
+      cq_wait(cq_priv, threshold, timeout);
   }
 
-  return result;
+  return cq_read_priv(cq_priv, buf, src_addr, count);
 }
 
 static int dpa_cq_signal(struct fid_cq *cq){
-  return cq_signal(container_of(cq, dpa_fid_cq, cq));
+  return cq_wake(container_of(cq, dpa_fid_cq, cq), 1);
 }
 
 static const char* dpa_cq_strerror(struct fid_cq *cq, int prov_errno, const void *err_data,
@@ -328,9 +533,33 @@ static inline void wait_cq_interrupt(dpa_fid_cq* cq, int timeout) {
 
 static inline void make_cq_progress(dpa_fid_cq* cq, int timeout) {
   timeout = make_queue_progress(&cq->progress, timeout);
+  mr_progress_domain_events(cq->domain);
+  rma_reclaim(cq->domain);
   wait_cq_interrupt(cq, timeout);
 }
 
+static int dpa_cq_control(struct fid* fid, int command, void* arg) {
+  dpa_fid_cq* cq_priv = container_of(fid, dpa_fid_cq, cq.fid);
+  switch (command) {
+  case FI_GETWAIT:
+    return wait_fd_get(&cq_priv->wait_fd, arg);
+  default:
+    return -FI_ENOSYS;
+  }
+}
+
+int cq_trywait(dpa_fid_cq* cq) {
+  if (cq->wait_fd.fd < 0) return -FI_EINVAL;
+  make_cq_progress(cq, 0);
+  wait_fd_arm(&cq->wait_fd);
+  return cq_empty(cq) && slist_empty(&cq->error_queue) ? FI_SUCCESS : -FI_EAGAIN;
+}
+
+int cq_ready(dpa_fid_cq* cq) {
+  make_cq_progress(cq, 0);
+  return !cq_empty(cq) || !slist_empty(&cq->error_queue);
+}
+
 static int dpa_cq_ops_open(struct fid *fid, const char *name,
                            uint64_t flags, void **ops, void *context){
   if (strcmp(name, FI_DPA_CQ_OPS_OPEN)) return -FI_ENODATA;
@@ -31,7 +31,7 @@
  *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
  */
 typedef struct dpa_fid_cq dpa_fid_cq;
-typedef struct dpa_cq_event dpa_cq_event;
+typedef struct dpa_cq_error dpa_cq_error;
 
 #ifndef DPA_CQ_H
 #define DPA_CQ_H
@@ -40,22 +40,40 @@ typedef struct dpa_cq_event dpa_cq_event;
 #include "dpa_domain.h"
 #include "dpa.h"
 #include "dpa_eq.h"
+#include "dpa_wait.h"
   
 
 struct dpa_fid_cq {
   struct fid_cq cq;
   dpa_fid_domain* domain;
   fastlock_cond_t cond;
+  fastlock_t lock;
   size_t entry_size;
-  struct slist event_queue;
+  // ring of entry_size bytes completions, in the format requested at open
+  void* ring;
+  fi_addr_t* ring_src;
+  size_t ring_mask;
+  size_t head;
+  size_t tail;
+  // single producer, single consumer: indices are published without the lock
+  uint8_t spsc;
+  uint8_t lock_needed;
+  size_t overruns;
+  int waiters;
+  // entries the least demanding waiter needs before it is worth waking
+  size_t wake_threshold;
+  size_t forced_wakeups;
+  enum fi_cq_wait_cond wait_cond;
+  queue_wait_fd wait_fd;
+  dpa_fid_wait* wait_set;
+  int numa_node;
   struct slist error_queue;
-  struct slist free_list;
   queue_interrupt interrupt;
   queue_progress progress;
   enum fi_wait_obj wait_obj;
 };
 
-struct dpa_cq_event {
+struct dpa_cq_error {
   struct fi_cq_err_entry entry;
   fi_addr_t src_addr;
   struct slist_entry list_entry;
@@ -63,6 +81,8 @@ struct dpa_cq_event {
 
 int dpa_cq_open(struct fid_domain *domain, struct fi_cq_attr *attr, struct fid_cq **cq, void *context);
 void cq_add_src(dpa_fid_cq* cq, struct fi_cq_err_entry* entry, fi_addr_t src_addr);
+int cq_trywait(dpa_fid_cq* cq);
+int cq_ready(dpa_fid_cq* cq);
 
 
 static inline void cq_add(dpa_fid_cq* cq, struct fi_cq_err_entry* entry) {
@@ -34,13 +34,36 @@
 #include "dpa_ep.h"
 #include "dpa_domain.h"
 #include "dpa_cntr.h"
+#include "dpa_atomic.h"
+#include "dpa_rma.h"
+#include "dpa_mr.h"
+#include "dpa_env.h"
+#include "dpa_numa.h"
+#include "dpa_wait.h"
+
+#ifndef ADAPTER_NUMA_NODE_DEFAULT
+#define ADAPTER_NUMA_NODE_DEFAULT FI_DPA_NUMA_ANY
+#endif
+DEFINE_ENV_CONST(int, ADAPTER_NUMA_NODE, ADAPTER_NUMA_NODE_DEFAULT);
+#ifndef NUMA_LOCAL_QUEUES_DEFAULT
+#define NUMA_LOCAL_QUEUES_DEFAULT 1
+#endif
+DEFINE_ENV_CONST(int, NUMA_LOCAL_QUEUES, NUMA_LOCAL_QUEUES_DEFAULT);
+
+void dpa_domain_init() {
+  ENV_OVERRIDE_INT(ADAPTER_NUMA_NODE);
+  ENV_OVERRIDE_INT(NUMA_LOCAL_QUEUES);
+}
+
+static int dpa_domain_ops_open(struct fid *fid, const char *name,
+                               uint64_t flags, void **ops, void *context);
 
 static struct fi_ops dpa_fid_ops = {
   .size = sizeof(struct fi_ops),
   .close = dpa_domain_close,
   .bind = fi_no_bind,
   .control = fi_no_control,
-  .ops_open = fi_no_ops_open
+  .ops_open = dpa_domain_ops_open
 };
 
 static struct fi_ops_domain dpa_domain_ops = {
@@ -48,7 +71,11 @@ static struct fi_ops_domain dpa_domain_ops = {
   .av_open = dpa_av_open,
   .cq_open = dpa_cq_open,
   .endpoint = dpa_ep_open,
-  .cntr_open = dpa_cntr_open
+  .cntr_open = dpa_cntr_open,
+  .poll_open = dpa_poll_open,
+#if FI_MAJOR_VERSION > 1 || FI_MINOR_VERSION >= 6
+  .query_atomic = dpa_query_atomic,
+#endif
 };
 
 static struct fi_ops_mr dpa_mr_ops = {
@@ -90,13 +117,74 @@ int	dpa_domain_open(struct fid_fabric *fabric, struct fi_info *info, struct fid_
     .control_progress = control_progress,
     .data_progress = data_progress,
     .threading = threading,
+    .caps = info->caps ? info->caps : DPA_EP_MSG_CAP,
+    .rail_count = dpaRailCount,
+    .next_rail = 0,
+    .numa = {
+      .ring_node = ADAPTER_NUMA_NODE,
+      .queue_node = NUMA_LOCAL_QUEUES ? FI_DPA_NUMA_LOCAL : FI_DPA_NUMA_ANY,
+    },
   });
+  DPA_INFO("NUMA placement: rings on node %d, queues on node %d\n",
+           result->numa.ring_node, result->numa.queue_node);
+  dlist_init(&result->event_mrs);
+  slist_init(&result->rma_reclaim);
+  result->rma_reclaim_count = 0;
+  mr_cache_init(&result->mr_cache);
+  mr_pool_fill(numa_resolve(result->numa.ring_node));
+  progress_engine_start(&result->progress_engine, result);
 
   *dom = &(result->domain);
   return 0;
 }
 
+static inline int valid_numa_policy(int node) {
+  return node == FI_DPA_NUMA_ANY || node == FI_DPA_NUMA_LOCAL ||
+    (node >= 0 && node < DPA_NUMA_MAX_NODE);
+}
+
+static int dpa_domain_set_numa_policy(struct fid_domain* domain,
+                                      const struct fi_dpa_numa_policy* policy) {
+  if (!policy || !valid_numa_policy(policy->ring_node) ||
+      !valid_numa_policy(policy->queue_node))
+    return -FI_EINVAL;
+  dpa_fid_domain* domain_priv = container_of(domain, dpa_fid_domain, domain);
+  domain_priv->numa = *policy;
+  DPA_INFO("NUMA placement: rings on node %d, queues on node %d\n",
+           policy->ring_node, policy->queue_node);
+  return FI_SUCCESS;
+}
+
+static int dpa_domain_get_numa_policy(struct fid_domain* domain,
+                                      struct fi_dpa_numa_policy* policy) {
+  if (!policy) return -FI_EINVAL;
+  *policy = container_of(domain, dpa_fid_domain, domain)->numa;
+  return FI_SUCCESS;
+}
+
+static struct fi_dpa_ops_domain dpa_ops_domain = {
+  .size = sizeof(struct fi_dpa_ops_domain),
+  .set_numa_policy = dpa_domain_set_numa_policy,
+  .get_numa_policy = dpa_domain_get_numa_policy,
+};
+
+static int dpa_domain_ops_open(struct fid *fid, const char *name,
+                               uint64_t flags, void **ops, void *context) {
+  if (strcmp(name, FI_DPA_DOMAIN_OPS_OPEN)) return -FI_ENODATA;
+  *ops = &dpa_ops_domain;
+  return 0;
+}
+
 int dpa_domain_close(struct fid *fid){
   dpa_fid_domain* domain = container_of(fid, dpa_fid_domain, domain.fid);
+  progress_engine_stop(&domain->progress_engine);
+  rma_reclaim(domain);
+  mr_cache_fini(&domain->mr_cache);
+  for (size_t rail = 0; rail < domain->rail_count; rail++)
+    DPA_INFO("Rail %zu (adapter %u): %lu connections, %lu transfers, %lu bytes\n",
+             rail, dpaRails[rail], domain->rails[rail].connections,
+             domain->rails[rail].ops, domain->rails[rail].bytes);
+  fastlock_destroy(&domain->rma_reclaim.lock);
+  fastlock_destroy(&domain->event_mrs.lock);
   free(domain);
 }
@@ -35,6 +35,28 @@ typedef struct dpa_fid_domain dpa_fid_domain;
 #ifndef DPA_DOMAIN_H
 #define DPA_DOMAIN_H
 #include "dpa.h"
+#include "dpa_progress.h"
+
+typedef struct rail_stats {
+  uint64_t bytes;
+  uint64_t ops;
+  uint64_t connections;
+} rail_stats;
+
+/* Registration cache: registrations sorted by buffer address, plus the
+ * idle ones (no open handle) in least recently used order. */
+typedef struct mr_cache {
+  fastlock_t lock;
+  struct dpa_fid_mr** index;
+  size_t count;
+  size_t capacity;
+  size_t max_len;
+  dlist_entry lru;
+  size_t idle;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+} mr_cache;
 
 struct dpa_fid_domain {
   struct fid_domain domain;
@@ -43,9 +65,46 @@ struct dpa_fid_domain {
   enum fi_progress control_progress;
   enum fi_progress data_progress;
   enum fi_threading threading;
+  uint64_t caps;
+  dlist event_mrs;
+  slist rma_reclaim;
+  size_t rma_reclaim_count;
+  mr_cache mr_cache;
+  struct fi_dpa_numa_policy numa;
+  size_t rail_count;
+  size_t next_rail;
+  rail_stats rails[DPA_MAX_RAILS];
+  progress_engine progress_engine;
 };
 
+// rail for a new endpoint, round robin over the domain's adapters
+static inline size_t domain_next_rail(dpa_fid_domain* domain) {
+  return __atomic_fetch_add(&domain->next_rail, 1, __ATOMIC_RELAXED) % domain->rail_count;
+}
+
+/* whether provider threads (progress workers, DPAlib interrupt callbacks)
+ * may complete operations next to the application's own calls */
+static inline int domain_async_producers(dpa_fid_domain* domain) {
+  return domain->progress_engine.running || domain->data_progress == FI_PROGRESS_AUTO;
+}
+
+// whether anything progresses the domain while the application sleeps
+static inline int domain_async_progress(dpa_fid_domain* domain) {
+  return domain->progress_engine.running ||
+    (domain->data_progress == FI_PROGRESS_AUTO && PROGRESS_CALLBACKS);
+}
+
+static inline void rail_account(dpa_fid_domain* domain, size_t rail, size_t bytes) {
+  __atomic_add_fetch(&domain->rails[rail].bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&domain->rails[rail].ops, 1, __ATOMIC_RELAXED);
+}
+
+static inline void rail_connected(dpa_fid_domain* domain, size_t rail) {
+  __atomic_add_fetch(&domain->rails[rail].connections, 1, __ATOMIC_RELAXED);
+}
+
 int	dpa_domain_open(struct fid_fabric *fabric, struct fi_info *info, struct fid_domain **dom, void *context);
 int dpa_domain_close(struct fid* fid);
+void dpa_domain_init();
 
 #endif
@@ -37,15 +37,19 @@
 #include "dpa_cm.h"
 #include "dpa_msg.h"
 #include "dpa_rma.h"
+#include "dpa_atomic.h"
 
 static int dpa_ep_close(fid_t fid);
+static inline void unbind_progress(dpa_fid_ep* ep);
 static int dpa_ep_control(struct fid *fid, int command, void *arg);
 static int dpa_ep_bind(struct fid *fid, struct fid *bfid, uint64_t flags);
+static int dpa_ep_ops_open(struct fid *fid, const char *name,
+                           uint64_t flags, void **ops, void *context);
 struct fi_ops dpa_ep_fid_ops = {
   .close = dpa_ep_close,
   .bind = dpa_ep_bind,
   .control = dpa_ep_control,
-  .ops_open = fi_no_ops_open
+  .ops_open = dpa_ep_ops_open
 };
 
 struct fi_ops_ep dpa_ep_ops = {
@@ -92,9 +96,26 @@ struct fi_ops_rma dpa_rma_ops = {
   .write = dpa_write,
   .writev = dpa_writev,
   .writemsg = dpa_writemsg,
-  .inject = fi_no_rma_inject,
+  .inject = dpa_inject_write,
   .writedata = dpa_writedata,
-  .injectdata = fi_no_rma_injectdata
+  .injectdata = dpa_inject_writedata
+};
+
+struct fi_ops_atomic dpa_atomic_ops = {
+  .size = sizeof(struct fi_ops_atomic),
+  .write = dpa_atomic_write,
+  .writev = dpa_atomic_writev,
+  .writemsg = dpa_atomic_writemsg,
+  .inject = dpa_atomic_inject,
+  .readwrite = dpa_atomic_readwrite,
+  .readwritev = dpa_atomic_readwritev,
+  .readwritemsg = dpa_atomic_readwritemsg,
+  .compwrite = dpa_atomic_compwrite,
+  .compwritev = dpa_atomic_compwritev,
+  .compwritemsg = dpa_atomic_compwritemsg,
+  .writevalid = dpa_atomic_writevalid,
+  .readwritevalid = dpa_atomic_readwritevalid,
+  .compwritevalid = dpa_atomic_compwritevalid
 };
 
 static inline int can_msg(uint64_t caps) {
@@ -105,6 +126,11 @@ static inline int can_rma(uint64_t caps) {
   return caps & (FI_RMA);
 }
 
+// atomics travel on the message ring, so they need a connected endpoint
+static inline int can_atomic(uint64_t caps) {
+  return can_msg(caps) && (caps & FI_ATOMIC);
+}
+
 uint64_t check_ep_caps(uint64_t caps) {
   if ((caps & DPA_EP_MSG_CAP) != caps) {
     DPA_WARN("Unsupported capabilities. Use fi_getinfo to query about supported capabilities.\n");
@@ -142,7 +168,12 @@ int dpa_ep_open(struct fid_domain *domain, struct fi_info *info,
       .domain = domain_priv,
       .peer_addr = dest_addr,
       .connected = 0,
-      .lock_needed = domain_priv->threading < FI_THREAD_FID,
+      // provider threads share the queues with the application
+      .lock_needed = domain_priv->threading < FI_THREAD_FID ||
+                     domain_async_producers(domain_priv),
+      .progress_state = PROGRESS_DETACHED,
+      .numa_node = numa_resolve(domain_priv->numa.queue_node),
+      .rail = domain_next_rail(domain_priv),
       .caps = ep_caps,
       .send_cq = NULL,
       .read_cq = NULL,
@@ -152,13 +183,12 @@ int dpa_ep_open(struct fid_domain *domain, struct fi_info *info,
       .read_cntr = NULL,
       .write_cntr = NULL,
       .recv_cntr = NULL,
-      .last_remote_mr = {
-        .target = {
-          .nodeId = 0,
-          .connectId = 0
-        },
-        .segment = NULL,
-      },
+      .selective = 0,
+      .tx_op_flags = info->tx_attr ? info->tx_attr->op_flags & FI_COMPLETION : 0,
+      .rx_op_flags = info->rx_attr ? info->rx_attr->op_flags & FI_COMPLETION : 0,
+      .rma_cache = NULL,
+      .last_remote_mr = NULL,
+      .rma_cache_clock = 0,
       .msg_recv_info = {
         .buffer = NULL,
       },
@@ -190,9 +220,15 @@ int dpa_ep_open(struct fid_domain *domain, struct fi_info *info,
       ops->writev = fi_no_rma_writev;
       ops->writemsg = fi_no_rma_writemsg;
       ops->writedata = fi_no_rma_writedata;
+      ops->inject = fi_no_rma_inject;
+      ops->injectdata = fi_no_rma_injectdata;
     }
     ep_priv->ep.rma = ops;
   }
+  if (can_rma(ep_caps))
+    rma_cache_init(ep_priv);
+  if (can_atomic(ep_caps))
+    ep_priv->ep.atomic = &dpa_atomic_ops;
     
   if (info->handle) {
     // opening active endpoint from passive
@@ -204,9 +240,13 @@ int dpa_ep_open(struct fid_domain *domain, struct fi_info *info,
     slist_init(&ep_priv->msg_recv_info.msg_queue);
     slist_init(&ep_priv->msg_send_info.free_entries);
     slist_init(&ep_priv->msg_recv_info.free_entries);
+    slist_init(&ep_priv->msg_recv_info.staged);
     slist_init(&ep_priv->free_entries_ptrs);
     create_msg_queue_entries(ep_priv, &ep_priv->msg_send_info.free_entries);
     create_msg_queue_entries(ep_priv, &ep_priv->msg_recv_info.free_entries);
+    slist_init(&ep_priv->atomic_pending);
+    slist_init(&ep_priv->atomic_free);
+    progress_engine_add(&domain_priv->progress_engine, ep_priv);
   }
   *ep = &(ep_priv->ep);
   return 0;
@@ -252,19 +292,35 @@ int dpa_passive_ep_open(struct fid_fabric *fabric, struct fi_info *info,
 static int dpa_ep_close(fid_t fid) {
   DPA_DEBUG("Closing endpoint\n");
   struct dpa_fid_ep *ep = container_of(fid, dpa_fid_ep, ep.fid);
-  if (ep->ep.msg) {
-    slist_destroy(&ep->free_entries_ptrs, msg_queue_ptr_entry, list_entry, no_destroyer);
-  }
+  unbind_progress(ep);
+  rma_cache_fini(ep);
+  if (ep->ep.msg)
+    release_msg_queues(ep);
   free(ep);
   return 0;
 }
 
+static struct fi_dpa_ops_ep dpa_ops_ep = {
+  .size = sizeof(struct fi_dpa_ops_ep),
+  .rma_prefetch = dpa_rma_prefetch
+};
+
+static int dpa_ep_ops_open(struct fid *fid, const char *name,
+                           uint64_t flags, void **ops, void *context) {
+  if (strcmp(name, FI_DPA_EP_OPS_OPEN)) return -FI_ENODATA;
+  dpa_fid_ep* ep = container_of(fid, dpa_fid_ep, ep.fid);
+  if (!ep->rma_cache) return -FI_ENOSYS;
+
+  *ops = &dpa_ops_ep;
+  return 0;
+}
+
 static int dpa_pep_close(fid_t fid) {
   DPA_DEBUG("Closing endpoint\n");
   struct dpa_fid_pep *pep = container_of(fid, dpa_fid_pep, pep.fid);
   fastlock_destroy(&pep->lock);
   if (pep->eq)
-    queue_progress_init(&pep->eq->progress);
+    queue_progress_unbind(&pep->eq->progress, pep);
   dpa_error_t error;
   DPARemoveDataInterrupt(pep->interrupt, NO_FLAGS, &error);
   DPAClose(pep->sd, NO_FLAGS, &error);
@@ -279,17 +335,36 @@ static int dpa_pep_close(fid_t fid) {
     return -FI_EINVAL;                                                  \
   }
 
-static inline void bind_progress(dpa_fid_ep* ep, queue_progress* progress, uint64_t flags) {
+static inline int bind_progress(dpa_fid_ep* ep, queue_progress* progress, uint64_t flags) {
     if (ep->domain->data_progress != FI_PROGRESS_MANUAL)
-      return;
+      return FI_SUCCESS;
+    // atomic results arrive on the receive ring
+    if ((flags & FI_SEND) && (ep->caps & FI_ATOMIC))
+      flags |= FI_RECV;
+    // the same queue may be bound once per direction
+    flags = (flags | queue_progress_flags(progress, ep)) & (FI_RECV | FI_SEND);
     
-    if ((flags | FI_RECV | FI_SEND) == flags)
-      progress->func = (progress_queue_t) progress_sendrecv_queues;
+    progress_queue_t func;
+    if (flags == (FI_RECV | FI_SEND))
+      func = (progress_queue_t) progress_sendrecv_queues;
     else if (flags & FI_RECV)
-      progress->func = (progress_queue_t) progress_recv_queue;
+      func = (progress_queue_t) progress_recv_queue;
     else if (flags & FI_SEND)
-      progress->func = (progress_queue_t) progress_send_queue;
-    progress->arg = ep;
+      func = (progress_queue_t) progress_send_queue;
+    else return FI_SUCCESS;
+    return queue_progress_bind(progress, func, (progress_pending_t) progress_pending,
+                               ep, flags);
+}
+
+static inline void unbind_progress(dpa_fid_ep* ep) {
+  dpa_fid_cq* cqs[] = { ep->send_cq, ep->recv_cq, ep->read_cq, ep->write_cq };
+  dpa_fid_cntr* cntrs[] = { ep->send_cntr, ep->recv_cntr, ep->read_cntr, ep->write_cntr };
+  for (int i = 0; i < 4; i++) {
+    if (cqs[i]) queue_progress_unbind(&cqs[i]->progress, ep);
+    if (cntrs[i]) queue_progress_unbind(&cntrs[i]->progress, ep);
+  }
+  if (ep->eq) queue_progress_unbind(&ep->eq->progress, ep);
+  progress_engine_remove(&ep->domain->progress_engine, ep);
 }
 
 static int dpa_ep_bind(struct fid *fid, struct fid *bfid, uint64_t flags){
@@ -312,17 +387,22 @@ static int dpa_ep_bind(struct fid *fid, struct fid *bfid, uint64_t flags){
     DPA_DEBUG("Binding completion queue to endpoint\n");
     dpa_fid_cq* cq = container_of(bfid, dpa_fid_cq, cq.fid);
     CHECK_DOMAIN(ep, cq);
-    bind_progress(ep, &cq->progress, flags);
+    if (bind_progress(ep, &cq->progress, flags)) return -FI_ENOMEM;
     if (flags & FI_SEND) ep->send_cq = cq;
     if (flags & (FI_SEND | FI_READ)) ep->read_cq = cq;
     if (flags & (FI_SEND | FI_WRITE)) ep->write_cq = cq;
     if (flags & FI_RECV) ep->recv_cq = cq;
+    // sends also bind the read and write queues
+    uint64_t kinds = flags & (FI_SEND | FI_RECV | FI_READ | FI_WRITE);
+    if (flags & FI_SEND) kinds |= FI_READ | FI_WRITE;
+    if (flags & FI_SELECTIVE_COMPLETION) ep->selective |= kinds;
+    else ep->selective &= ~kinds;
     break;
   case FI_CLASS_CNTR:
     DPA_DEBUG("Binding completion queue to endpoint\n");
     dpa_fid_cntr* cntr = container_of(bfid, dpa_fid_cntr, cntr.fid);
     CHECK_DOMAIN(ep, cntr);
-    bind_progress(ep, &cntr->progress, flags);
+    if (bind_progress(ep, &cntr->progress, flags)) return -FI_ENOMEM;
     if (flags & FI_SEND) ep->send_cntr = cntr;
     if (flags & (FI_SEND | FI_READ)) ep->read_cntr = cntr;
     if (flags & (FI_SEND | FI_WRITE)) ep->write_cntr = cntr;
@@ -336,9 +416,10 @@ static int dpa_ep_bind(struct fid *fid, struct fid *bfid, uint64_t flags){
     break;
   case FI_CLASS_MR:    
     DPA_DEBUG("Binding memory registration to endpoint\n");
-    dpa_fid_mr* mr = container_of(bfid, dpa_fid_mr, mr.fid);
+    dpa_fid_mr* mr = dpa_mr_from_fid(bfid);
     CHECK_DOMAIN(ep, mr);
     ep->mr = mr;
+    mr->ep = ep;
     break;
   case FI_CLASS_STX_CTX:
     DPA_WARN("Binding stx_ctx to endpoint is not supported\n");
@@ -57,18 +57,62 @@ struct dpa_fid_pep {
   fastlock_t lock;
 };
 
+#ifndef RMA_WINDOW_SLOTS
+#define RMA_WINDOW_SLOTS 4
+#endif
+
+typedef struct remote_window {
+  dpa_map_t map;
+  dpa_sequence_t sequence;
+  volatile void* base;
+  size_t offset;
+  size_t len;
+  uint64_t last_use;
+  uint8_t dirty;
+} remote_window;
+
 typedef struct remote_mr_cache {
   dpa_addr_t target;
+  size_t rail;
   dpa_desc_t sd;
   dpa_remote_segment_t segment;
-  dpa_map_t map;
   dpa_intid_t interruptId;
   dpa_remote_interrupt_t interrupt;
-  dpa_sequence_t sequence;
-  volatile void* base;
+  /* windows[0] maps the start of the segment for as long as we are
+   * connected (the whole segment if it is small), the others are
+   * mapped on demand and recycled in LRU order */
+  remote_window windows[RMA_WINDOW_SLOTS];
+  uint64_t window_clock;
+  uint64_t last_use;
+  size_t seg_len;
+  size_t data_offset;
   size_t len;
+  volatile mr_event_area* events;
+  uint64_t cq_data_head;
+  uint64_t cq_data_tail;
+  uint32_t cq_data_size;
+  uint8_t rma_events;
+  // our reporting slot on the target, see mr_initiator
+  uint32_t slot_count;
+  uint32_t slot_offset;
+  uint32_t slot_stride;
+  uint32_t slot_index;
+  uint64_t initiator_id;
+  uint64_t slot_request;
+  volatile mr_initiator* slot;
+  uint64_t write_tail;
+  uint64_t read_tail;
+  uint8_t hasEventInt;
+  uint8_t eventIntRail;
+  dpa_intid_t eventIntId;
 } remote_mr_cache;
 
+// evicted target mapping awaiting teardown
+typedef struct rma_reclaim_entry {
+  remote_mr_cache cache;
+  slist_entry list_entry;
+} rma_reclaim_entry;
+
 struct dpa_fid_ep {
   struct fid_ep ep;
   dpa_fid_pep* pep;
@@ -82,19 +126,32 @@ struct dpa_fid_ep {
   dpa_fid_cntr* recv_cntr;
   dpa_fid_cntr* read_cntr;
   dpa_fid_cntr* write_cntr;
+  // FI_SEND, FI_RECV, FI_READ, FI_WRITE queues bound with FI_SELECTIVE_COMPLETION
+  uint64_t selective;
+  // FI_COMPLETION from the attributes, for calls that take no flags
+  uint64_t tx_op_flags;
+  uint64_t rx_op_flags;
   dpa_fid_av* av;
   dpa_fid_mr* mr;
   dpa_fid_eq* eq;
   ep_recv_info msg_recv_info;
   ep_send_info msg_send_info;
   slist free_entries_ptrs;
-  remote_mr_cache last_remote_mr;
+  slist atomic_pending;
+  slist atomic_free;
+  remote_mr_cache* rma_cache;
+  remote_mr_cache* last_remote_mr;
+  uint64_t rma_cache_clock;
   dpa_addr_t peer_addr;
   segment_data connect_data;
   dpa_desc_t connect_sd;
   dpa_local_data_interrupt_t connect_interrupt;
   uint8_t connected;
   uint8_t lock_needed;
+  int numa_node;
+  size_t rail;
+  int progress_state;
+  size_t progress_worker;
 };
 
 int dpa_rdm_verify_attr(struct fi_ep_attr *ep_attr, struct fi_tx_attr *tx_attr, struct fi_rx_attr *rx_attr);
@@ -104,6 +161,23 @@ int dpa_ep_open(struct fid_domain *domain, struct fi_info *info,
 int dpa_passive_ep_open(struct fid_fabric *fabric, struct fi_info *info,
                         struct fid_pep **pep, void *context);
 
+static inline uint64_t ep_tx_op_flags(struct fid_ep* ep) {
+  return container_of(ep, dpa_fid_ep, ep)->tx_op_flags;
+}
+
+static inline uint64_t ep_rx_op_flags(struct fid_ep* ep) {
+  return container_of(ep, dpa_fid_ep, ep)->rx_op_flags;
+}
+
+/**
+ * Whether an operation of the given kind gets a completion entry: always,
+ * unless its queue was bound with FI_SELECTIVE_COMPLETION and the operation
+ * was not flagged with FI_COMPLETION. Errors are reported regardless.
+ */
+static inline int ep_completes(dpa_fid_ep* ep, uint64_t kind, uint64_t flags) {
+  return !(ep->selective & kind) || (flags & FI_COMPLETION);
+}
+
 static inline void lock_if_needed(dpa_fid_ep* ep, slist* list) {
   if (ep->lock_needed) slist_lock(list);
 }
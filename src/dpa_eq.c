@@ -33,12 +33,163 @@
 #define LOG_SUBSYS FI_LOG_EQ
 #include "dpa_eq.h"
 
+#ifndef PROGRESS_BUDGET_DEFAULT
+#define PROGRESS_BUDGET_DEFAULT 16
+#endif
+DEFINE_ENV_CONST(size_t, PROGRESS_BUDGET, PROGRESS_BUDGET_DEFAULT);
+
+// longest wait on a single binding when several share a queue
+#ifndef PROGRESS_WAIT_SLICE
+#define PROGRESS_WAIT_SLICE 1
+#endif
+
+// blocking reads poll this long before going to sleep
+#ifndef WAIT_SPIN_USEC_DEFAULT
+#define WAIT_SPIN_USEC_DEFAULT 20
+#endif
+DEFINE_ENV_CONST(long, WAIT_SPIN_USEC, WAIT_SPIN_USEC_DEFAULT);
+
+void dpa_eq_init() {
+  ENV_OVERRIDE_INT(PROGRESS_BUDGET);
+  ENV_OVERRIDE_INT(WAIT_SPIN_USEC);
+}
+
+static inline progress_binding* find_binding(queue_progress* progress, void* arg) {
+  for (size_t i = 0; i < progress->count; i++)
+    if (progress->bindings[i].arg == arg) return &progress->bindings[i];
+  return NULL;
+}
+
+int queue_progress_bind(queue_progress* progress, progress_queue_t func,
+                        progress_pending_t pending, void* arg, uint64_t flags) {
+  int ret = FI_SUCCESS;
+  fastlock_acquire(&progress->lock);
+  progress_binding* binding = find_binding(progress, arg);
+  if (!binding && progress->count == progress->capacity) {
+    size_t capacity = progress->capacity ? 2 * progress->capacity : 4;
+    progress_binding* bindings = realloc(progress->bindings,
+                                         capacity * sizeof(progress_binding));
+    if (!bindings) {
+      ret = -FI_ENOMEM;
+      goto bind_end;
+    }
+    progress->bindings = bindings;
+    progress->capacity = capacity;
+  }
+  if (!binding) binding = &progress->bindings[progress->count++];
+  *binding = (progress_binding) {
+    .func = func,
+    .pending = pending,
+    .arg = arg,
+    .flags = flags
+  };
+ bind_end:
+  fastlock_release(&progress->lock);
+  return ret;
+}
+
+uint64_t queue_progress_flags(queue_progress* progress, void* arg) {
+  fastlock_acquire(&progress->lock);
+  progress_binding* binding = find_binding(progress, arg);
+  uint64_t flags = binding ? binding->flags : 0;
+  fastlock_release(&progress->lock);
+  return flags;
+}
+
+void queue_progress_unbind(queue_progress* progress, void* arg) {
+  fastlock_acquire(&progress->lock);
+  progress_binding* binding = find_binding(progress, arg);
+  if (binding) {
+    size_t index = binding - progress->bindings;
+    memmove(binding, binding + 1, (--progress->count - index) * sizeof(progress_binding));
+    if (progress->next > index) progress->next--;
+    if (progress->next >= progress->count) progress->next = 0;
+  }
+  fastlock_release(&progress->lock);
+}
+
+/**
+ * Copy up to max bindings starting from the round robin cursor,
+ * which is moved past them. Returns the number copied.
+ */
+static inline size_t next_bindings(queue_progress* progress,
+                                   progress_binding* batch, size_t max) {
+  fastlock_acquire(&progress->lock);
+  size_t count = MIN(max, progress->count);
+  for (size_t i = 0; i < count; i++) {
+    batch[i] = progress->bindings[progress->next];
+    progress->next = (progress->next + 1) % progress->count;
+  }
+  fastlock_release(&progress->lock);
+  return count;
+}
+
+/**
+ * Progress without waiting up to max bindings from the cursor,
+ * skipping those with nothing pending. Returns how many had work.
+ */
+size_t poll_queue_progress(queue_progress* progress, size_t max) {
+  max = MIN(max, __atomic_load_n(&progress->count, __ATOMIC_RELAXED));
+  if (!max) return 0;
+  progress_binding batch[max];
+  size_t count = next_bindings(progress, batch, max);
+  size_t busy = 0;
+  for (size_t i = 0; i < count; i++)
+    if (!batch[i].pending || batch[i].pending(batch[i].arg)) {
+      batch[i].func(batch[i].arg, 0);
+      busy++;
+    }
+  return busy;
+}
+
+/**
+ * Progress the bound queues, waiting up to timeout for one of them to be
+ * woken up. Returns the time left when woken up, 0 once it expired.
+ */
+// whether a binding may have work, bindings telling nothing always may
+static int queue_progress_busy(queue_progress* progress) {
+  int busy = 0;
+  fastlock_acquire(&progress->lock);
+  for (size_t i = 0; !busy && i < progress->count; i++) {
+    progress_binding* binding = &progress->bindings[i];
+    busy = !binding->pending || binding->pending(binding->arg);
+  }
+  fastlock_release(&progress->lock);
+  return busy;
+}
+
+int make_queue_progress(queue_progress* progress, int timeout) {
+  if (!queue_progress_bound(progress)) {
+    DPA_DEBUG("No progress function available\n");
+    return timeout;
+  }
+  DPA_DEBUG("Enforcing queue progress\n");
+  int64_t deadline = deadline_usec(timeout);
+  progress_binding binding;
+  // a single binding can block on its own interrupt for the whole timeout
+  if (__atomic_load_n(&progress->count, __ATOMIC_RELAXED) == 1 &&
+      next_bindings(progress, &binding, 1)) {
+    if (!timeout && binding.pending && !binding.pending(binding.arg)) return 0;
+    return binding.func(binding.arg, timeout) ? remaining_msec(deadline) : 0;
+  }
+
+  poll_queue_progress(progress, PROGRESS_BUDGET ? PROGRESS_BUDGET : 1);
+
+  // then wait on each binding in turn, a slice at a time
+  while ((timeout = remaining_msec(deadline)) && next_bindings(progress, &binding, 1)) {
+    int slice = timeout < 0 ? PROGRESS_WAIT_SLICE : MIN(timeout, PROGRESS_WAIT_SLICE);
+    if (binding.func(binding.arg, slice)) return remaining_msec(deadline);
+  }
+  return 0;
+}
+
 static int dpa_eq_close(struct fid* fid);
+static int dpa_eq_control(struct fid* fid, int command, void* arg);
 struct fi_ops dpa_fid_eq_ops = {
   .size = sizeof(struct fi_ops),
   .close = dpa_eq_close,
   .bind = fi_no_bind,
-  .control = fi_no_control,
+  .control = dpa_eq_control,
   .ops_open = fi_no_ops_open
 };
 
@@ -50,6 +201,26 @@ static ssize_t dpa_eq_sread(struct fid_eq *eq, uint32_t *event,
                             void *buf, size_t len, int timeout, uint64_t flags);
 static ssize_t dpa_eq_write(struct fid_eq *eq, uint32_t event,
                             const void *buf, size_t len, uint64_t flags);
+static int dpa_eq_control(struct fid* fid, int command, void* arg) {
+  dpa_fid_eq* eq_priv = container_of(fid, dpa_fid_eq, eq.fid);
+  switch (command) {
+  case FI_GETWAIT:
+    return wait_fd_get(&eq_priv->wait_fd, arg);
+  default:
+    return -FI_ENOSYS;
+  }
+}
+
+int eq_trywait(dpa_fid_eq* eq) {
+  if (eq->wait_fd.fd < 0) return -FI_EINVAL;
+  make_queue_progress(&eq->progress, 0);
+  wait_fd_arm(&eq->wait_fd);
+  // connection management is only progressed by polling, never while asleep
+  if (queue_progress_busy(&eq->progress)) return -FI_EAGAIN;
+  return slist_empty(&eq->event_queue) && slist_empty(&eq->error_queue)
+    ? FI_SUCCESS : -FI_EAGAIN;
+}
+
 static const char* dpa_eq_strerror(struct fid_eq *eq, int prov_errno,
                                    const void *err_data, char *buf, size_t len);
 
@@ -70,6 +241,7 @@ int	dpa_eq_open(struct fid_fabric *fabric, struct fi_eq_attr *attr,
   switch (attr->wait_obj) {
   case FI_WAIT_NONE:
   case FI_WAIT_UNSPEC:
+  case FI_WAIT_FD:
     break;
   default:
     VERIFY_FAIL(attr->wait_obj, FI_WAIT_NONE);
@@ -89,6 +261,12 @@ int	dpa_eq_open(struct fid_fabric *fabric, struct fi_eq_attr *attr,
     });
 
   queue_progress_init(&eq_priv->progress);
+  wait_fd_init(&eq_priv->wait_fd);
+  if (attr->wait_obj == FI_WAIT_FD && wait_fd_open(&eq_priv->wait_fd)) {
+    DPA_WARN("Cannot create event queue wait fd\n");
+    free(eq_priv);
+    return -FI_ENOSYS;
+  }
   slist_init(&eq_priv->event_queue);
   slist_init(&eq_priv->error_queue);
   slist_init(&eq_priv->free_list);
@@ -117,6 +295,8 @@ static int dpa_eq_close(struct fid* fid) {
   free_eq(&eq_priv->event_queue);
   free_eq(&eq_priv->error_queue);
   free_eq(&eq_priv->free_list);
+  queue_progress_destroy(&eq_priv->progress);
+  wait_fd_close(&eq_priv->wait_fd);
   free(eq_priv);
 }
 
@@ -162,6 +342,11 @@ static inline ssize_t _read_or_err(dpa_fid_eq* eq, uint32_t *event,
     return eq_read_priv(eq, &eq->event_queue, buf, len, event, flags);
 }
 
+static int eq_has_events(void* arg) {
+  dpa_fid_eq* eq = arg;
+  return !slist_empty(&eq->event_queue) || !slist_empty(&eq->error_queue);
+}
+
 static ssize_t dpa_eq_sread(struct fid_eq *eq, uint32_t *event,
                             void *buf, size_t len, int timeout, uint64_t flags) {
   DPA_INFO("Reading from event queue with timeout %d\n", timeout);
@@ -171,15 +356,19 @@ static ssize_t dpa_eq_sread(struct fid_eq *eq, uint32_t *event,
   result = _read_or_err(eq_priv, event, buf, len, timeout, flags);
   if (result == -FI_EAGAIN && timeout) {
     DPA_INFO("Empty queue, waiting on event queue until timeout\n");
-    if (eq_priv->progress.func) {
-      make_queue_progress(&eq_priv->progress, timeout);
-    } else {
+    if (queue_progress_bound(&eq_priv->progress)) {
+      int64_t deadline = deadline_usec(timeout);
+      while (!eq_has_events(eq_priv) && (timeout = remaining_msec(deadline)))
+        make_queue_progress(&eq_priv->progress, timeout);
+    } else if (!fastlock_spin(eq_has_events, eq_priv, WAIT_SPIN_USEC, &timeout) && timeout) {
       // with automatic progress wait until progress happens
       LIST_SAFE(&eq_priv->event_queue, ({
-            fastlock_wait_timeout(&eq_priv->cond, &eq_priv->event_queue.lock, timeout);
+            if (!eq_has_events(eq_priv))
+              fastlock_wait_timeout(&eq_priv->cond, &eq_priv->event_queue.lock, timeout);
           }));
     }
-    result = eq_read_priv(eq_priv, &eq_priv->event_queue, buf, len, event, flags);
+    // an error may be what ended the wait
+    result = _read_or_err(eq_priv, event, buf, len, timeout, flags);
   }
   return result;
 }
@@ -192,9 +381,14 @@ static inline dpa_eq_event* get_empty_event(dpa_fid_eq* eq) {
 }
 
 static inline int eq_signal(dpa_fid_eq* eq) {
+  wait_fd_signal(&eq->wait_fd);
   // if progress is manual nobody ever waits
-  if (eq->progress.func) return 0;
-  return fastlock_signal(&eq->cond);
+  if (queue_progress_bound(&eq->progress)) return 0;
+  // under the queue lock, not to slip between a reader's check and its wait
+  fastlock_acquire(&eq->event_queue.lock);
+  int result = fastlock_signal(&eq->cond);
+  fastlock_release(&eq->event_queue.lock);
+  return result;
 }
 
 ssize_t eq_add(dpa_fid_eq* eq, uint32_t event_num, const void* buf, size_t len, uint64_t flags, int error) {
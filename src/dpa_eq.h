@@ -33,11 +33,18 @@
 typedef struct dpa_fid_eq dpa_fid_eq;
 typedef struct queue_interrupt queue_interrupt;
 typedef struct queue_progress queue_progress;
+typedef struct progress_binding progress_binding;
 typedef int (*progress_queue_t)(void* arg, int timeout_millis);
+typedef int (*progress_pending_t)(void* arg);
 
 #ifndef _DPA_EQ_H
 #define _DPA_EQ_H
 #include "dpa.h"
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+EXTERN_ENV_CONST(long, WAIT_SPIN_USEC);
 
 
 struct queue_interrupt {
@@ -64,25 +71,101 @@ static inline dpa_error_t wait_interrupt(dpa_local_interrupt_t interrupt, int ti
   return error;
 }
 
-struct queue_progress {
+/* eventfd behind FI_WAIT_FD. Producers only write to it once fi_trywait
+ * has armed it, so nobody pays a system call while the application polls. */
+typedef struct queue_wait_fd {
+  int fd;
+  int armed;
+} queue_wait_fd;
+
+static inline void wait_fd_init(queue_wait_fd* wait) {
+  wait->fd = -1;
+  wait->armed = 0;
+}
+
+static inline int wait_fd_open(queue_wait_fd* wait) {
+#ifdef HAVE_SYS_EVENTFD_H
+  wait->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  wait->armed = 1;
+  return wait->fd < 0 ? -FI_EMFILE : FI_SUCCESS;
+#else
+  return -FI_ENOSYS;
+#endif
+}
+
+static inline void wait_fd_close(queue_wait_fd* wait) {
+  if (wait->fd >= 0) close(wait->fd);
+  wait->fd = -1;
+}
+
+static inline void wait_fd_signal(queue_wait_fd* wait) {
+  if (wait->fd < 0 || !__atomic_exchange_n(&wait->armed, 0, __ATOMIC_SEQ_CST))
+    return;
+  uint64_t one = 1;
+  if (write(wait->fd, &one, sizeof(one)) != sizeof(one))
+    DPA_DEBUG("Cannot signal wait fd %d\n", wait->fd);
+}
+
+/**
+ * Arm and drain the fd. The caller must then check its queue once more:
+ * anything added before arming did not signal.
+ */
+static inline void wait_fd_arm(queue_wait_fd* wait) {
+  __atomic_store_n(&wait->armed, 1, __ATOMIC_SEQ_CST);
+  uint64_t count;
+  while (read(wait->fd, &count, sizeof(count)) == sizeof(count));
+}
+
+static inline int wait_fd_get(queue_wait_fd* wait, void* arg) {
+  if (wait->fd < 0) return -FI_ENOSYS;
+  if (!arg) return -FI_EINVAL;
+  *(int*) arg = wait->fd;
+  return FI_SUCCESS;
+}
+
+struct progress_binding {
   progress_queue_t func;
+  // optional, tells whether arg has any work before calling func
+  progress_pending_t pending;
   void* arg;
+  uint64_t flags;
+};
+
+/**
+ * Endpoints bound to a queue, progressed round robin.
+ */
+struct queue_progress {
+  fastlock_t lock;
+  progress_binding* bindings;
+  size_t count;
+  size_t capacity;
+  size_t next;
 };
 
 static inline void queue_progress_init(queue_progress* progress) {
-  progress->func = NULL;
-  progress->arg = NULL;
+  fastlock_init(&progress->lock);
+  progress->bindings = NULL;
+  progress->count = progress->capacity = progress->next = 0;
 }
 
-static inline int make_queue_progress(queue_progress* progress, int timeout) {
-  if (progress->func) {
-    DPA_DEBUG("Enforcing queue progress\n");
-    return progress->func(progress->arg, timeout);
-  } else
-	DPA_DEBUG("No progress function available\n");
-  return timeout;
+static inline void queue_progress_destroy(queue_progress* progress) {
+  free(progress->bindings);
+  fastlock_destroy(&progress->lock);
 }
 
+static inline int queue_progress_bound(queue_progress* progress) {
+  return __atomic_load_n(&progress->count, __ATOMIC_RELAXED) != 0;
+}
+
+int queue_progress_bind(queue_progress* progress, progress_queue_t func,
+                        progress_pending_t pending, void* arg, uint64_t flags);
+uint64_t queue_progress_flags(queue_progress* progress, void* arg);
+void queue_progress_unbind(queue_progress* progress, void* arg);
+int make_queue_progress(queue_progress* progress, int timeout);
+size_t poll_queue_progress(queue_progress* progress, size_t max);
+void dpa_eq_init();
+int eq_trywait(dpa_fid_eq* eq);
+
 typedef struct dpa_fid_eq {
   struct fid_eq eq;
   struct fid_fabric* fabric;
@@ -91,6 +174,7 @@ typedef struct dpa_fid_eq {
   struct slist error_queue;
   struct slist free_list;
   queue_progress progress;
+  queue_wait_fd wait_fd;
 } dpa_fid_eq;
 
 typedef struct dpa_eq_event {
@@ -34,7 +34,13 @@
 #include "dpa_env.h"
 #include "dpa_msg.h"
 #include "dpa_mr.h"
+#include "dpa_rma.h"
 #include "dpa_info.h"
+#include "dpa_domain.h"
+#include "dpa_cq.h"
+#include "dpa_cntr.h"
+#include "dpa_eq.h"
+#include "dpa_wait.h"
 
 static int dpa_fabric(struct fi_fabric_attr *attr, struct fid_fabric **fabric, void *context);
 static int dpa_fabric_close(fid_t fid);
@@ -45,6 +51,25 @@ dpa_nodeid_t localNodeId;
 #define ADAPTERNO_DEFAULT 0
 #endif
 DEFINE_ENV_CONST(dpa_adapterno_t, localAdapterNo, ADAPTERNO_DEFAULT);
+#ifndef ADAPTER_COUNT_DEFAULT
+#define ADAPTER_COUNT_DEFAULT 1
+#endif
+DEFINE_ENV_CONST(size_t, ADAPTER_COUNT, ADAPTER_COUNT_DEFAULT);
+#ifndef RAIL_NODEID_STRIDE_DEFAULT
+#define RAIL_NODEID_STRIDE_DEFAULT 0
+#endif
+DEFINE_ENV_CONST(dpa_nodeid_t, RAIL_NODEID_STRIDE, RAIL_NODEID_STRIDE_DEFAULT);
+// stand in for missing adapters with localAdapterNo, to run multi-rail code on one adapter
+#ifndef RAIL_EMULATE_DEFAULT
+#define RAIL_EMULATE_DEFAULT 0
+#endif
+DEFINE_ENV_CONST(int, RAIL_EMULATE, RAIL_EMULATE_DEFAULT);
+dpa_adapterno_t dpaRails[DPA_MAX_RAILS];
+size_t dpaRailCount;
+#ifndef SEGMENT_HUGEPAGES_DEFAULT
+#define SEGMENT_HUGEPAGES_DEFAULT 0
+#endif
+DEFINE_ENV_CONST(int, SEGMENT_HUGEPAGES, SEGMENT_HUGEPAGES_DEFAULT);
 
 struct fi_provider dpa_provider = {
   .name="dpa",
@@ -57,6 +82,35 @@ struct fi_provider dpa_provider = {
 
 extern fastlock_t msg_lock;
 
+/**
+ * Use FI_DPA_ADAPTER_COUNT adapters starting from localAdapterNo,
+ * skipping those that do not answer, or emulating them on
+ * localAdapterNo when FI_DPA_RAIL_EMULATE is set.
+ */
+static void dpa_rails_init() {
+  ENV_OVERRIDE_INT(ADAPTER_COUNT);
+  ENV_OVERRIDE_INT(RAIL_NODEID_STRIDE);
+  ENV_OVERRIDE_INT(RAIL_EMULATE);
+  dpaRails[0] = localAdapterNo;
+  dpaRailCount = 1;
+  for (size_t i = 1; i < ADAPTER_COUNT && dpaRailCount < DPA_MAX_RAILS; i++) {
+    dpa_adapterno_t adapterNo = localAdapterNo + i;
+    dpa_nodeid_t nodeId;
+    dpa_error_t error;
+    DPAGetLocalNodeId(adapterNo, &nodeId, NO_FLAGS, &error);
+    if (error != DPA_ERR_OK && RAIL_EMULATE) {
+      DPA_INFO("Adapter %u not available, emulating it on adapter %u\n",
+               adapterNo, localAdapterNo);
+      adapterNo = localAdapterNo;
+    } else if (error != DPA_ERR_OK) {
+      DPA_WARN("Adapter %u not available, skipping it\n", adapterNo);
+      continue;
+    }
+    dpaRails[dpaRailCount++] = adapterNo;
+  }
+  DPA_INFO("Using %zu adapter(s) starting from %u\n", dpaRailCount, localAdapterNo);
+}
+
 FI_EXT_INI{
   //start dpalib
   dpa_error_t error;
@@ -65,6 +119,7 @@ FI_EXT_INI{
   DPALIB_CHECK_ERROR(DPAInitialize, return NULL);
   
   ENV_OVERRIDE_INT(localAdapterNo);
+  ENV_OVERRIDE_INT(SEGMENT_HUGEPAGES);
   DPA_DEBUG("Getting local node id\n");
   DPAGetLocalNodeId(localAdapterNo,
                     &localNodeId,
@@ -72,7 +127,12 @@ FI_EXT_INI{
                     &error);
   DPALIB_CHECK_ERROR(DPAGetLocalNodeId, return NULL);
   DPA_DEBUG("Local node id = %d\n", localNodeId);
+  dpa_rails_init();
+  dpa_domain_init();
+  dpa_progress_init();
+  dpa_eq_init();
   dpa_mr_init();
+  dpa_rma_init();
   dpa_msg_init();
   dpa_cm_init();
   return &dpa_provider;
@@ -86,6 +146,7 @@ static void fi_dpa_fini(void)
   dpa_mr_fini();
   dpa_msg_fini();
   dpa_cm_fini();
+  dpa_progress_fini();
   //finalize dpalib
   DPATerminate();
 }
@@ -98,12 +159,41 @@ static struct fi_ops dpa_fab_fi_ops = {
   .ops_open = fi_no_ops_open
 };
 
+/**
+ * Arm the wait fds of fids, failing with -FI_EAGAIN if any of them
+ * already has something to read.
+ */
+static int dpa_trywait(struct fid_fabric *fabric, struct fid **fids, int count) {
+  for (int i = 0; i < count; i++) {
+    int ret;
+    switch (fids[i]->fclass) {
+    case FI_CLASS_CQ:
+      ret = cq_trywait(container_of(fids[i], dpa_fid_cq, cq.fid));
+      break;
+    case FI_CLASS_EQ:
+      ret = eq_trywait(container_of(fids[i], dpa_fid_eq, eq.fid));
+      break;
+    case FI_CLASS_CNTR:
+      ret = cntr_trywait(container_of(fids[i], dpa_fid_cntr, cntr.fid));
+      break;
+    case FI_CLASS_WAIT:
+      ret = wait_set_trywait(container_of(fids[i], dpa_fid_wait, wait.fid));
+      break;
+    default:
+      ret = -FI_EINVAL;
+    }
+    if (ret) return ret;
+  }
+  return FI_SUCCESS;
+}
+
 static struct fi_ops_fabric dpa_fab_ops = {
   .size = sizeof(struct fi_ops_fabric),
   .domain = dpa_domain_open,
   .passive_ep = dpa_passive_ep_open,
   .eq_open = dpa_eq_open,
-  .wait_open = fi_no_wait_open
+  .wait_open = dpa_wait_open,
+  .trywait = dpa_trywait
 };
     
 /**
@@ -31,8 +31,9 @@
  *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
  */
 #include <string.h>
+#include <inttypes.h>
 #include "dpa.h"
-static int get_ep_caps(struct fi_info* hints);
+static int get_ep_caps(struct fi_info* hints, uint64_t* caps);
 static int dpa_verify_requirements(uint32_t version, const char *node, const char *service,
                                    uint64_t flags, struct fi_info *hints);
 static dpa_addr_t* resolvename(const char* node, const char *service);
@@ -55,6 +56,10 @@ int dpa_getinfo(uint32_t version, const char *node, const char *service,
   int ret = dpa_verify_requirements(version, node, service, flags, hints);
   if (ret) 
     return ret;
+  uint64_t caps;
+  ret = get_ep_caps(hints, &caps);
+  if (ret)
+    return ret;
 
   dpa_addr_t *dest_addr = NULL;
   if (node && service && !(flags & FI_SOURCE))
@@ -94,7 +99,7 @@ int dpa_getinfo(uint32_t version, const char *node, const char *service,
           .av_type = av_type,
           .mr_mode = mr_mode,
           .mr_key_size = sizeof(dpa_segmid_t),
-          .cq_data_size = 0,
+          .cq_data_size = sizeof(uint64_t),
           .cq_cnt = 0,
           .ep_cnt = 0,
           .tx_ctx_cnt = 1,
@@ -134,7 +139,7 @@ int dpa_getinfo(uint32_t version, const char *node, const char *service,
   DPA_DEBUG("Building dpa_info\n");
   struct fi_info* result = ALLOC_INIT(struct fi_info, {
       .next = NULL,
-        .caps = get_ep_caps(hints),
+        .caps = caps,
         .mode = 0,
         .addr_format = FI_FORMAT_UNSPEC,
         .src_addrlen = sizeof(dpa_addr_t),
@@ -153,6 +158,8 @@ int dpa_getinfo(uint32_t version, const char *node, const char *service,
 	DPA_WARN("Unable to allocate memory for fi_info");
 	return -FI_ENOMEM;
   }
+  result->tx_attr->rma_iov_limit = DPA_RMA_IOV_LIMIT;
+  result->tx_attr->inject_size = DPA_INJECT_SIZE;
   
   *info = result;
   return FI_SUCCESS;
@@ -217,10 +224,9 @@ static int dpa_verify_requirements(uint32_t version, const char *node, const cha
  
 
   DPA_DEBUG("check capabilities\n");
-  int caps = get_ep_caps(hints);
-  if (caps < 0) return caps;
-  if ((caps | hints->caps) != caps)
-	VERIFY_FAIL_SPEC(hints->caps, caps, "%x");
+  uint64_t caps;
+  ret = get_ep_caps(hints, &caps);
+  if (ret) return ret;
 
   DPA_DEBUG("check endpoint and context attributes\n");
   ret = dpa_verify_attr(hints->ep_attr, hints->tx_attr, hints->rx_attr);
@@ -267,6 +273,12 @@ static int dpa_verify_tx_attr(struct fi_tx_attr *attr){
 
 	if ((attr->caps | DPA_EP_MSG_CAP) != DPA_EP_MSG_CAP)
 		return -FI_ENODATA;
+
+	if (attr->rma_iov_limit > DPA_RMA_IOV_LIMIT)
+		VERIFY_FAIL(attr->rma_iov_limit, DPA_RMA_IOV_LIMIT);
+
+	if (attr->inject_size > DPA_INJECT_SIZE)
+		VERIFY_FAIL(attr->inject_size, DPA_INJECT_SIZE);
 	
 	return FI_SUCCESS;
 }
@@ -309,25 +321,36 @@ static int dpa_verify_attr(struct fi_ep_attr *ep_attr, struct fi_tx_attr *tx_att
   return FI_SUCCESS;
 }
 
-static int get_ep_caps(struct fi_info* hints){
-  if (!hints) return DPA_EP_MSG_CAP;
+/**
+ * Capabilities for the requested endpoint type, narrowed to the hints.
+ * Caps use the upper bits (FI_RMA_EVENT), so they never go through an int.
+ */
+static int get_ep_caps(struct fi_info* hints, uint64_t* caps){
+  if (!hints) {
+    *caps = DPA_EP_MSG_CAP;
+    return FI_SUCCESS;
+  }
   enum fi_ep_type ep_type = hints->ep_attr ? hints->ep_attr->type : FI_EP_UNSPEC;
-  int caps;
+  uint64_t supported;
   switch (ep_type) {
   case FI_EP_UNSPEC:
   case FI_EP_MSG:
-	caps = DPA_EP_MSG_CAP;
+	supported = DPA_EP_MSG_CAP;
 	break;
   case FI_EP_RDM:
   case FI_EP_DGRAM:
-    caps = DPA_EP_RDM_CAP;
+    supported = DPA_EP_RDM_CAP;
     break;
   default:
 	VERIFY_FAIL(hints->ep_attr->type, FI_EP_MSG);
   }
-  if ((caps | hints->caps) != caps)
-	VERIFY_FAIL_SPEC(hints->caps, caps, "%x");
-  return hints->caps ? hints->caps : caps;
+  if ((supported | hints->caps) != supported)
+	VERIFY_FAIL_SPEC(hints->caps, supported, "0x%" PRIx64);
+  *caps = hints->caps ? hints->caps : supported;
+  // atomics ride the message ring, see DPA_EP_RDM_CAP
+  if (*caps & FI_ATOMIC)
+    *caps |= FI_MSG;
+  return FI_SUCCESS;
 }
   
   
@@ -32,36 +32,553 @@
  */
 #include "dpa.h"
 #include "dpa_mr.h"
+#include "dpa_ep.h"
+#include "dpa_cq.h"
+#include "dpa_cntr.h"
 #include "dpa_segments.h"
 #include "dpa_env.h"
+#include "table.h"
 
 #ifndef MR_MAP_SIZE_DEFAULT
-#define MR_MAP_SIZE_DEFAULT 251
+#define MR_MAP_SIZE_DEFAULT 256
 #endif
 DEFINE_ENV_CONST(size_t, MR_MAP_SIZE, MR_MAP_SIZE_DEFAULT);
+// remote CQ data ring of each initiator slot
+#ifndef RMA_CQ_DATA_ENTRIES_DEFAULT
+#define RMA_CQ_DATA_ENTRIES_DEFAULT 16
+#endif
+DEFINE_ENV_CONST(size_t, RMA_CQ_DATA_ENTRIES, RMA_CQ_DATA_ENTRIES_DEFAULT);
+// initiators that can report RMA events or CQ data to one key at the same time
+#ifndef MR_EVENT_SLOTS_DEFAULT
+#define MR_EVENT_SLOTS_DEFAULT 32
+#endif
+DEFINE_ENV_CONST(size_t, MR_EVENT_SLOTS, MR_EVENT_SLOTS_DEFAULT);
+#ifndef MR_ATTACH_USER_DEFAULT
+#define MR_ATTACH_USER_DEFAULT 1
+#endif
+DEFINE_ENV_CONST(int, MR_ATTACH_USER, MR_ATTACH_USER_DEFAULT);
+/* idle registrations kept per domain, only those attached to user memory.
+ * A cached segment keeps the pages it was attached to: only enable this
+ * if registered buffers are not freed and reallocated while cached. */
+#ifndef MR_CACHE_SIZE_DEFAULT
+#define MR_CACHE_SIZE_DEFAULT 0
+#endif
+DEFINE_ENV_CONST(size_t, MR_CACHE_SIZE, MR_CACHE_SIZE_DEFAULT);
+
+// keys handed out for FI_DPA_MR_PROV_KEY, below the message segments
+#ifndef MIN_MR_SEGMID_DEFAULT
+#define MIN_MR_SEGMID_DEFAULT (~((~(dpa_segmid_t)0) >> 2) & ((~(dpa_segmid_t)0) >> 1))
+#endif
+#ifndef MAX_MR_SEGMID_DEFAULT
+#define MAX_MR_SEGMID_DEFAULT (MIN_MR_SEGMID_DEFAULT + 65535)
+#endif
+DEFINE_ENV_CONST(dpa_segmid_t, MIN_MR_SEGMID, MIN_MR_SEGMID_DEFAULT);
+DEFINE_ENV_CONST(dpa_segmid_t, MAX_MR_SEGMID, MAX_MR_SEGMID_DEFAULT);
+#define MR_KEY_RANGE ((size_t) (MAX_MR_SEGMID - MIN_MR_SEGMID) + 1)
+
+// size classes of pooled segments, from MR_POOL_MIN_SIZE doubling each time.
+// Pooled segments carry no event area, see mr_wants_events
+#ifndef MR_POOL_MIN_SIZE
+#define MR_POOL_MIN_SIZE 4096
+#endif
+#ifndef MR_POOL_CLASSES
+#define MR_POOL_CLASSES 5
+#endif
+#ifndef MR_POOL_DEPTH_DEFAULT
+#define MR_POOL_DEPTH_DEFAULT 4
+#endif
+DEFINE_ENV_CONST(size_t, MR_POOL_DEPTH, MR_POOL_DEPTH_DEFAULT);
+#define MR_POOL_SEGMENT_SIZE(class) ((size_t) MR_POOL_MIN_SIZE << (class))
+
+#define MR_ALIGN(size) ((((size) + MR_DATA_ALIGN - 1) / MR_DATA_ALIGN) * MR_DATA_ALIGN)
+#define MR_SLOT_OFFSET MR_ALIGN(sizeof(mr_event_area))
+#define MR_SLOT_STRIDE MR_ALIGN(sizeof(mr_initiator) +                  \
+                                RMA_CQ_DATA_ENTRIES * sizeof(rma_cq_data))
+#define MR_DATA_OFFSET (MR_SLOT_OFFSET + MR_EVENT_SLOTS * MR_SLOT_STRIDE)
 
-static hash_map* mr_map = NULL;
+static table* mr_map = NULL;
+
+static struct {
+  fastlock_t lock;
+  dpa_segmid_t next;
+} mr_keys;
+
+typedef struct mr_pool_entry {
+  local_segment_info info;
+  int numa_node;
+  slist_entry list_entry;
+} mr_pool_entry;
+
+static slist mr_pool[MR_POOL_CLASSES];
+static size_t mr_pool_count[MR_POOL_CLASSES];
+static pthread_once_t mr_pool_once = PTHREAD_ONCE_INIT;
 
 void dpa_mr_init(){
   ENV_OVERRIDE_INT(MR_MAP_SIZE);
-  mr_map = hash_create(dpa_fid_mr, segment_info.segmentId, MR_MAP_SIZE, NULL);
+  ENV_OVERRIDE_INT(RMA_CQ_DATA_ENTRIES);
+  ENV_OVERRIDE_INT(MR_EVENT_SLOTS);
+  ENV_OVERRIDE_INT(MR_ATTACH_USER);
+  ENV_OVERRIDE_INT(MR_CACHE_SIZE);
+  ENV_OVERRIDE_INT(MIN_MR_SEGMID);
+  ENV_OVERRIDE_INT(MAX_MR_SEGMID);
+  ENV_OVERRIDE_INT(MR_POOL_DEPTH);
+  mr_map = table_create(MR_MAP_SIZE);
+  fastlock_init(&mr_keys.lock);
+  mr_keys.next = MIN_MR_SEGMID;
+  for (int i = 0; i < MR_POOL_CLASSES; i++) {
+    slist_init(&mr_pool[i]);
+    mr_pool_count[i] = 0;
+  }
 }
 
 void dpa_mr_fini() {
-  hash_destroy(mr_map, no_destroyer);
+  for (int i = 0; i < MR_POOL_CLASSES; i++) {
+    slist_entry* e;
+    while ((e = slist_remove_head(&mr_pool[i]))) {
+      mr_pool_entry* entry = container_of(e, mr_pool_entry, list_entry);
+      dpa_destroy_segment(entry->info);
+      free(entry);
+    }
+    fastlock_destroy(&mr_pool[i].lock);
+  }
+  fastlock_destroy(&mr_keys.lock);
+  table_destroy(mr_map);
+}
+
+dpa_fid_mr* dpa_mr_lookup(uint64_t key, table_readers** readers) {
+  dpa_segmid_t segmentId = (dpa_segmid_t) mr_key_segment(key);
+  *readers = NULL;
+  if (segmentId != mr_key_segment(key)) return NULL;
+  return table_get_held(mr_map, segmentId, readers);
+}
+
+void dpa_mr_unlock(table_readers* readers) {
+  if (readers) table_read_unlock(readers);
 }
 
 static int dpa_mr_close(struct fid *fid);
 static int dpa_mr_bind(struct fid *fid, struct fid *bfid, uint64_t flags);
+static int dpa_mr_handle_close(struct fid *fid);
+static int dpa_mr_handle_bind(struct fid *fid, struct fid *bfid, uint64_t flags);
 
 static struct fi_ops dpa_fi_ops = {
   .size = sizeof(struct fi_ops),
   .close = dpa_mr_close,
-  .bind = fi_no_bind,
+  .bind = dpa_mr_bind,
   .control = fi_no_control,
   .ops_open = fi_no_ops_open
 };
 
+static struct fi_ops dpa_handle_ops = {
+  .size = sizeof(struct fi_ops),
+  .close = dpa_mr_handle_close,
+  .bind = dpa_mr_handle_bind,
+  .control = fi_no_control,
+  .ops_open = fi_no_ops_open
+};
+
+dpa_fid_mr* dpa_mr_from_fid(struct fid* fid) {
+  if (fid->ops == &dpa_handle_ops)
+    return container_of(fid, dpa_mr_handle, mr.fid)->shared;
+  return container_of(fid, dpa_fid_mr, mr.fid);
+}
+
+
+static void event_area_initializer(local_segment_info* info) {
+  mr_event_area* events = (mr_event_area*) info->base;
+  memset(events, 0, MR_DATA_OFFSET);
+  events->data_offset = MR_DATA_OFFSET;
+  events->data_len = info->size - MR_DATA_OFFSET;
+  events->ring_size = RMA_CQ_DATA_ENTRIES;
+  events->slot_count = MR_EVENT_SLOTS;
+  events->slot_offset = MR_SLOT_OFFSET;
+  events->slot_stride = MR_SLOT_STRIDE;
+  events->magic = MR_EVENT_MAGIC;
+}
+
+static dpa_callback_action_t mr_event_interrupt_callback(void *arg,
+                                                         dpa_local_interrupt_t interrupt,
+                                                         dpa_error_t status) {
+  mr_progress_events((dpa_fid_mr*) arg);
+  return DPA_CALLBACK_CONTINUE;
+}
+
+static dpa_error_t create_event_interrupt(dpa_fid_mr* mr) {
+  dpa_error_t error;
+  dpa_intid_t interruptId;
+  DPA_DEBUG("Opening MR event virtual device\n");
+  DPAOpen(&mr->event_sd, NO_FLAGS, &error);
+  DPALIB_CHECK_ERROR(DPAOpen, return error);
+
+  // MR events are carried by the first rail
+  size_t rail = 0;
+  DPA_DEBUG("Creating MR event interrupt\n");
+  DPACreateInterrupt(mr->event_sd, &mr->event_interrupt, dpaRails[rail],
+                     &interruptId, mr_event_interrupt_callback, mr,
+                     DPA_FLAG_USE_CALLBACK, &error);
+  DPALIB_CHECK_ERROR(DPACreateInterrupt, goto event_interrupt_close);
+
+  mr->events->interruptRail = rail;
+  mr->events->interruptId = interruptId;
+  mr->events->hasInterrupt = 1;
+  return DPA_ERR_OK;
+
+ event_interrupt_close:
+  DPAClose(mr->event_sd, NO_FLAGS, &error);
+  mr->event_sd = NULL;
+  return error;
+}
+
+static void mr_destroy(dpa_fid_mr* mr);
+
+void mr_cache_init(mr_cache* cache) {
+  memset(cache, 0, sizeof(mr_cache));
+  fastlock_init(&cache->lock);
+  dlist_init_unsafe(&cache->lru);
+}
+
+// position of the first registration starting at or after buf
+static size_t mr_cache_bound(mr_cache* cache, uintptr_t buf) {
+  size_t low = 0, high = cache->count;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if ((uintptr_t) cache->index[mid]->buf < buf) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+static int mr_cache_insert(mr_cache* cache, dpa_fid_mr* mr) {
+  if (cache->count == cache->capacity) {
+    size_t capacity = cache->capacity ? 2 * cache->capacity : 16;
+    dpa_fid_mr** index = realloc(cache->index, capacity * sizeof(dpa_fid_mr*));
+    if (!index) return 0;
+    cache->index = index;
+    cache->capacity = capacity;
+  }
+  size_t pos = mr_cache_bound(cache, (uintptr_t) mr->buf);
+  memmove(&cache->index[pos + 1], &cache->index[pos],
+          (cache->count - pos) * sizeof(dpa_fid_mr*));
+  cache->index[pos] = mr;
+  cache->count++;
+  cache->max_len = MAX(cache->max_len, mr->len);
+  return 1;
+}
+
+static void mr_cache_remove(mr_cache* cache, dpa_fid_mr* mr) {
+  size_t pos = mr_cache_bound(cache, (uintptr_t) mr->buf);
+  while (pos < cache->count && cache->index[pos] != mr) pos++;
+  if (pos == cache->count) return;
+  memmove(&cache->index[pos], &cache->index[pos + 1],
+          (cache->count - pos - 1) * sizeof(dpa_fid_mr*));
+  cache->count--;
+}
+
+/**
+ * A registration containing [buf, buf+len). Provider keys can point
+ * anywhere inside it, see mr_key; a requested key must be the segment
+ * id of a registration starting at buf.
+ */
+static dpa_fid_mr* mr_cache_find(mr_cache* cache, const void* buf, size_t len,
+                                 int any_key, dpa_segmid_t segmentId) {
+  uintptr_t start = (uintptr_t) buf;
+  size_t pos = mr_cache_bound(cache, start + 1);
+  while (pos-- > 0) {
+    dpa_fid_mr* mr = cache->index[pos];
+    uintptr_t mr_start = (uintptr_t) mr->buf;
+    if (mr_start + cache->max_len < start + len) break;
+    if (mr_start + mr->len < start + len) continue;
+    if (any_key ? !((start - mr_start) >> MR_KEY_OFFSET_SHIFT) :
+        mr_start == start && mr->segment_info.segmentId == segmentId)
+      return mr;
+  }
+  return NULL;
+}
+
+/**
+ * Must be called with the cache lock held, on an idle registration.
+ * Destruction waits for a table grace period, so the registration is
+ * only moved to victims, for mr_destroy_victims once the lock is dropped.
+ */
+static void mr_cache_evict(mr_cache* cache, dpa_fid_mr* mr, dlist_entry* victims) {
+  dlist_remove_unsafe(&mr->lru_entry);
+  cache->idle--;
+  mr_cache_remove(cache, mr);
+  cache->evictions++;
+  dlist_insert_before_unsafe(&mr->lru_entry, victims);
+}
+
+static void mr_destroy_victims(dlist_entry* victims) {
+  while (!dlist_empty(victims)) {
+    dpa_fid_mr* mr = container_of(victims->next, dpa_fid_mr, lru_entry);
+    dlist_remove_unsafe(&mr->lru_entry);
+    mr_destroy(mr);
+  }
+}
+
+/**
+ * Drop idle registrations overlapping [buf, buf+len),
+ * which would otherwise pin stale mappings of that range.
+ */
+static void mr_cache_evict_overlaps(mr_cache* cache, const void* buf, size_t len,
+                                    dlist_entry* victims) {
+  uintptr_t start = (uintptr_t) buf;
+  size_t pos = mr_cache_bound(cache, start + len);
+  while (pos-- > 0) {
+    dpa_fid_mr* mr = cache->index[pos];
+    uintptr_t mr_start = (uintptr_t) mr->buf;
+    if (mr_start + cache->max_len <= start) break;
+    if (!mr->refcount && mr_start + mr->len > start)
+      mr_cache_evict(cache, mr, victims);
+  }
+}
+
+/**
+ * An idle registration of this domain may still hold the requested key.
+ * Cached registrations are only freed under their cache lock, the table
+ * read side covers the ones of other domains while we look at them.
+ */
+static void mr_cache_evict_key(mr_cache* cache, dpa_segmid_t segmentId) {
+  dlist_entry victims;
+  dlist_init_unsafe(&victims);
+  fastlock_acquire(&cache->lock);
+  table_readers* readers;
+  dpa_fid_mr* mr = table_get_held(mr_map, segmentId, &readers);
+  int evict = mr && mr->cached && &mr->domain->mr_cache == cache && !mr->refcount;
+  table_read_unlock(readers);
+  if (evict)
+    mr_cache_evict(cache, mr, &victims);
+  fastlock_release(&cache->lock);
+  mr_destroy_victims(&victims);
+}
+
+static void mr_unbind_events(dpa_fid_mr* mr) {
+  if (mr->event_listed) {
+    dlist_remove(&mr->event_entry, &mr->domain->event_mrs);
+    mr->event_listed = 0;
+  }
+  if (mr->events) {
+    volatile mr_event_area* events = mr->events;
+    events->rma_events = 0;
+    for (size_t i = 0; i < events->slot_count; i++) {
+      volatile mr_initiator* slot = mr_slot(events, events->slot_offset,
+                                            events->slot_stride, i);
+      mr->seen[i].write = slot->write_tail;
+      mr->seen[i].read = slot->read_tail;
+    }
+  }
+  mr->write_cq = mr->read_cq = NULL;
+  mr->write_cntr = mr->read_cntr = NULL;
+  mr->ep = NULL;
+}
+
+// must be called with the cache lock held, when the last handle is closed
+static void mr_cache_release(mr_cache* cache, dpa_fid_mr* mr, dlist_entry* victims) {
+  // bound queues and counters may be closed while the registration is idle
+  mr_unbind_events(mr);
+  dlist_insert_before_unsafe(&mr->lru_entry, &cache->lru);
+  cache->idle++;
+  while (cache->idle > MR_CACHE_SIZE)
+    mr_cache_evict(cache, container_of(cache->lru.next, dpa_fid_mr, lru_entry), victims);
+}
+
+void mr_cache_fini(mr_cache* cache) {
+  dlist_entry victims;
+  dlist_init_unsafe(&victims);
+  fastlock_acquire(&cache->lock);
+  while (!dlist_empty(&cache->lru))
+    mr_cache_evict(cache, container_of(cache->lru.next, dpa_fid_mr, lru_entry), &victims);
+  fastlock_release(&cache->lock);
+  mr_destroy_victims(&victims);
+  if (cache->hits || cache->misses)
+    DPA_INFO("MR cache: %lu hits, %lu misses, %lu evictions\n",
+             cache->hits, cache->misses, cache->evictions);
+  free(cache->index);
+  fastlock_destroy(&cache->lock);
+}
+
+/**
+ * Try to make the user buffer itself remotely accessible.
+ * Attached segments carry no control area, so they cannot receive
+ * remote CQ data or report RMA events.
+ */
+static inline int can_attach(const void* buf, size_t len) {
+#ifdef HAVE_DPA_REGISTER_SEGMENT_MEMORY
+  long page_size = sysconf(_SC_PAGESIZE);
+  return MR_ATTACH_USER && buf && len && page_size > 0 &&
+    !((uintptr_t) buf % page_size) && !(len % page_size);
+#else
+  return 0;
+#endif
+}
+
+static int attach_user_segment(local_segment_info* info, dpa_segmid_t segmentId,
+                               const void* buf, size_t len, dpa_error_t* error) {
+#ifdef HAVE_DPA_REGISTER_SEGMENT_MEMORY
+  if (!can_attach(buf, len))
+    return 0;
+  *error = dpa_attach_segment(info, segmentId, (void*) buf, len, NULL);
+  if (*error == DPA_ERR_OK) return 1;
+  DPA_DEBUG("Cannot attach user memory to segment %u, allocating it\n", segmentId);
+#endif
+  return 0;
+}
+
+static dpa_segmid_t mr_next_key() {
+  fastlock_acquire(&mr_keys.lock);
+  dpa_segmid_t segmentId = mr_keys.next;
+  mr_keys.next = segmentId >= MAX_MR_SEGMID ? MIN_MR_SEGMID : segmentId + 1;
+  fastlock_release(&mr_keys.lock);
+  return segmentId;
+}
+
+/**
+ * Allocate a segment under the first free key of the provider range.
+ * Keys are node-wide, so ids used by other processes are skipped too.
+ */
+static dpa_error_t mr_alloc_prov_segment(local_segment_info* info, size_t size,
+                                         segment_initializer initializer, int numa_node) {
+  dpa_error_t error = DPA_ERR_SEGMENTID_USED;
+  for (size_t attempt = 0; attempt < MR_KEY_RANGE && error == DPA_ERR_SEGMENTID_USED;
+       attempt++) {
+    dpa_segmid_t segmentId = mr_next_key();
+    if (!table_get(mr_map, segmentId))
+      error = dpa_alloc_segment(info, segmentId, size, initializer,
+                                NULL, NULL, numa_node);
+  }
+  return error;
+}
+
+static inline int mr_pool_class(size_t len) {
+  for (int i = 0; i < MR_POOL_CLASSES; i++)
+    if (len <= ((size_t) MR_POOL_MIN_SIZE << i)) return i;
+  return -1;
+}
+
+/**
+ * Put an idle segment in its pool class, unless the class is full.
+ * Idle segments are unavailable, so nobody connects to a key before
+ * it is registered. Takes ownership of the segment.
+ */
+static int mr_pool_keep(local_segment_info* info, int numa_node) {
+  int class = mr_pool_class(info->size);
+  mr_pool_entry* entry = class < 0 ? NULL : malloc(sizeof(mr_pool_entry));
+  if (!entry) goto mr_pool_drop;
+  slist* pool = &mr_pool[class];
+  slist_lock(pool);
+  int keep = mr_pool_count[class] < MR_POOL_DEPTH;
+  if (keep) mr_pool_count[class]++;
+  slist_unlock(pool);
+  if (!keep) goto mr_pool_drop;
+  if (dpa_set_segment_available(info, 0) != DPA_ERR_OK) {
+    slist_lock(pool);
+    mr_pool_count[class]--;
+    slist_unlock(pool);
+    goto mr_pool_drop;
+  }
+  entry->info = *info;
+  entry->numa_node = numa_node;
+  slist_lock(pool);
+  slist_insert_tail_unsafe(&entry->list_entry, pool);
+  slist_unlock(pool);
+  return 1;
+
+ mr_pool_drop:
+  free(entry);
+  dpa_destroy_segment(*info);
+  return 0;
+}
+
+static int mr_pool_add(int class, int numa_node) {
+  local_segment_info info;
+  if (mr_alloc_prov_segment(&info, MR_POOL_SEGMENT_SIZE(class), NULL, numa_node) != DPA_ERR_OK) {
+    DPA_WARN("Cannot pre-create MR segments of %zu bytes\n",
+             (size_t) MR_POOL_MIN_SIZE << class);
+    return 0;
+  }
+  return mr_pool_keep(&info, numa_node);
+}
+
+static int mr_pool_fill_node = FI_DPA_NUMA_ANY;
+
+static void mr_pool_fill_once() {
+  for (int i = 0; i < MR_POOL_CLASSES; i++)
+    while (mr_pool_count[i] < MR_POOL_DEPTH && mr_pool_add(i, mr_pool_fill_node));
+}
+
+/**
+ * Pre-create the pooled segments on the node of the first domain, so
+ * small registrations with provider keys skip segment creation entirely.
+ */
+void mr_pool_fill(int numa_node) {
+  if (!MR_POOL_DEPTH) return;
+  mr_pool_fill_node = numa_node;
+  pthread_once(&mr_pool_once, mr_pool_fill_once);
+}
+
+static int mr_pool_match_node(slist_entry* item, const void* arg) {
+  return container_of(item, mr_pool_entry, list_entry)->numa_node == *(const int*) arg;
+}
+
+static int mr_pool_get(local_segment_info* info, size_t len, int numa_node) {
+  int class = mr_pool_class(len);
+  if (class < 0 || !MR_POOL_DEPTH) return 0;
+  slist* pool = &mr_pool[class];
+  slist_lock(pool);
+  slist_entry* e = slist_remove_first_match_unsafe(pool, mr_pool_match_node, &numa_node);
+  if (e) mr_pool_count[class]--;
+  slist_unlock(pool);
+  // allocate at class size anyway, so the segment can be pooled on release
+  if (!e)
+    return mr_alloc_prov_segment(info, MR_POOL_SEGMENT_SIZE(class), NULL,
+                                 numa_node) == DPA_ERR_OK;
+  mr_pool_entry* entry = container_of(e, mr_pool_entry, list_entry);
+  *info = entry->info;
+  free(entry);
+  if (dpa_set_segment_available(info, 1) == DPA_ERR_OK) return 1;
+  dpa_destroy_segment(*info);
+  return 0;
+}
+
+/**
+ * Release a pooled segment: it goes back to its class under the same
+ * key, nothing is created or destroyed unless the class is full.
+ * Pooled segments hold data only, there is no event area to reset.
+ * Initiators still connected keep mapping the same memory, as with any
+ * key used after the registration was closed.
+ */
+static void mr_pool_put(local_segment_info info, int numa_node) {
+  mr_pool_keep(&info, numa_node);
+}
+
+/**
+ * Whether a registration needs an event area: the application asked for
+ * RMA events or remote CQ data on it, or for RMA events on the domain.
+ * Anything else is pure data, which keeps small registrations small.
+ */
+static inline int mr_wants_events(dpa_fid_domain* domain, uint64_t flags) {
+  return (flags & (FI_RMA_EVENT | FI_REMOTE_CQ_DATA)) || (domain->caps & FI_RMA_EVENT);
+}
+
+static dpa_error_t mr_create_prov_segment(local_segment_info* info, const void* buf,
+                                          size_t len, int events, int numa_node,
+                                          int* attached, int* pooled) {
+  if (events)
+    return mr_alloc_prov_segment(info, MR_DATA_OFFSET + len, event_area_initializer,
+                                 numa_node);
+  dpa_error_t error = DPA_ERR_SEGMENTID_USED;
+  for (size_t attempt = 0; can_attach(buf, len) && attempt < MR_KEY_RANGE &&
+         error == DPA_ERR_SEGMENTID_USED; attempt++) {
+    dpa_segmid_t segmentId = mr_next_key();
+    if (!table_get(mr_map, segmentId))
+      *attached = attach_user_segment(info, segmentId, buf, len, &error);
+  }
+  if (*attached) return DPA_ERR_OK;
+  // small registrations that cannot be attached come from the pool
+  *pooled = mr_pool_get(info, len, numa_node);
+  if (*pooled) return DPA_ERR_OK;
+  return mr_alloc_prov_segment(info, len, NULL, numa_node);
+}
 
 int dpa_mr_reg(struct fid *fid, const void *buf, size_t len,
                uint64_t access, uint64_t offset, uint64_t requested_key, uint64_t flags,
@@ -72,17 +589,81 @@ int dpa_mr_reg(struct fid *fid, const void *buf, size_t len,
   if (domain_priv->mr_mode == FI_MR_BASIC)
     return -FI_EBADFLAGS;
 
+  int prov_key = (flags & FI_DPA_MR_PROV_KEY) != 0;
+  int events = mr_wants_events(domain_priv, flags);
   dpa_segmid_t segmentId = (dpa_segmid_t) requested_key;
-  if (segmentId != requested_key)
+  if (!prov_key && segmentId != requested_key)
     return -FI_EKEYREJECTED; // truncation occurred, so requested key cannot be used
+
+  mr_cache* cache = &domain_priv->mr_cache;
+  // event areas cannot live in user memory, those are never cached
+  int use_cache = MR_CACHE_SIZE && buf && len && !events;
+  if (use_cache) {
+    dlist_entry victims;
+    dlist_init_unsafe(&victims);
+    fastlock_acquire(&cache->lock);
+    dpa_fid_mr* cached = mr_cache_find(cache, buf, len, prov_key, segmentId);
+    if (cached) {
+      // each registration gets a handle of its own on the shared segment
+      size_t delta = (uintptr_t) buf - (uintptr_t) cached->buf;
+      dpa_mr_handle* handle = ALLOC_INIT(dpa_mr_handle, {
+          .mr = {
+            .fid = {
+              .fclass = FI_CLASS_MR,
+              .context = context,
+              .ops = &dpa_handle_ops,
+            },
+            .mem_desc = cached->mr.mem_desc + delta,
+            .key = mr_key(cached->segment_info.segmentId, delta)
+          },
+          .shared = cached
+        });
+      if (!handle) {
+        fastlock_release(&cache->lock);
+        return -FI_ENOMEM;
+      }
+      if (!cached->refcount++) {
+        dlist_remove_unsafe(&cached->lru_entry);
+        cache->idle--;
+      }
+      cached->access |= access;
+      cache->hits++;
+      fastlock_release(&cache->lock);
+      *mr = &handle->mr;
+      return 0;
+    }
+    cache->misses++;
+    mr_cache_evict_overlaps(cache, buf, len, &victims);
+    fastlock_release(&cache->lock);
+    mr_destroy_victims(&victims);
+    if (!prov_key)
+      mr_cache_evict_key(cache, segmentId);
+  }
   
   local_segment_info info;
-  dpa_error_t error = dpa_alloc_segment(&info, segmentId, len, NULL, NULL, NULL);
+  dpa_error_t error = DPA_ERR_OK;
+  int attached = 0, pooled = 0;
+  // remote nodes write into registrations through the adapter, like rings
+  int numa_node = numa_resolve(domain_priv->numa.ring_node);
+  if (prov_key)
+    error = mr_create_prov_segment(&info, buf, len, events, numa_node,
+                                   &attached, &pooled);
+  else {
+    if (!events)
+      attached = attach_user_segment(&info, segmentId, buf, len, &error);
+    if (!attached && error != DPA_ERR_SEGMENTID_USED)
+      error = dpa_alloc_segment(&info, segmentId, (events ? MR_DATA_OFFSET : 0) + len,
+                                events ? event_area_initializer : NULL,
+                                NULL, NULL, numa_node);
+  }
+  events = events && !attached;
+  size_t data_offset = events ? MR_DATA_OFFSET : 0;
 
   if (error == DPA_ERR_SEGMENTID_USED)
     return -FI_ENOKEY;
   else if (error != DPA_ERR_OK)
     return -FI_EOTHER;
+  segmentId = info.segmentId;
   
   dpa_fid_mr* mr_priv = ALLOC_INIT(dpa_fid_mr, {
       .mr = {
@@ -91,7 +672,7 @@ int dpa_mr_reg(struct fid *fid, const void *buf, size_t len,
           .context = context,
           .ops = &dpa_fi_ops,
         },
-        .mem_desc = (void*) info.base,
+        .mem_desc = (void*) info.base + data_offset,
         .key = info.segmentId
       },
       .segment_info = info,
@@ -99,19 +680,260 @@ int dpa_mr_reg(struct fid *fid, const void *buf, size_t len,
       .len = len,
       .access = access,
       .flags = flags,
-      .domain = domain_priv
+      .domain = domain_priv,
+      .ep = NULL,
+      .events = events ? info.base : NULL,
+      .event_sd = NULL,
+      .event_interrupt = NULL,
+      .event_listed = 0,
+      .seen = NULL,
+      .write_cq = NULL,
+      .read_cq = NULL,
+      .write_cntr = NULL,
+      .read_cntr = NULL,
+      .cached = 0,
+      .pooled = pooled,
+      .numa_node = numa_node,
+      .refcount = 1,
     });
+  fastlock_init(&mr_priv->event_lock);
+  if (mr_priv->events) {
+    mr_priv->seen = calloc(mr_priv->events->slot_count, sizeof(mr_slot_seen));
+    if (!mr_priv->seen) {
+      mr_destroy(mr_priv);
+      return -FI_ENOMEM;
+    }
+  }
 
-  hash_put(mr_map, mr_priv);
+  // with automatic progress remote CQ data is consumed on interrupt
+  if (mr_priv->events && domain_priv->data_progress == FI_PROGRESS_AUTO &&
+      PROGRESS_CALLBACKS && create_event_interrupt(mr_priv) != DPA_ERR_OK)
+    DPA_WARN("Remote CQ data for key %u will only be polled\n", segmentId);
+
+  if (table_put(mr_map, segmentId, mr_priv)) {
+    mr_destroy(mr_priv);
+    return -FI_ENOMEM;
+  }
+  /* a provider segment only holds data copied in through mem_desc,
+   * a later registration of the same buffer cannot reuse it */
+  if (use_cache && attached) {
+    fastlock_acquire(&cache->lock);
+    mr_priv->cached = mr_cache_insert(cache, mr_priv);
+    fastlock_release(&cache->lock);
+  }
   
   *mr = &(mr_priv->mr);
   return 0;
 }
 
+// keep the segment around, deregistration is deferred to eviction
+static void mr_cache_put(dpa_fid_mr* mr) {
+  mr_cache* cache = &mr->domain->mr_cache;
+  dlist_entry victims;
+  dlist_init_unsafe(&victims);
+  fastlock_acquire(&cache->lock);
+  if (!--mr->refcount)
+    mr_cache_release(cache, mr, &victims);
+  fastlock_release(&cache->lock);
+  mr_destroy_victims(&victims);
+}
+
 static int dpa_mr_close(struct fid *fid){
   dpa_fid_mr *mr = container_of(fid, dpa_fid_mr, mr.fid);
-  hash_remove(mr_map, &(mr->segment_info.segmentId));
-  dpa_destroy_segment(mr->segment_info);
+  if (mr->cached) {
+    mr_cache_put(mr);
+    return 0;
+  }
+  mr_destroy(mr);
+  return 0;
+}
+
+static int dpa_mr_handle_close(struct fid *fid) {
+  dpa_mr_handle* handle = container_of(fid, dpa_mr_handle, mr.fid);
+  mr_cache_put(handle->shared);
+  free(handle);
+  return 0;
+}
+
+static void mr_destroy(dpa_fid_mr* mr) {
+  table_remove(mr_map, mr->segment_info.segmentId);
+  // let lookups still using the registration finish with it
+  table_synchronize(mr_map);
+  if (mr->event_listed)
+    dlist_remove(&mr->event_entry, &mr->domain->event_mrs);
+  if (mr->event_interrupt) {
+    dpa_error_t error;
+    DPARemoveInterrupt(mr->event_interrupt, NO_FLAGS, &error);
+    DPALIB_CHECK_ERROR(DPARemoveInterrupt, );
+    DPAClose(mr->event_sd, NO_FLAGS, &error);
+    DPALIB_CHECK_ERROR(DPAClose, );
+  }
+  if (mr->pooled)
+    mr_pool_put(mr->segment_info, mr->numa_node);
+  else
+    dpa_destroy_segment(mr->segment_info);
+  fastlock_destroy(&mr->event_lock);
+  free(mr->seen);
   free(mr);
+}
+
+#define CHECK_MR_DOMAIN(mr, bnd)                                        \
+  if (mr->domain != bnd->domain){                                       \
+    DPA_WARN("Binding" #bnd "to memory region on a different domain\n"); \
+    return -FI_EINVAL;                                                  \
+  }
+
+static int dpa_mr_bind(struct fid *fid, struct fid *bfid, uint64_t flags) {
+  if (!bfid) return -FI_EINVAL;
+  if (!(flags & (FI_REMOTE_WRITE | FI_REMOTE_READ))) return -FI_EBADFLAGS;
+
+  dpa_fid_mr* mr = container_of(fid, dpa_fid_mr, mr.fid);
+  if (!mr->events) {
+    DPA_WARN("Memory region %u has no event area, register it with FI_RMA_EVENT\n",
+             mr->segment_info.segmentId);
+    return -FI_ENOSYS;
+  }
+  switch (bfid->fclass) {
+  case FI_CLASS_CQ:
+    DPA_DEBUG("Binding completion queue to memory region\n");
+    dpa_fid_cq* cq = container_of(bfid, dpa_fid_cq, cq.fid);
+    CHECK_MR_DOMAIN(mr, cq);
+    if (flags & FI_REMOTE_WRITE) mr->write_cq = cq;
+    if (flags & FI_REMOTE_READ) mr->read_cq = cq;
+    break;
+  case FI_CLASS_CNTR:
+    DPA_DEBUG("Binding counter to memory region\n");
+    dpa_fid_cntr* cntr = container_of(bfid, dpa_fid_cntr, cntr.fid);
+    CHECK_MR_DOMAIN(mr, cntr);
+    if (flags & FI_REMOTE_WRITE) mr->write_cntr = cntr;
+    if (flags & FI_REMOTE_READ) mr->read_cntr = cntr;
+    break;
+  default:
+    DPA_WARN("Cannot bind bfid->fclass %zu to memory region\n", bfid->fclass);
+    return -FI_ENOSYS;
+  }
+
+  // from now on initiators report every access to this key
+  mr->events->rma_events = 1;
+  if (!mr->event_listed) {
+    dlist_insert_tail(&mr->event_entry, &mr->domain->event_mrs.list,
+                      &mr->domain->event_mrs);
+    mr->event_listed = 1;
+  }
+  return FI_SUCCESS;
+}
+
+static int dpa_mr_handle_bind(struct fid *fid, struct fid *bfid, uint64_t flags) {
+  return dpa_mr_bind(&dpa_mr_from_fid(fid)->mr.fid, bfid, flags);
+}
+
+static inline void report_rma_events(dpa_fid_cq* cq, dpa_fid_cntr* cntr,
+                                     uint64_t flags, uint64_t count) {
+  if (cntr)
+    cntr->cntr.ops->add(&cntr->cntr, count);
+  if (!cq) return;
+  struct fi_cq_err_entry entry = {
+    .op_context = NULL,
+    .flags = flags,
+    .len = 0,
+    .buf = NULL,
+    .data = 0,
+    .err = FI_SUCCESS
+  };
+  for (uint64_t i = 0; i < count; i++)
+    cq_add(cq, &entry);
+}
+
+static inline int slot_has_events(volatile mr_initiator* slot, mr_slot_seen* seen) {
+  uint64_t owner = slot->owner;
+  if (!owner)
+    return slot->request != 0;
+  return slot->write_tail != seen->write || slot->read_tail != seen->read ||
+    slot->cq_data_head != slot->cq_data_tail || slot->release == owner;
+}
+
+static inline int has_events(volatile mr_event_area* events, dpa_fid_mr* mr) {
+  for (size_t i = 0; i < events->slot_count; i++)
+    if (slot_has_events(mr_slot(events, events->slot_offset,
+                                events->slot_stride, i), &mr->seen[i]))
+      return 1;
   return 0;
 }
+
+/**
+ * Report what the owner of a slot counted and posted since the last
+ * call, recycle the slot once its owner released it and its ring is
+ * drained, and grant free slots to pending requests.
+ * Must be called with the event lock held.
+ */
+static inline void mr_progress_slot(dpa_fid_mr* mr, uint32_t ring_size,
+                                    volatile mr_initiator* slot, mr_slot_seen* seen,
+                                    dpa_fid_cq* cq) {
+  uint64_t owner = slot->owner;
+  if (!owner) {
+    uint64_t request = slot->request;
+    if (mr_slot_current(request, slot->generation))
+      __atomic_store_n(&slot->owner, request, __ATOMIC_RELEASE);
+    return;
+  }
+  // the owner releases after its last report, so check before reading them
+  uint8_t released = slot->release == owner;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  uint64_t write_tail = slot->write_tail;
+  uint64_t read_tail = slot->read_tail;
+  report_rma_events(mr->write_cq, mr->write_cntr, FI_RMA | FI_REMOTE_WRITE,
+                    write_tail - seen->write);
+  report_rma_events(mr->read_cq, mr->read_cntr, FI_RMA | FI_REMOTE_READ,
+                    read_tail - seen->read);
+  seen->write = write_tail;
+  seen->read = read_tail;
+
+  // entries stay in the ring until someone can receive them
+  uint64_t head = slot->cq_data_head;
+  uint64_t tail = slot->cq_data_tail;
+  while ((cq || mr->write_cntr) && head != tail) {
+    volatile rma_cq_data* cq_data = &slot->cq_data[head % ring_size];
+    struct fi_cq_err_entry entry = {
+      .op_context = NULL,
+      .flags = FI_RMA | FI_REMOTE_WRITE | FI_REMOTE_CQ_DATA,
+      .len = cq_data->len,
+      .buf = mr->mr.mem_desc + cq_data->offset,
+      .data = cq_data->data,
+      .err = FI_SUCCESS
+    };
+    if (cq) cq_add(cq, &entry);
+    if (mr->write_cntr) dpa_cntr_inc(mr->write_cntr);
+    slot->cq_data_head = ++head;
+  }
+
+  if (!released || head != tail) return;
+  slot->write_tail = slot->read_tail = 0;
+  slot->cq_data_head = slot->cq_data_tail = 0;
+  seen->write = seen->read = 0;
+  slot->generation++;
+  __atomic_store_n(&slot->owner, 0, __ATOMIC_RELEASE);
+}
+
+void mr_progress_events(dpa_fid_mr* mr) {
+  volatile mr_event_area* events = mr->events;
+  if (!events || !has_events(events, mr))
+    return;
+
+  fastlock_acquire(&mr->event_lock);
+  dpa_fid_cq* cq = mr->write_cq ? mr->write_cq :
+    (mr->ep ? mr->ep->recv_cq : NULL);
+  for (size_t i = 0; i < events->slot_count; i++)
+    mr_progress_slot(mr, events->ring_size,
+                     mr_slot(events, events->slot_offset, events->slot_stride, i),
+                     &mr->seen[i], cq);
+  fastlock_release(&mr->event_lock);
+}
+
+void mr_progress_domain_events(dpa_fid_domain* domain) {
+  dlist* list = &domain->event_mrs;
+  if (dlist_empty(&list->list)) return;
+  fastlock_acquire(&list->lock);
+  for (dlist_entry* e = list->list.next; e != &list->list; e = e->next)
+    mr_progress_events(container_of(e, dpa_fid_mr, event_entry));
+  fastlock_release(&list->lock);
+}
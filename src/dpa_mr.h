@@ -37,19 +37,149 @@ typedef struct dpa_fid_mr dpa_fid_mr;
 
 #include "dpa_domain.h"
 #include "dpa_segments.h"
+#include "table.h"
+
+#define MR_EVENT_MAGIC 0x5354564541504444ULL
+#define MR_DATA_ALIGN 64
+
+/* Keys are segment ids. A registration served from inside a larger cached
+ * one also carries its offset in that segment above the id, since remote
+ * offsets are relative to the start of the segment. */
+#define MR_KEY_OFFSET_SHIFT 32
+
+static inline uint64_t mr_key(dpa_segmid_t segmentId, uint64_t offset) {
+  return (uint64_t) segmentId | offset << MR_KEY_OFFSET_SHIFT;
+}
+
+static inline uint64_t mr_key_segment(uint64_t key) {
+  return key & ((1ULL << MR_KEY_OFFSET_SHIFT) - 1);
+}
+
+static inline uint64_t mr_key_offset(uint64_t key) {
+  return key >> MR_KEY_OFFSET_SHIFT;
+}
+
+typedef struct rma_cq_data {
+  uint64_t key;
+  uint64_t offset;
+  uint64_t len;
+  uint64_t data;
+} rma_cq_data;
+
+/* Reporting slot of one initiator, followed by its ring of remote CQ data.
+ * An initiator writes a request carrying
+ * its id and the slot generation to a free slot, the target grants it by
+ * copying the request to owner while progressing events, and the owner
+ * writes its request to release once it disconnects. The target then
+ * recycles the slot under a new generation, so requests left behind on
+ * the slot by initiators that gave up are never granted.
+ * Only the owner advances write_tail/read_tail and appends to the ring,
+ * advancing cq_data_tail, while the target consumes entries and advances
+ * cq_data_head; concurrent initiators never write the same word. */
+typedef struct mr_initiator {
+  volatile uint64_t request;
+  volatile uint64_t owner;
+  volatile uint64_t release;
+  volatile uint64_t generation;
+  volatile uint64_t write_tail;
+  volatile uint64_t read_tail;
+  volatile uint64_t cq_data_head;
+  volatile uint64_t cq_data_tail;
+  rma_cq_data cq_data[0];
+} mr_initiator;
+
+#define MR_SLOT_GEN_BITS 16
+#define MR_SLOT_GEN_MASK ((1ULL << MR_SLOT_GEN_BITS) - 1)
+
+static inline uint64_t mr_slot_request(uint64_t id, uint64_t generation) {
+  return id << MR_SLOT_GEN_BITS | (generation & MR_SLOT_GEN_MASK);
+}
+
+static inline int mr_slot_current(uint64_t request, uint64_t generation) {
+  return request && (request & MR_SLOT_GEN_MASK) == (generation & MR_SLOT_GEN_MASK);
+}
+
+/* Control area at the start of the MR segments registered for RMA events
+ * or remote CQ data (other segments are data only, from offset 0).
+ * RMA initiators post remote CQ data through a slot of their own among
+ * the slot_count ones at slot_offset, each holding ring_size entries.
+ * When a counter or CQ is bound to the MR, rma_events is set and
+ * initiators also count every operation in their slot (writes carrying
+ * CQ data are only counted by the ring).
+ * data_len is the registered length, initiators never access past it
+ * even when the segment is larger. */
+typedef struct mr_event_area {
+  uint64_t magic;
+  uint64_t data_offset;
+  uint64_t data_len;
+  uint32_t ring_size;
+  uint8_t hasInterrupt;
+  volatile uint8_t rma_events;
+  // rail the interrupt was created on, as in segment_data
+  uint8_t interruptRail;
+  dpa_intid_t interruptId;
+  uint32_t slot_count;
+  uint32_t slot_offset;
+  uint32_t slot_stride;
+} mr_event_area;
+
+static inline volatile mr_initiator* mr_slot(volatile mr_event_area* events,
+                                             size_t offset, size_t stride,
+                                             size_t index) {
+  return (volatile void*) events + offset + index * stride;
+}
+
+// what the target has already reported from each slot
+typedef struct mr_slot_seen {
+  uint64_t write;
+  uint64_t read;
+} mr_slot_seen;
 
 struct dpa_fid_mr {
   struct fid_mr mr;
   local_segment_info segment_info;
   dpa_fid_domain* domain;
+  struct dpa_fid_ep* ep;
   const void* buf;
   size_t len;
   uint64_t access;
   uint64_t flags;
+  volatile mr_event_area* events;
+  dpa_desc_t event_sd;
+  dpa_local_interrupt_t event_interrupt;
+  fastlock_t event_lock;
+  dlist_entry event_entry;
+  uint8_t event_listed;
+  mr_slot_seen* seen;
+  struct dpa_fid_cq* write_cq;
+  struct dpa_fid_cq* read_cq;
+  struct dpa_fid_cntr* write_cntr;
+  struct dpa_fid_cntr* read_cntr;
+  uint8_t cached;
+  uint8_t pooled;
+  int numa_node;
+  size_t refcount;
+  dlist_entry lru_entry;
 };
 
+// further handle on a cached registration, one per cache hit
+typedef struct dpa_mr_handle {
+  struct fid_mr mr;
+  dpa_fid_mr* shared;
+} dpa_mr_handle;
+
 void dpa_mr_init();
 void dpa_mr_fini();
+void mr_pool_fill(int numa_node);
+// the registration stays valid until dpa_mr_unlock(*readers)
+dpa_fid_mr* dpa_mr_lookup(uint64_t key, table_readers** readers);
+void dpa_mr_unlock(table_readers* readers);
+// the registration behind any of its handles
+dpa_fid_mr* dpa_mr_from_fid(struct fid* fid);
+void mr_progress_events(dpa_fid_mr* mr);
+void mr_progress_domain_events(dpa_fid_domain* domain);
+void mr_cache_init(mr_cache* cache);
+void mr_cache_fini(mr_cache* cache);
 
 int dpa_mr_reg(struct fid *fid, const void *buf, size_t len,
                uint64_t access, uint64_t offset, uint64_t requested_key,
@@ -35,6 +35,7 @@
 #include "dpa_segments.h"
 #include "dpa_cm.h"
 #include "dpa_msg.h"
+#include "dpa_atomic.h"
 
 
 msg_queue_entry* get_free_entry(dpa_fid_ep* ep, slist* free_entries) {
@@ -58,6 +59,8 @@ static inline ssize_t _dpa_msg_enqueue(msg_queue_entry* msg, dpa_fid_ep* ep, sli
   memcpy(entry, msg, sizeof(msg_queue_entry));
   slist_insert_tail_unsafe(&entry->list_entry, msg_queue);
   unlock_if_needed(ep, msg_queue);
+  if (ep->progress_state != PROGRESS_DETACHED)
+    progress_engine_activate(ep);
   return FI_SUCCESS;
 }
 static inline int try_recv(msg_queue_entry* entry);
@@ -92,7 +95,7 @@ static inline ssize_t _dpa_recv(dpa_fid_ep* ep, const void *buf, size_t len,
 
 ssize_t dpa_recv(struct fid_ep *ep, void *buf, size_t len, void *desc,
 				 fi_addr_t src_addr, void *context){
-  return _dpa_recv(container_of(ep, dpa_fid_ep, ep), buf, len, NO_FLAGS, context);
+  return _dpa_recv(container_of(ep, dpa_fid_ep, ep), buf, len, ep_rx_op_flags(ep), context);
 }
 
 ssize_t dpa_recvv(struct fid_ep *ep, const struct iovec *iov, void **desc,
@@ -105,7 +108,7 @@ ssize_t dpa_recvv(struct fid_ep *ep, const struct iovec *iov, void **desc,
     .context = context,
     .data = 0
   };
-  return dpa_recvmsg(ep, &msg, NO_FLAGS);
+  return dpa_recvmsg(ep, &msg, ep_rx_op_flags(ep));
 }
 
 inline ssize_t dpa_recvmsg(struct fid_ep *ep, const struct fi_msg *msg, uint64_t flags) {
@@ -131,7 +134,7 @@ ssize_t _dpa_send(dpa_fid_ep* ep, const void *buf, size_t len,
     .ep = ep,
     .buf = buf,
     .len = len,
-    .flags = NO_FLAGS,
+    .flags = flags & (MSG_CONTROL | FI_COMPLETION),
     .context = context
   };
   lock_if_needed(ep, msg_queue);
@@ -141,15 +144,22 @@ ssize_t _dpa_send(dpa_fid_ep* ep, const void *buf, size_t len,
 
   if (err == -FI_EAGAIN) {
     DPA_DEBUG("Enqueuing send\n");
+    // control messages are built on the stack, keep a copy until sent
+    if (entry.flags & MSG_CONTROL)
+      entry.buf = memdup(buf, len);
     return _dpa_msg_enqueue(&entry, ep, msg_queue, free_entries);
   } else {
     return FI_SUCCESS;
   }
 }
 
+ssize_t send_control_msg(dpa_fid_ep* ep, const void* buf, size_t len) {
+  return _dpa_send(ep, buf, len, MSG_CONTROL, NULL);
+}
+
 ssize_t dpa_send(struct fid_ep *ep, const void *buf, size_t len, void *desc,
 				 fi_addr_t dest_addr, void *context) {
-  return _dpa_send(container_of(ep, dpa_fid_ep, ep), buf, len, NO_FLAGS, context);
+  return _dpa_send(container_of(ep, dpa_fid_ep, ep), buf, len, ep_tx_op_flags(ep), context);
 }
 
 ssize_t dpa_sendv(struct fid_ep *ep, const struct iovec *iov, void **desc,
@@ -162,7 +172,7 @@ ssize_t dpa_sendv(struct fid_ep *ep, const struct iovec *iov, void **desc,
     .context = context,
     .data = 0
   };
-  return dpa_sendmsg(ep, &msg, NO_FLAGS);
+  return dpa_sendmsg(ep, &msg, ep_tx_op_flags(ep));
 }
 
 inline ssize_t dpa_sendmsg(struct fid_ep *ep, const struct fi_msg *msg, uint64_t flags){
@@ -257,25 +267,29 @@ static inline size_t read_msg(msg_queue_entry* msg, ep_recv_info* recv_info) {
   local_buffer_info* buf_info = recv_info->buffer;
   volatile msg_data* read_ptr = recv_read_ptr(recv_info);
   size_t buftop_size = ((void*)buf_info->base->data) + recv_buffer_size(recv_info) - (void*)read_ptr->data;
-  size_t msg_size = read_ptr->size;
+  size_t msg_size = read_ptr->size & ~MSG_CONTROL;
   size_t recv_size = msg->len;
   size_t read_size = MIN(recv_size, msg_size);
   size_t copy_size = MIN(read_size, buftop_size);
+  size_t clear_size = MIN(msg_size, buftop_size);
   
   DEBUG_dump_mem((volatile uint8_t*)buf_info->base->data, buf_info->size, recv_info->read);
   
   DPA_DEBUG("Reading %u bytes, message is %u bytes\n", read_size, msg_size);
   memcpy((void*)msg->buf, (void*)read_ptr->data, copy_size);
-  //clean up read buffer
-  memset((void*)read_ptr, 0, offsetof(msg_data, data) + copy_size);
-  if (copy_size < read_size) {
   // copy second part if we need to wrap around buffer
+  if (copy_size < read_size)
     memcpy((void*)msg->buf + copy_size, (void*)buf_info->base->data, read_size - copy_size);
-    //clean up buffer
-    memset((void*)buf_info->base->data, 0, read_size - copy_size);
-  }
+  /* clean up the whole message, even the part that was not read:
+   * a later header landing there must read as empty until written */
+  memset((void*)read_ptr, 0, offsetof(msg_data, data) + clear_size);
+  if (clear_size < msg_size)
+    memset((void*)buf_info->base->data, 0, msg_size - clear_size);
   
+  size_t prev_read = recv_info->read;
   recv_info->read = new_offset(recv_info->read, msg_size, recv_buffer_size(recv_info));
+  if (recv_info->scan == prev_read)
+    recv_info->scan = recv_info->read;
   // write remote status
   recv_info->remote_status->read = recv_info->read;
   if (recv_info->remote_interrupt) {
@@ -286,19 +300,104 @@ static inline size_t read_msg(msg_queue_entry* msg, ep_recv_info* recv_info) {
   return read_size;
 }
 
-static inline int try_recv(msg_queue_entry* entry) {
-  dpa_fid_ep* ep = entry->ep;
-  size_t msg_size = recv_read_ptr(&ep->msg_recv_info)->size;
-  if (msg_size<=0) {
-    DPA_DEBUG("Nothing to receive\n");
-    return -FI_EAGAIN;
+/* Whether offset is within the part of the ring the writer may have
+ * filled since our read offset. */
+static inline int ring_holds(ep_recv_info* recv_info, size_t offset) {
+  size_t buf_size = recv_buffer_size(recv_info);
+  return (offset + 2*buf_size - recv_info->read) % (2*buf_size) < buf_size;
+}
+
+/**
+ * A message at the scan offset nobody has looked at yet: a control
+ * message, or data that may have control messages behind it.
+ * Lock-free, a stale answer is fixed by the next check.
+ */
+static inline int has_unscanned_msg(ep_recv_info* recv_info) {
+  size_t scan = recv_info->scan;
+  return ring_holds(recv_info, scan) &&
+    data_ptr((void*)recv_info->buffer->base->data, scan, recv_buffer_size(recv_info))->size;
+}
+
+/**
+ * Whether a control message sits behind the data at the head of the ring.
+ * Advances the scan offset, so each data message is only looked at once.
+ * Must be called with receive queue lock.
+ */
+static inline int control_behind(ep_recv_info* recv_info) {
+  size_t buf_size = recv_buffer_size(recv_info);
+  void* base = (void*)recv_info->buffer->base->data;
+  uint64_t size;
+  while (ring_holds(recv_info, recv_info->scan) &&
+         (size = data_ptr(base, recv_info->scan, buf_size)->size)) {
+    if (size & MSG_CONTROL) return 1;
+    recv_info->scan = new_offset(recv_info->scan, size, buf_size);
   }
-  size_t copied = read_msg(entry, &ep->msg_recv_info);
+  return 0;
+}
+
+/**
+ * Consume a control message, they are not matched with posted receives.
+ * Must be called with receive queue lock.
+ */
+static inline void process_control_msg(dpa_fid_ep* ep) {
+  uint64_t buf[MSG_CONTROL_MAX_SIZE / sizeof(uint64_t)];
+  msg_queue_entry control = {
+    .ep = ep,
+    .buf = buf,
+    .len = sizeof(buf),
+    .flags = MSG_CONTROL,
+    .context = NULL
+  };
+  size_t len = read_msg(&control, &ep->msg_recv_info);
+  dpa_atomic_handle(ep, buf, len);
+}
+
+/**
+ * Move the data message at the head of the ring to the staged list,
+ * where it waits for a receive. Must be called with receive queue lock.
+ */
+static inline int stage_msg(dpa_fid_ep* ep, size_t msg_size) {
+  staged_msg* staged = malloc(sizeof(staged_msg) + msg_size);
+  if (!staged) {
+    DPA_WARN("Cannot stage %zu bytes message, control messages are held back\n", msg_size);
+    return 0;
+  }
+  msg_queue_entry entry = {
+    .ep = ep,
+    .buf = staged->data,
+    .len = msg_size,
+    .flags = 0,
+    .context = NULL
+  };
+  staged->len = read_msg(&entry, &ep->msg_recv_info);
+  slist_insert_tail_unsafe(&staged->list_entry, &ep->msg_recv_info.staged);
+  return 1;
+}
+
+/**
+ * Consume the control messages on the ring. Data nobody has posted a
+ * receive for yet is staged when control messages are queued behind it,
+ * so that atomic requests and responses are never held back by the
+ * application. Must be called with receive queue lock.
+ */
+static inline void process_control_msgs(dpa_fid_ep* ep) {
+  ep_recv_info* recv_info = &ep->msg_recv_info;
+  uint64_t msg_size;
+  while ((msg_size = recv_read_ptr(recv_info)->size)) {
+    if (msg_size & MSG_CONTROL)
+      process_control_msg(ep);
+    else if (!control_behind(recv_info) || !stage_msg(ep, msg_size))
+      break;
+  }
+}
+
+static inline void complete_recv(msg_queue_entry* entry, size_t copied, size_t msg_size) {
+  dpa_fid_ep* ep = entry->ep;
   DPA_DEBUG("received msg size: %u, buffer size: %u, copied: %u\n",
             msg_size, entry->len, copied);
 
   int err = copied < msg_size ? FI_ETOOSMALL : FI_SUCCESS;
-  if (ep->recv_cq) {
+  if (ep->recv_cq && (err || ep_completes(ep, FI_RECV, entry->flags))) {
     // generate completion
     struct fi_cq_err_entry completion = {
       .op_context = entry->context,
@@ -319,6 +418,29 @@ static inline int try_recv(msg_queue_entry* entry) {
     else
       dpa_cntr_err_inc(ep->recv_cntr);
   }
+}
+
+static inline int try_recv(msg_queue_entry* entry) {
+  dpa_fid_ep* ep = entry->ep;
+  slist* staged = &ep->msg_recv_info.staged;
+  // staged messages were on the ring before anything still there
+  if (!slist_empty(staged)) {
+    staged_msg* msg = container_of(slist_remove_head_unsafe(staged), staged_msg, list_entry);
+    size_t copied = MIN(entry->len, msg->len);
+    memcpy((void*)entry->buf, msg->data, copied);
+    complete_recv(entry, copied, msg->len);
+    free(msg);
+    return FI_SUCCESS;
+  }
+  size_t msg_size;
+  // control messages can land at any time: classify each one on a single read
+  while ((msg_size = recv_read_ptr(&ep->msg_recv_info)->size) & MSG_CONTROL)
+    process_control_msg(ep);
+  if (msg_size<=0) {
+    DPA_DEBUG("Nothing to receive\n");
+    return -FI_EAGAIN;
+  }
+  complete_recv(entry, read_msg(entry, &ep->msg_recv_info), msg_size);
   return FI_SUCCESS;
 }
 
@@ -329,7 +451,7 @@ inline void process_recv_queue(dpa_fid_ep* ep, uint8_t locked) {
     return;
   }
   if (!locked) {
-    if (slist_empty(queue)) return;
+    if (slist_empty(queue) && !has_unscanned_msg(&ep->msg_recv_info)) return;
     lock_if_needed(ep, queue);
   }
   local_buffer_info* buffer_info = ep->msg_recv_info.buffer;
@@ -345,6 +467,7 @@ inline void process_recv_queue(dpa_fid_ep* ep, uint8_t locked) {
       slist_insert_head_unsafe(entry, &ep->msg_recv_info.free_entries);
     }
   }
+  process_control_msgs(ep);
   //remove locks
   unlock_if_needed(ep, queue);
 }
@@ -357,6 +480,7 @@ static inline void write_msg(ep_send_info* send_info, msg_queue_entry* msg) {
   size_t copy_size = MIN(msg->len, buftop_size);
   
   DPA_DEBUG("Writing %u bytes\n", msg->len);
+  rail_account(msg->ep->domain, msg->ep->rail, msg->len);
   memcpy((void*)recvbuf, (void*)msg->buf, copy_size);
 
   //check if we need to wrap around buffer
@@ -371,7 +495,7 @@ static inline void write_msg(ep_send_info* send_info, msg_queue_entry* msg) {
 
   // barrier before writing length
   dpa_barrier(send_info->sequence);
-  data->size = msg->len;
+  data->size = msg->len | (msg->flags & MSG_CONTROL);
 
   // complete operation
   dpa_barrier(send_info->sequence);
@@ -407,7 +531,9 @@ int try_send(msg_queue_entry* entry) {
   }
   //actually write the message on remote buffer.
   write_msg(send_info, entry);
-  if (entry->ep->send_cq) {
+  // control messages are internal and complete silently
+  if (entry->flags & MSG_CONTROL) return FI_SUCCESS;
+  if (entry->ep->send_cq && ep_completes(entry->ep, FI_SEND, entry->flags)) {
     // generate completion
     struct fi_cq_err_entry completion = {
       .op_context = entry->context,
@@ -439,6 +565,7 @@ void process_send_queue(dpa_fid_ep* ep, uint8_t locked) {
     msg_queue_entry* head = container_of(queue->head, msg_queue_entry, list_entry);
     err = try_send(head);
     if (err != -FI_EAGAIN) {
+      if (head->flags & MSG_CONTROL) free((void*) head->buf);
       // move to free queue
       slist_remove_head_unsafe(queue);
       slist_insert_head_unsafe(&head->list_entry, &(send_info->free_entries));
@@ -449,7 +576,10 @@ void process_send_queue(dpa_fid_ep* ep, uint8_t locked) {
 
 static inline int progress_queue(dpa_fid_ep* ep, dpa_local_interrupt_t interrupt,
                           int timeout_millis, process_queue_t process_queue) {
-  if (timeout_millis) {
+  // without an interrupt there is nothing to be woken up by
+  if (!interrupt)
+    timeout_millis = 0;
+  else if (timeout_millis) {
     dpa_error_t error = wait_interrupt(interrupt, timeout_millis);
     // avoid logging errors for timeout
     if (error == DPA_ERR_TIMEOUT)
@@ -465,11 +595,58 @@ int progress_send_queue(dpa_fid_ep* ep, int timeout_millis) {
   return progress_queue(ep, ep->msg_send_info.interrupt, timeout_millis, process_send_queue);
 }
 
+static inline dpa_local_interrupt_t recv_wait_interrupt(dpa_fid_ep* ep) {
+  return ep->msg_recv_info.doorbell ? NULL : ep->msg_recv_info.interrupt;
+}
+
 int progress_recv_queue(dpa_fid_ep* ep, int timeout_millis) {
-  return progress_queue(ep, ep->msg_recv_info.interrupt, timeout_millis, process_recv_queue);
+  int remaining = progress_queue(ep, recv_wait_interrupt(ep), timeout_millis,
+                                 process_recv_queue);
+  // remote CQ data from RMA writes targeting the bound MR
+  if (ep->mr) mr_progress_events(ep->mr);
+  return remaining;
 }
 
+// waits on the receive interrupt if there is one, else on the send one
 int progress_sendrecv_queues(dpa_fid_ep* ep, int timeout_millis) {
+  if (recv_wait_interrupt(ep)) {
+    progress_send_queue(ep, 0);
+    return progress_recv_queue(ep, timeout_millis);
+  }
   int remaining = progress_send_queue(ep, timeout_millis);
-  return progress_recv_queue(ep, remaining);
+  progress_recv_queue(ep, 0);
+  return remaining;
+}
+
+/**
+ * Queued sends, data with a receive posted for it, or a message that has
+ * not been scanned for control messages yet.
+ * Endpoints waiting for data are woken up by their doorbell.
+ */
+int progress_active(dpa_fid_ep* ep) {
+  if (!ep->connected) return 0;
+  if (!slist_empty(&ep->msg_send_info.msg_queue)) return 1;
+  ep_recv_info* recv_info = &ep->msg_recv_info;
+  if (!slist_empty(&recv_info->msg_queue) &&
+      (!slist_empty(&recv_info->staged) || recv_read_ptr(recv_info)->size))
+    return 1;
+  return has_unscanned_msg(recv_info);
+}
+
+void release_msg_queues(dpa_fid_ep* ep) {
+  // control messages still queued for sending own a copy of their payload
+  for (slist_entry* e = ep->msg_send_info.msg_queue.head; e; e = e->next) {
+    msg_queue_entry* entry = container_of(e, msg_queue_entry, list_entry);
+    if (entry->flags & MSG_CONTROL) free((void*) entry->buf);
+  }
+  slist_destroy(&ep->msg_recv_info.staged, staged_msg, list_entry, no_destroyer);
+  /* queue entries, atomic ones included, all come from the batches
+   * in free_entries_ptrs: pending atomics are dropped with them */
+  fastlock_destroy(&ep->atomic_pending.lock);
+  fastlock_destroy(&ep->atomic_free.lock);
+  slist_destroy(&ep->free_entries_ptrs, msg_queue_ptr_entry, list_entry, no_destroyer);
+}
+
+int progress_pending(dpa_fid_ep* ep) {
+  return ep->mr || progress_active(ep);
 }
@@ -34,6 +34,15 @@
 #define DPA_MSG_H
 #include "dpa_ep.h"
 #include "dpa_msg_cm.h"
+#include "dpa_numa.h"
+
+/* Provider-private flag (within FI_PROV_SPECIFIC) marking control messages.
+ * The same bit is set in msg_data.size on the ring, so the receiver can
+ * consume them regardless of posted receives, staging the data in front. */
+#define MSG_CONTROL (1ULL << 63)
+#ifndef MSG_CONTROL_MAX_SIZE
+#define MSG_CONTROL_MAX_SIZE 2048
+#endif
 
 int dpa_msg_init();
 int dpa_msg_fini();
@@ -49,11 +58,17 @@ ssize_t dpa_sendv(struct fid_ep *ep, const struct iovec *iov, void **desc,
                   size_t count, fi_addr_t dest_addr, void *context);
 ssize_t dpa_sendmsg(struct fid_ep *ep, const struct fi_msg *msg, uint64_t flags);
 
+ssize_t send_control_msg(dpa_fid_ep* ep, const void* buf, size_t len);
+
+msg_queue_entry* get_free_entry(dpa_fid_ep* ep, slist* free_entries);
 void process_send_queue(dpa_fid_ep* ep, uint8_t locked);
 void process_recv_queue(dpa_fid_ep* ep, uint8_t locked);
 int progress_send_queue(dpa_fid_ep* ep, int timeout_millis);
 int progress_recv_queue(dpa_fid_ep* ep, int timeout_millis);
 int progress_sendrecv_queues(dpa_fid_ep* ep, int timeout_millis);
+int progress_pending(dpa_fid_ep* ep);
+int progress_active(dpa_fid_ep* ep);
+void release_msg_queues(dpa_fid_ep* ep);
 
 static inline size_t recv_buffer_size(ep_recv_info* recv_info) {
   return recv_info->buffer->size - offsetof(buffer_status, data);
@@ -76,7 +91,8 @@ static inline volatile msg_data* send_write_ptr(ep_send_info* send_info) {
 #endif
 
 static inline void create_msg_queue_entries(dpa_fid_ep* ep, slist* free_entries) {
-  msg_queue_ptr_entry* newentries = malloc(sizeof(msg_queue_ptr_entry) + MSG_QUEUE_ENTRIES_BATCH_SIZE * sizeof(msg_queue_entry));
+  msg_queue_ptr_entry* newentries = numa_calloc(sizeof(msg_queue_ptr_entry) + MSG_QUEUE_ENTRIES_BATCH_SIZE * sizeof(msg_queue_entry),
+                                                ep->numa_node);
   lock_if_needed(ep, &ep->free_entries_ptrs);
   slist_insert_head_unsafe(&newentries->list_entry, &ep->free_entries_ptrs);
   unlock_if_needed(ep, &ep->free_entries_ptrs);
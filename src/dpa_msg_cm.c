@@ -72,9 +72,10 @@ static dpa_callback_action_t process_send_queue_interrupt_callback(void *, dpa_l
 static dpa_callback_action_t process_recv_queue_interrupt_callback(void *, dpa_local_interrupt_t,
                                                                    dpa_error_t);
 
-static inline void create_data_segment(msg_local_segment_info *info) {
+static inline void create_data_segment(msg_local_segment_info *info, int numa_node) {
   dpa_error_t error = dpa_alloc_segment(&info->segment_info, assign_data.currentSegmentId,
-                                        DATA_SEGMENT_SIZE, zero_segment_initializer, NULL, NULL);
+                                        DATA_SEGMENT_SIZE, zero_segment_initializer, NULL, NULL,
+                                        numa_node);
   if (error != DPA_ERR_OK) {
     dpa_destroy_segment(info->segment_info);
     info->segment_info.segmentId = 0;
@@ -89,12 +90,12 @@ static inline void create_data_segment(msg_local_segment_info *info) {
   assign_data.currentSegmentId++;
 }
 
-static inline local_buffer_info* get_empty_buffer(){
+static inline local_buffer_info* get_empty_buffer(int numa_node){
   //get an empty buffer somewhere
   for (int i = 0; i < NUM_SEGMENTS; i++) {
     msg_local_segment_info* info = &local_segments_info[i];
     while (!info->segment_info.segmentId){
-      create_data_segment(info);
+      create_data_segment(info, numa_node);
     }
     if (info->bufcount < BUFFERS_PER_SEGMENT) {
       for (int j = 0; j < BUFFERS_PER_SEGMENT; j++) {
@@ -112,30 +113,36 @@ static inline dpa_error_t alloc_msg_buffer(dpa_fid_ep* ep, segment_data* local_s
   if (!(ep->caps & (FI_RECV | FI_SEND))) return FI_SUCCESS;
 
   dpa_error_t error, nocheck;
-  local_buffer_info* empty_buffer = get_empty_buffer();
+  // rings are shared, a new one is placed as asked by the domain creating it
+  local_buffer_info* empty_buffer = get_empty_buffer(numa_resolve(ep->domain->numa.ring_node));
   if (empty_buffer == NULL) {
     DPA_WARN("No empty buffers available for node %d\n", ep->peer_addr.nodeId);
     error = DPA_ERR_SYSTEM;
     goto alloc_fail;
   }
 
-  unsigned int interrupt_flags = ep->domain->data_progress == FI_PROGRESS_AUTO
+  unsigned int interrupt_flags =
+    ep->domain->data_progress == FI_PROGRESS_AUTO && PROGRESS_CALLBACKS
     ? DPA_FLAG_USE_CALLBACK
     : NO_FLAGS;
+  // incoming messages must wake the progress engine up for idle endpoints
+  ep->msg_recv_info.doorbell = ep->progress_state != PROGRESS_DETACHED;
   if (ep->caps & FI_RECV) {
     DPA_DEBUG("Opening recv virtual device\n");
     DPAOpen(&ep->msg_recv_info.sd, NO_FLAGS, &error);
     DPALIB_CHECK_ERROR(DPAOpen, goto alloc_fail);
 
-    if (ep->domain->data_progress == FI_PROGRESS_AUTO ||
+    if (ep->msg_recv_info.doorbell ||
+        ep->domain->data_progress == FI_PROGRESS_AUTO ||
         (ep->recv_cq && ep->recv_cq->wait_obj == FI_WAIT_UNSPEC) ||
         (ep->recv_cntr && ep->recv_cntr->wait_obj == FI_WAIT_UNSPEC)) {
       DPA_DEBUG("Creating recv interrupt\n");
       DPACreateInterrupt(ep->msg_recv_info.sd,
-                         &ep->msg_recv_info.interrupt, localAdapterNo,
+                         &ep->msg_recv_info.interrupt, dpaRails[ep->rail],
                          (dpa_intid_t*)&(local_segment_data->recvInterruptId),
-                         process_recv_queue_interrupt_callback,
-                         ep, interrupt_flags, &error);
+                         process_recv_queue_interrupt_callback, ep,
+                         ep->msg_recv_info.doorbell ? DPA_FLAG_USE_CALLBACK : interrupt_flags,
+                         &error);
       DPALIB_CHECK_ERROR(DPACreateInterrupt, goto alloc_recvclose);
       local_segment_data->hasRecvInterrupt = 1;
     } else
@@ -151,7 +158,7 @@ static inline dpa_error_t alloc_msg_buffer(dpa_fid_ep* ep, segment_data* local_s
         (ep->recv_cntr && ep->send_cntr->wait_obj == FI_WAIT_UNSPEC)) {
       DPA_DEBUG("Creating send interrupt\n");
       DPACreateInterrupt(ep->msg_send_info.sd,
-                         &ep->msg_send_info.interrupt, localAdapterNo,
+                         &ep->msg_send_info.interrupt, dpaRails[ep->rail],
                          (dpa_intid_t*)&(local_segment_data->sendInterruptId),
                          process_send_queue_interrupt_callback,
                          ep, interrupt_flags, &error);
@@ -165,10 +172,12 @@ static inline dpa_error_t alloc_msg_buffer(dpa_fid_ep* ep, segment_data* local_s
   empty_buffer->base->read = 0;
   ep->msg_recv_info.buffer = empty_buffer;
   ep->msg_recv_info.read = 0;
+  ep->msg_recv_info.scan = 0;
   recv_read_ptr(&ep->msg_recv_info)->size = 0;
   ep->msg_send_info.remote_status = empty_buffer->base;
   void* segment_base = (void*) empty_buffer->segment->segment_info.base;
   //set metadata
+  local_segment_data->interruptRail = ep->rail;
   local_segment_data->segmentId = empty_buffer->segment->segment_info.segmentId;
   local_segment_data->offset = (size_t) (((void*) empty_buffer->base) - segment_base);
   local_segment_data->size = empty_buffer->size;
@@ -251,10 +260,13 @@ dpa_error_t connect_msg(dpa_fid_ep* ep, segment_data remote_segment_data) {
   if (ep->caps & (FI_RECV | FI_SEND)) {
     DPA_DEBUG("Connecting to remote recv segment %u on node %u\n", 
               remote_segment_data.segmentId, ep->peer_addr.nodeId);
-    DPAConnectSegment(ep->msg_send_info.sd, &ep->msg_send_info.remote_segment, ep->peer_addr.nodeId,
-                      remote_segment_data.segmentId, localAdapterNo, NO_CALLBACK,
+    // ring traffic and interrupts are balanced over the rails
+    DPAConnectSegment(ep->msg_send_info.sd, &ep->msg_send_info.remote_segment,
+                      rail_node(ep->peer_addr.nodeId, ep->rail),
+                      remote_segment_data.segmentId, dpaRails[ep->rail], NO_CALLBACK,
                       NULL, DPA_INFINITE_TIMEOUT, NO_FLAGS, &error);
     DPALIB_CHECK_ERROR(DPAConnectSegment, goto conn_end);
+    rail_connected(ep->domain, ep->rail);
   
     DPA_DEBUG("Mapping remote segment %u on node %u\n", 
               remote_segment_data.segmentId, ep->peer_addr.nodeId);
@@ -273,12 +285,21 @@ dpa_error_t connect_msg(dpa_fid_ep* ep, segment_data remote_segment_data) {
     ep->msg_recv_info.remote_status = remote_status;
   }
   
+  size_t int_rail = remote_segment_data.interruptRail;
+  if ((remote_segment_data.hasRecvInterrupt || remote_segment_data.hasSendInterrupt) &&
+      int_rail >= dpaRailCount) {
+    DPA_WARN("Peer interrupts are on rail %zu, only %zu rail(s) in use\n",
+             int_rail, dpaRailCount);
+    error = DPA_ERR_SYSTEM;
+    goto conn_end;
+  }
+
   if (ep->caps & FI_SEND && remote_segment_data.hasRecvInterrupt) {
     DPA_DEBUG("Connecting to remote recv interrupt %u on node %u\n", 
               remote_segment_data.recvInterruptId, ep->peer_addr.nodeId);
     DPAConnectInterrupt(ep->msg_send_info.sd,
                         &ep->msg_send_info.remote_interrupt,
-                        ep->peer_addr.nodeId, localAdapterNo,
+                        rail_node(ep->peer_addr.nodeId, int_rail), dpaRails[int_rail],
                         remote_segment_data.recvInterruptId,
                         DPA_INFINITE_TIMEOUT, NO_FLAGS, &error);
     DPALIB_CHECK_ERROR(DPAConnectInterrupt, goto conn_end);
@@ -288,7 +309,8 @@ dpa_error_t connect_msg(dpa_fid_ep* ep, segment_data remote_segment_data) {
     DPA_DEBUG("Connecting to remote send interrupt %u on node %u\n", 
               remote_segment_data.sendInterruptId, ep->peer_addr.nodeId);
     DPAConnectInterrupt(ep->msg_recv_info.sd, &ep->msg_recv_info.remote_interrupt,
-                        ep->peer_addr.nodeId, localAdapterNo, remote_segment_data.sendInterruptId,
+                        rail_node(ep->peer_addr.nodeId, int_rail), dpaRails[int_rail],
+                        remote_segment_data.sendInterruptId,
                         DPA_INFINITE_TIMEOUT, NO_FLAGS, &error);
     DPALIB_CHECK_ERROR(DPAConnectInterrupt, goto conn_end);
   } else ep->msg_recv_info.remote_interrupt = NULL;
@@ -300,6 +322,9 @@ dpa_error_t connect_msg(dpa_fid_ep* ep, segment_data remote_segment_data) {
   };
   eq_add(ep->eq, FI_CONNECTED, &event, sizeof(event), NO_FLAGS, 0);
   ep->connected = 1;
+  // operations posted before the connection completed
+  if (ep->progress_state != PROGRESS_DETACHED)
+    progress_engine_activate(ep);
  conn_end:
   return error;  
 }
@@ -343,7 +368,12 @@ static dpa_callback_action_t process_recv_queue_interrupt_callback(void *arg,
                                                                    dpa_local_interrupt_t interrupt,
                                                                    dpa_error_t status){
   dpa_fid_ep* ep = *((dpa_fid_ep **)arg);
-  process_recv_queue(ep, 0);
+  // workers take care of endpoints in the progress engine
+  if (ep->msg_recv_info.doorbell &&
+      __atomic_load_n(&ep->progress_state, __ATOMIC_ACQUIRE) != PROGRESS_DETACHED)
+    progress_engine_activate(ep);
+  else
+    process_recv_queue(ep, 0);
   return DPA_CALLBACK_CONTINUE;
 }
  
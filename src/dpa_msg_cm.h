@@ -41,6 +41,7 @@ typedef struct msg_queue_entry msg_queue_entry;
 typedef struct ep_recv_info ep_recv_info;
 typedef struct ep_send_info ep_send_info;
 typedef struct msg_queue_ptr_entry msg_queue_ptr_entry;
+typedef struct staged_msg staged_msg;
 
 #ifndef _DPA_MSG_CM_H
 #define _DPA_MSG_CM_H
@@ -63,6 +64,8 @@ struct segment_data {
   dpa_intid_t recvInterruptId;
   uint64_t hasSendInterrupt;
   dpa_intid_t sendInterruptId;
+  // rail the recv and send interrupts were created on
+  uint8_t interruptRail;
 };
 
 enum control_data_status {
@@ -105,11 +108,17 @@ struct ep_recv_info {
   dpa_desc_t sd;
   local_buffer_info* buffer;
   dpa_local_interrupt_t interrupt;
+  // the interrupt only rings the progress engine, nobody waits on it
+  uint8_t doorbell;
   dpa_remote_interrupt_t remote_interrupt;
   volatile buffer_status* remote_status;
   size_t read;
+  // the messages between read and scan are known to be data
+  size_t scan;
   slist msg_queue;
   slist free_entries;
+  // data moved off the ring to reach the control messages behind it
+  slist staged;
 };
 
 
@@ -144,6 +153,12 @@ struct msg_queue_ptr_entry {
   msg_queue_entry entries[0];
 };
 
+struct staged_msg {
+  slist_entry list_entry;
+  size_t len;
+  char data[0];
+};
+
 dpa_error_t ctrl_connect_msg(dpa_fid_ep* ep);
 dpa_error_t connect_msg(dpa_fid_ep* ep, segment_data remote_segment_data);
 dpa_error_t disconnect_msg(dpa_fid_ep* ep);
@@ -0,0 +1,117 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#ifndef DPA_NUMA_H
+#define DPA_NUMA_H
+
+#include "dpa.h"
+#include "fi_ext_dpa.h"
+#include <sys/syscall.h>
+
+/* NUMA placement without a libnuma dependency: node lookup through
+ * getcpu and binding through mbind. Binding is best effort, memory
+ * that cannot be bound simply stays where the kernel put it. */
+
+#define DPA_MPOL_PREFERRED 1
+#define DPA_MPOL_MF_MOVE (1 << 1)
+// nodes are ints like the policies naming them, one bit each in an mbind mask
+#define DPA_NUMA_MAX_NODE ((int) (8 * sizeof(unsigned long)))
+#define DPA_MAX_CPUS 1024
+
+static inline int numa_current_node() {
+#ifdef SYS_getcpu
+  unsigned int cpu, node;
+  if (!syscall(SYS_getcpu, &cpu, &node, NULL))
+    return node;
+#endif
+  return FI_DPA_NUMA_ANY;
+}
+
+// turn a policy value into a node, or FI_DPA_NUMA_ANY
+static inline int numa_resolve(int policy) {
+  if (policy == FI_DPA_NUMA_LOCAL) return numa_current_node();
+  if (policy < 0 || policy >= DPA_NUMA_MAX_NODE) return FI_DPA_NUMA_ANY;
+  return policy;
+}
+
+/**
+ * Prefer node for the pages of [addr, addr+len), moving those already
+ * touched. addr must be page aligned.
+ */
+static inline int numa_bind(void* addr, size_t len, int node) {
+#ifdef SYS_mbind
+  if (node < 0 || node >= DPA_NUMA_MAX_NODE) return -FI_EINVAL;
+  unsigned long mask = 1UL << node;
+  if (!syscall(SYS_mbind, addr, len, DPA_MPOL_PREFERRED, &mask,
+               (unsigned long) DPA_NUMA_MAX_NODE + 1, DPA_MPOL_MF_MOVE))
+    return FI_SUCCESS;
+#endif
+  return -FI_ENOSYS;
+}
+
+/**
+ * Pin the calling thread to cpu.
+ */
+static inline int cpu_bind_self(int cpu) {
+#ifdef SYS_sched_setaffinity
+  unsigned long mask[DPA_MAX_CPUS / (8 * sizeof(unsigned long))] = { 0 };
+  if (cpu < 0 || cpu >= DPA_MAX_CPUS) return -FI_EINVAL;
+  mask[cpu / (8 * sizeof(unsigned long))] = 1UL << (cpu % (8 * sizeof(unsigned long)));
+  if (!syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask))
+    return FI_SUCCESS;
+#endif
+  return -FI_ENOSYS;
+}
+
+/**
+ * Zeroed, cache line aligned allocation placed on node, released with free().
+ * Whole pages are allocated so the binding does not leak onto
+ * neighbouring heap objects.
+ */
+static inline void* numa_calloc(size_t size, int node) {
+  void* mem;
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (node < 0 || page_size <= 0) {
+    if (posix_memalign(&mem, DPA_CACHE_LINE, size)) return NULL;
+    memset(mem, 0, size);
+    return mem;
+  }
+  size_t len = (size + page_size - 1) & ~((size_t) page_size - 1);
+  if (posix_memalign(&mem, page_size, len)) return NULL;
+  if (numa_bind(mem, len, node))
+    DPA_DEBUG("Cannot bind %zu bytes to NUMA node %d\n", len, node);
+  // first touch happens after binding
+  memset(mem, 0, len);
+  return mem;
+}
+
+#endif
@@ -0,0 +1,418 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#define LOG_SUBSYS FI_LOG_DOMAIN
+
+#include "dpa.h"
+#include "dpa_progress.h"
+#include "dpa_domain.h"
+#include "dpa_ep.h"
+#include "dpa_msg.h"
+#include "dpa_mr.h"
+#include "dpa_rma.h"
+#include "dpa_numa.h"
+#include <sched.h>
+#include <time.h>
+
+// automatic progress through DPAlib interrupt callbacks
+#ifndef PROGRESS_CALLBACKS_DEFAULT
+#define PROGRESS_CALLBACKS_DEFAULT 1
+#endif
+DEFINE_ENV_CONST(int, PROGRESS_CALLBACKS, PROGRESS_CALLBACKS_DEFAULT);
+// worker threads polling the endpoints of each domain, 0 to disable
+#ifndef PROGRESS_THREADS_DEFAULT
+#define PROGRESS_THREADS_DEFAULT 0
+#endif
+DEFINE_ENV_CONST(size_t, PROGRESS_THREADS, PROGRESS_THREADS_DEFAULT);
+// first CPU, worker i is pinned to PROGRESS_THREAD_CPU + i
+#ifndef PROGRESS_THREAD_CPU_DEFAULT
+#define PROGRESS_THREAD_CPU_DEFAULT -1
+#endif
+DEFINE_ENV_CONST(int, PROGRESS_THREAD_CPU, PROGRESS_THREAD_CPU_DEFAULT);
+// idle time spent polling before a worker starts sleeping
+#ifndef PROGRESS_SPIN_USEC_DEFAULT
+#define PROGRESS_SPIN_USEC_DEFAULT 50
+#endif
+DEFINE_ENV_CONST(long, PROGRESS_SPIN_USEC, PROGRESS_SPIN_USEC_DEFAULT);
+// longest sleep, reached doubling from 1us while nothing happens
+#ifndef PROGRESS_SLEEP_USEC_DEFAULT
+#define PROGRESS_SLEEP_USEC_DEFAULT 1000
+#endif
+DEFINE_ENV_CONST(long, PROGRESS_SLEEP_USEC, PROGRESS_SLEEP_USEC_DEFAULT);
+// helper threads running tasks of domains without progress workers
+#ifndef PROGRESS_HELPERS_DEFAULT
+#define PROGRESS_HELPERS_DEFAULT 4
+#endif
+DEFINE_ENV_CONST(size_t, PROGRESS_HELPERS, PROGRESS_HELPERS_DEFAULT);
+
+// started on the first task submitted, they sleep on cond in between
+static struct {
+  pthread_once_t once;
+  fastlock_t lock;
+  fastlock_cond_t cond;
+  slist tasks;
+  int running;
+  size_t count;
+  pthread_t* threads;
+} helpers = {
+  .once = PTHREAD_ONCE_INIT
+};
+
+void dpa_progress_init() {
+  ENV_OVERRIDE_INT(PROGRESS_CALLBACKS);
+  ENV_OVERRIDE_INT(PROGRESS_THREADS);
+  ENV_OVERRIDE_INT(PROGRESS_THREAD_CPU);
+  ENV_OVERRIDE_INT(PROGRESS_SPIN_USEC);
+  ENV_OVERRIDE_INT(PROGRESS_SLEEP_USEC);
+  ENV_OVERRIDE_INT(PROGRESS_HELPERS);
+  fastlock_init(&helpers.lock);
+  fastlock_cond_init(&helpers.cond);
+  slist_init_unsafe(&helpers.tasks);
+}
+
+void dpa_progress_fini() {
+  fastlock_acquire(&helpers.lock);
+  helpers.running = 0;
+  fastlock_signal_all(&helpers.cond);
+  fastlock_release(&helpers.lock);
+  for (size_t i = 0; i < helpers.count; i++)
+    pthread_join(helpers.threads[i], NULL);
+  free(helpers.threads);
+  helpers.threads = NULL;
+  helpers.count = 0;
+  fastlock_cond_destroy(&helpers.cond);
+  fastlock_destroy(&helpers.lock);
+}
+
+void progress_batch_init(progress_batch* batch) {
+  fastlock_init(&batch->lock);
+  fastlock_cond_init(&batch->cond);
+  batch->pending = 0;
+}
+
+static void task_run(progress_task* task) {
+  progress_batch* batch = task->batch;
+  task->run(task);
+  fastlock_acquire(&batch->lock);
+  if (!--batch->pending)
+    fastlock_signal_all(&batch->cond);
+  fastlock_release(&batch->lock);
+}
+
+void progress_batch_wait(progress_batch* batch) {
+  fastlock_acquire(&batch->lock);
+  while (batch->pending)
+    fastlock_wait(&batch->cond, &batch->lock);
+  fastlock_release(&batch->lock);
+  fastlock_cond_destroy(&batch->cond);
+  fastlock_destroy(&batch->lock);
+}
+
+static void* helper_thread(void* arg) {
+  fastlock_acquire(&helpers.lock);
+  for (;;) {
+    while (helpers.running && slist_empty(&helpers.tasks))
+      fastlock_wait(&helpers.cond, &helpers.lock);
+    slist_entry* entry = slist_remove_head_unsafe(&helpers.tasks);
+    if (!entry) break;
+    fastlock_release(&helpers.lock);
+    task_run(container_of(entry, progress_task, list_entry));
+    fastlock_acquire(&helpers.lock);
+  }
+  fastlock_release(&helpers.lock);
+  return NULL;
+}
+
+static void helpers_start() {
+  if (!PROGRESS_HELPERS) return;
+  helpers.threads = calloc(PROGRESS_HELPERS, sizeof(pthread_t));
+  if (!helpers.threads) return;
+  helpers.running = 1;
+  while (helpers.count < PROGRESS_HELPERS &&
+         !pthread_create(&helpers.threads[helpers.count], NULL, helper_thread, NULL))
+    helpers.count++;
+  if (!helpers.count) {
+    DPA_WARN("Cannot start progress helper threads, running tasks inline\n");
+    helpers.running = 0;
+  }
+}
+
+static progress_task* engine_take_task(progress_engine* engine) {
+  if (slist_empty(&engine->tasks)) return NULL;
+  slist_entry* entry = slist_remove_head(&engine->tasks);
+  return entry ? container_of(entry, progress_task, list_entry) : NULL;
+}
+
+void progress_submit(progress_engine* engine, progress_batch* batch, progress_task* task) {
+  task->batch = batch;
+  fastlock_acquire(&batch->lock);
+  batch->pending++;
+  fastlock_release(&batch->lock);
+  if (engine && __atomic_load_n(&engine->running, __ATOMIC_ACQUIRE)) {
+    slist_insert_tail(&task->list_entry, &engine->tasks);
+    return;
+  }
+  pthread_once(&helpers.once, helpers_start);
+  fastlock_acquire(&helpers.lock);
+  int queued = helpers.running;
+  if (queued) {
+    slist_insert_tail_unsafe(&task->list_entry, &helpers.tasks);
+    fastlock_signal(&helpers.cond);
+  }
+  fastlock_release(&helpers.lock);
+  if (!queued) task_run(task);
+}
+
+static int worker_push(progress_worker* worker, dpa_fid_ep* ep) {
+  int ret = FI_SUCCESS;
+  fastlock_acquire(&worker->lock);
+  size_t count = worker->tail - worker->head;
+  if (count > worker->mask) {
+    size_t capacity = 2 * (worker->mask + 1);
+    dpa_fid_ep** eps = malloc(capacity * sizeof(dpa_fid_ep*));
+    if (!eps) {
+      ret = -FI_ENOMEM;
+      goto push_end;
+    }
+    for (size_t i = 0; i < count; i++)
+      eps[i] = worker->eps[(worker->head + i) & worker->mask];
+    free(worker->eps);
+    worker->eps = eps;
+    worker->mask = capacity - 1;
+    worker->head = 0;
+    worker->tail = count;
+  }
+  worker->eps[worker->tail++ & worker->mask] = ep;
+ push_end:
+  fastlock_release(&worker->lock);
+  return ret;
+}
+
+static dpa_fid_ep* worker_pop(progress_worker* worker) {
+  dpa_fid_ep* ep = NULL;
+  fastlock_acquire(&worker->lock);
+  if (worker->tail != worker->head)
+    ep = worker->eps[--worker->tail & worker->mask];
+  fastlock_release(&worker->lock);
+  return ep;
+}
+
+static dpa_fid_ep* worker_steal(progress_worker* victim) {
+  // checked without the lock, stealing from an empty worker costs nothing
+  if (__atomic_load_n(&victim->tail, __ATOMIC_RELAXED) ==
+      __atomic_load_n(&victim->head, __ATOMIC_RELAXED))
+    return NULL;
+  dpa_fid_ep* ep = NULL;
+  fastlock_acquire(&victim->lock);
+  if (victim->tail != victim->head)
+    ep = victim->eps[victim->head++ & victim->mask];
+  fastlock_release(&victim->lock);
+  return ep;
+}
+
+static dpa_fid_ep* worker_next(progress_worker* worker) {
+  dpa_fid_ep* ep = worker_pop(worker);
+  progress_engine* engine = worker->engine;
+  for (size_t i = 1; !ep && i < engine->worker_count; i++) {
+    ep = worker_steal(&engine->workers[(worker->index + i) % engine->worker_count]);
+    if (ep) worker->steals++;
+  }
+  return ep;
+}
+
+void progress_engine_activate(dpa_fid_ep* ep) {
+  int idle = PROGRESS_IDLE;
+  if (!__atomic_compare_exchange_n(&ep->progress_state, &idle, PROGRESS_QUEUED,
+                                   0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return; // already queued, closing or detached
+  progress_engine* engine = &ep->domain->progress_engine;
+  if (worker_push(&engine->workers[ep->progress_worker], ep)) {
+    DPA_WARN("Out of memory, endpoint left to application progress\n");
+    __atomic_store_n(&ep->progress_state, PROGRESS_IDLE, __ATOMIC_RELEASE);
+  }
+}
+
+static void worker_run_ep(progress_worker* worker, dpa_fid_ep* ep) {
+  if (__atomic_load_n(&ep->progress_state, __ATOMIC_ACQUIRE) == PROGRESS_CLOSING) {
+    __atomic_store_n(&ep->progress_state, PROGRESS_DETACHED, __ATOMIC_RELEASE);
+    return;
+  }
+  progress_sendrecv_queues(ep, 0);
+  worker->runs++;
+  if (progress_active(ep)) {
+    // keep it local, thieves take it if this worker falls behind
+    if (!worker_push(worker, ep)) return;
+  }
+  int queued = PROGRESS_QUEUED;
+  if (!__atomic_compare_exchange_n(&ep->progress_state, &queued, PROGRESS_IDLE,
+                                   0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&ep->progress_state, PROGRESS_DETACHED, __ATOMIC_RELEASE);
+    return;
+  }
+  // work posted while deactivating would otherwise go unnoticed
+  if (progress_active(ep)) progress_engine_activate(ep);
+}
+
+static inline long elapsed_usec(struct timespec* since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1000000L +
+    (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+static void* worker_thread(void* arg) {
+  progress_worker* worker = arg;
+  progress_engine* engine = worker->engine;
+  if (PROGRESS_THREAD_CPU >= 0 &&
+      cpu_bind_self(PROGRESS_THREAD_CPU + worker->index))
+    DPA_WARN("Cannot pin progress worker %zu to CPU %zu\n", worker->index,
+             PROGRESS_THREAD_CPU + worker->index);
+
+  struct timespec idle_since;
+  clock_gettime(CLOCK_MONOTONIC, &idle_since);
+  long sleep_usec = 0;
+  while (__atomic_load_n(&engine->running, __ATOMIC_ACQUIRE)) {
+    progress_task* task = engine_take_task(engine);
+    if (task) task_run(task);
+    dpa_fid_ep* ep = worker_next(worker);
+    if (ep) worker_run_ep(worker, ep);
+    // domain wide work is left to the first worker
+    if (!worker->index) {
+      mr_progress_domain_events(engine->domain);
+      rma_reclaim(engine->domain);
+    }
+
+    if (ep || task) {
+      clock_gettime(CLOCK_MONOTONIC, &idle_since);
+      sleep_usec = 0;
+    } else if (elapsed_usec(&idle_since) >= PROGRESS_SPIN_USEC) {
+      sleep_usec = MIN(sleep_usec ? 2 * sleep_usec : 1, PROGRESS_SLEEP_USEC);
+      struct timespec nap = {
+        .tv_sec = sleep_usec / 1000000,
+        .tv_nsec = (sleep_usec % 1000000) * 1000
+      };
+      nanosleep(&nap, NULL);
+    }
+  }
+  return NULL;
+}
+
+void progress_engine_start(progress_engine* engine, dpa_fid_domain* domain) {
+  engine->domain = domain;
+  engine->running = 0;
+  engine->worker_count = 0;
+  engine->next_worker = 0;
+  engine->workers = NULL;
+  slist_init(&engine->tasks);
+  if (!PROGRESS_THREADS) return;
+
+  engine->workers = numa_calloc(PROGRESS_THREADS * sizeof(progress_worker),
+                                FI_DPA_NUMA_ANY);
+  if (!engine->workers) goto start_fail;
+  engine->running = 1;
+  for (size_t i = 0; i < PROGRESS_THREADS; i++) {
+    progress_worker* worker = &engine->workers[i];
+    worker->engine = engine;
+    worker->index = i;
+    worker->mask = 15;
+    worker->eps = malloc((worker->mask + 1) * sizeof(dpa_fid_ep*));
+    fastlock_init(&worker->lock);
+    if (!worker->eps ||
+        pthread_create(&worker->thread, NULL, worker_thread, worker)) {
+      free(worker->eps);
+      fastlock_destroy(&worker->lock);
+      break;
+    }
+    engine->worker_count++;
+  }
+  if (!engine->worker_count) {
+    free(engine->workers);
+    engine->workers = NULL;
+    engine->running = 0;
+    goto start_fail;
+  }
+  DPA_INFO("Progress engine started with %zu worker(s)%s\n", engine->worker_count,
+           PROGRESS_THREAD_CPU >= 0 ? ", pinned" : "");
+  return;
+
+ start_fail:
+  DPA_WARN("Cannot start progress engine\n");
+}
+
+void progress_engine_stop(progress_engine* engine) {
+  if (!engine->running) {
+    fastlock_destroy(&engine->tasks.lock);
+    return;
+  }
+  __atomic_store_n(&engine->running, 0, __ATOMIC_RELEASE);
+  for (size_t i = 0; i < engine->worker_count; i++) {
+    progress_worker* worker = &engine->workers[i];
+    pthread_join(worker->thread, NULL);
+    DPA_INFO("Progress worker %zu: %lu endpoint runs, %lu stolen\n",
+             i, worker->runs, worker->steals);
+    free(worker->eps);
+    fastlock_destroy(&worker->lock);
+  }
+  free(engine->workers);
+  engine->workers = NULL;
+  // tasks are waited for by their submitters, none can be left
+  fastlock_destroy(&engine->tasks.lock);
+}
+
+void progress_engine_add(progress_engine* engine, dpa_fid_ep* ep) {
+  if (!engine->running) return;
+  ep->progress_worker =
+    __atomic_fetch_add(&engine->next_worker, 1, __ATOMIC_RELAXED) % engine->worker_count;
+  __atomic_store_n(&ep->progress_state, PROGRESS_IDLE, __ATOMIC_RELEASE);
+}
+
+/**
+ * Detach ep from the engine, waiting for the worker holding it if any.
+ */
+void progress_engine_remove(progress_engine* engine, dpa_fid_ep* ep) {
+  for (;;) {
+    int state = __atomic_load_n(&ep->progress_state, __ATOMIC_ACQUIRE);
+    if (state == PROGRESS_DETACHED) return;
+    if (!__atomic_load_n(&engine->running, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&ep->progress_state, PROGRESS_DETACHED, __ATOMIC_RELEASE);
+      return;
+    }
+    if (state == PROGRESS_CLOSING) {
+      sched_yield();
+      continue;
+    }
+    // a queued endpoint is detached by the worker that picks it up
+    int next = state == PROGRESS_IDLE ? PROGRESS_DETACHED : PROGRESS_CLOSING;
+    __atomic_compare_exchange_n(&ep->progress_state, &state, next,
+                                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  }
+}
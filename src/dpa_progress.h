@@ -0,0 +1,103 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+typedef struct progress_engine progress_engine;
+typedef struct progress_worker progress_worker;
+typedef struct progress_task progress_task;
+typedef struct progress_batch progress_batch;
+
+#ifndef DPA_PROGRESS_H
+#define DPA_PROGRESS_H
+#include "dpa.h"
+
+EXTERN_ENV_CONST(int, PROGRESS_CALLBACKS);
+
+/* Endpoint states in the progress engine. An endpoint is queued on at
+ * most one worker at a time, so only one thread ever progresses it. */
+#define PROGRESS_DETACHED 0
+#define PROGRESS_IDLE 1
+#define PROGRESS_QUEUED 2
+#define PROGRESS_CLOSING 3
+
+/* Active endpoints of a worker: the owner takes from the tail,
+ * idle workers steal from the head. */
+struct progress_worker {
+  pthread_t thread;
+  progress_engine* engine;
+  size_t index;
+  fastlock_t lock;
+  struct dpa_fid_ep** eps;
+  size_t head;
+  size_t tail;
+  size_t mask;
+  uint64_t runs;
+  uint64_t steals;
+} __attribute__((aligned(DPA_CACHE_LINE)));
+
+struct progress_engine {
+  struct dpa_fid_domain* domain;
+  int running;
+  size_t worker_count;
+  size_t next_worker;
+  progress_worker* workers;
+  slist tasks;
+};
+
+/* Blocking calls handed to provider threads so that several of them
+ * overlap, like connection handshakes. Tasks run on the workers of the
+ * engine when it is running, else on a few persistent helper threads.
+ * The submitter waits for the whole batch. */
+struct progress_batch {
+  fastlock_t lock;
+  fastlock_cond_t cond;
+  size_t pending;
+};
+
+struct progress_task {
+  void (*run)(progress_task* task);
+  progress_batch* batch;
+  slist_entry list_entry;
+};
+
+void dpa_progress_init();
+void dpa_progress_fini();
+void progress_batch_init(progress_batch* batch);
+void progress_submit(progress_engine* engine, progress_batch* batch, progress_task* task);
+// wait for every task of the batch, then release it
+void progress_batch_wait(progress_batch* batch);
+void progress_engine_start(progress_engine* engine, struct dpa_fid_domain* domain);
+void progress_engine_stop(progress_engine* engine);
+void progress_engine_add(progress_engine* engine, struct dpa_fid_ep* ep);
+void progress_engine_remove(progress_engine* engine, struct dpa_fid_ep* ep);
+void progress_engine_activate(struct dpa_fid_ep* ep);
+
+#endif
@@ -34,19 +34,118 @@
 #include "dpa_rma.h"
 #include "dpa_av.h"
 #include "dpa_ep.h"
-  
-void cache_disconnect(remote_mr_cache* cache) {
+
+#ifndef RMA_WINDOW_SIZE_DEFAULT
+#define RMA_WINDOW_SIZE_DEFAULT (64 * 1024 * 1024)
+#endif
+DEFINE_ENV_CONST(size_t, RMA_WINDOW_SIZE, RMA_WINDOW_SIZE_DEFAULT);
+#ifndef RMA_RECLAIM_MAX_DEFAULT
+#define RMA_RECLAIM_MAX_DEFAULT 16
+#endif
+DEFINE_ENV_CONST(size_t, RMA_RECLAIM_MAX, RMA_RECLAIM_MAX_DEFAULT);
+#ifndef RMA_CACHE_SIZE_DEFAULT
+#define RMA_CACHE_SIZE_DEFAULT 16
+#endif
+DEFINE_ENV_CONST(size_t, RMA_CACHE_SIZE, RMA_CACHE_SIZE_DEFAULT);
+#ifndef RMA_STRIPE_SIZE_DEFAULT
+#define RMA_STRIPE_SIZE_DEFAULT (1 << 20)
+#endif
+DEFINE_ENV_CONST(size_t, RMA_STRIPE_SIZE, RMA_STRIPE_SIZE_DEFAULT);
+// an empty table would leave no slot for the current target
+#define RMA_CACHE_SLOTS MAX(RMA_CACHE_SIZE, 1)
+// RMA_WINDOW_SIZE as validated at init: whole pages, at least one
+static size_t rma_window_size = RMA_WINDOW_SIZE_DEFAULT;
+
+void dpa_rma_init() {
+  ENV_OVERRIDE_INT(RMA_WINDOW_SIZE);
+  ENV_OVERRIDE_INT(RMA_RECLAIM_MAX);
+  ENV_OVERRIDE_INT(RMA_CACHE_SIZE);
+  ENV_OVERRIDE_INT(RMA_STRIPE_SIZE);
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t page = page_size > 0 ? (size_t) page_size : 4096;
+  rma_window_size = RMA_WINDOW_SIZE - RMA_WINDOW_SIZE % page;
+  if (!rma_window_size) {
+    DPA_WARN("RMA window size %zu is below the page size, using %zu\n",
+             (size_t) RMA_WINDOW_SIZE, (size_t) RMA_WINDOW_SIZE_DEFAULT);
+    rma_window_size = RMA_WINDOW_SIZE_DEFAULT;
+  }
+}
+
+void cache_disconnect_interrupt(remote_mr_cache* cache) {
+  if (!cache->interrupt) return;
+  dpa_error_t nocheck;
+  DPADisconnectInterrupt(cache->interrupt, NO_FLAGS, &nocheck);
+  cache->interrupt = NULL;
+  cache->interruptId = 0;
+}
+
+static inline void window_unmap(remote_window* window) {
   dpa_error_t error;
-  if (cache->sequence) {
-    DPARemoveSequence(cache->sequence, NO_FLAGS, &error);
+  if (window->sequence) {
+    DPARemoveSequence(window->sequence, NO_FLAGS, &error);
     DPALIB_CHECK_ERROR(DPARemoveSequence, );
-    cache->sequence = NULL;
+    window->sequence = NULL;
   }
-  if (cache->map) {
-    DPAUnmapSegment(cache->map, NO_FLAGS, &error);
+  if (window->map) {
+    DPAUnmapSegment(window->map, NO_FLAGS, &error);
     DPALIB_CHECK_ERROR(DPAUnmapSegment, );
-    cache->map = NULL;
+    window->map = NULL;
   }
+  window->base = NULL;
+  window->offset = window->len = 0;
+  window->dirty = 0;
+}
+
+static inline dpa_error_t window_map(remote_mr_cache* cache, remote_window* window,
+                                     size_t offset, size_t len) {
+  dpa_error_t error;
+  DPA_DEBUG("Mapping %zu bytes at offset %zu of segment %u on node %u\n",
+            len, offset, cache->target.connectId, cache->target.nodeId);
+  window->base = DPAMapRemoteSegment(cache->segment, &window->map, offset, len,
+                                     NULL, NO_FLAGS, &error);
+  DPALIB_CHECK_ERROR(DPAMapRemoteSegment, goto window_map_end);
+  window->offset = offset;
+  window->len = len;
+  window->last_use = ++cache->window_clock;
+  DPACreateMapSequence(window->map, &window->sequence, DPA_FLAG_FAST_BARRIER, &error);
+  DPALIB_CHECK_ERROR(DPACreateMapSequence, goto window_map_end);
+  dpa_sequence_status_t status;
+  do {
+    status = DPAStartSequence(window->sequence, NO_FLAGS, &error);
+  } while (status != DPA_SEQ_OK);
+ window_map_end:
+  if (error != DPA_ERR_OK) window_unmap(window);
+  return error;
+}
+
+void signal_interrupt(remote_mr_cache* cache, dpa_intid_t interruptId);
+
+/**
+ * Give our reporting slot back to the target, or withdraw a request
+ * it has not granted yet. Must run while windows[0] is still mapped.
+ */
+static inline void cache_release_slot(remote_mr_cache* cache) {
+  if (!cache->slot_request || !cache->windows[0].base) return;
+  volatile mr_initiator* slot = mr_slot(cache->events, cache->slot_offset,
+                                        cache->slot_stride, cache->slot_index);
+  if (slot->owner != cache->slot_request) {
+    slot->request = 0;
+    dpa_barrier(cache->windows[0].sequence);
+    // the target may have granted it in the meantime
+    if (slot->owner != cache->slot_request) return;
+  }
+  slot->release = cache->slot_request;
+  dpa_barrier(cache->windows[0].sequence);
+  if (cache->hasEventInt)
+    signal_interrupt(cache, cache->eventIntId);
+}
+
+void cache_disconnect(remote_mr_cache* cache) {
+  dpa_error_t error;
+  cache_release_slot(cache);
+  cache_disconnect_interrupt(cache);
+  for (int i = 0; i < RMA_WINDOW_SLOTS; i++)
+    window_unmap(&cache->windows[i]);
   if (cache->segment) {
     DPADisconnectSegment(cache->segment, NO_FLAGS, &error);
     DPALIB_CHECK_ERROR(DPADisconnectSegment, );
@@ -58,56 +157,323 @@ void cache_disconnect(remote_mr_cache* cache) {
     cache->sd = NULL;
   }
   cache->target.nodeId = cache->target.connectId = 0;
-  cache->base = NULL;
-  cache->len = 0;
+  cache->seg_len = cache->data_offset = cache->len = 0;
+  cache->events = NULL;
+  cache->cq_data_head = cache->cq_data_tail = 0;
+  cache->cq_data_size = 0;
+  cache->rma_events = 0;
+  cache->slot_count = cache->slot_offset = cache->slot_stride = 0;
+  cache->slot_index = 0;
+  cache->initiator_id = cache->slot_request = 0;
+  cache->slot = NULL;
+  cache->write_tail = cache->read_tail = 0;
+  cache->hasEventInt = 0;
+  cache->eventIntRail = 0;
+  cache->eventIntId = 0;
+}
+
+static inline void cache_flush(remote_mr_cache* cache) {
+  for (int i = 0; i < RMA_WINDOW_SLOTS; i++) {
+    remote_window* window = &cache->windows[i];
+    if (!window->dirty) continue;
+    dpa_barrier(window->sequence);
+    window->dirty = 0;
+  }
+}
+
+/**
+ * Tear down mappings evicted from RMA caches of this domain.
+ */
+void rma_reclaim(dpa_fid_domain* domain) {
+  slist* list = &domain->rma_reclaim;
+  if (slist_empty(list)) return;
+  slist_lock(list);
+  slist_entry* head = list->head;
+  slist_init_unsafe(list);
+  domain->rma_reclaim_count = 0;
+  slist_unlock(list);
+
+  while (head) {
+    rma_reclaim_entry* entry = container_of(head, rma_reclaim_entry, list_entry);
+    head = head->next;
+    cache_disconnect(&entry->cache);
+    free(entry);
+  }
+}
+
+/**
+ * Detach a target from the cache, deferring its teardown
+ * so that a miss only pays for the new connection.
+ */
+static void cache_release(dpa_fid_domain* domain, remote_mr_cache* cache) {
+  if (!cache->segment) {
+    cache->last_use = 0;
+    return;
+  }
+  // writes still buffered for the old target must land before unmapping
+  cache_flush(cache);
+  rma_reclaim_entry* entry = malloc(sizeof(rma_reclaim_entry));
+  if (!entry) {
+    cache_disconnect(cache);
+    cache->last_use = 0;
+    return;
+  }
+  entry->cache = *cache;
+  memset(cache, 0, sizeof(remote_mr_cache));
+
+  slist* list = &domain->rma_reclaim;
+  slist_lock(list);
+  slist_insert_tail_unsafe(&entry->list_entry, list);
+  size_t pending = ++domain->rma_reclaim_count;
+  slist_unlock(list);
+  // bound the resources held by evicted mappings
+  if (pending > RMA_RECLAIM_MAX)
+    rma_reclaim(domain);
+}
+
+void rma_cache_init(dpa_fid_ep* ep) {
+  ep->rma_cache = calloc(RMA_CACHE_SLOTS, sizeof(remote_mr_cache));
+  ep->last_remote_mr = ep->rma_cache;
+  ep->rma_cache_clock = 0;
 }
 
-dpa_error_t cache_connect(dpa_fid_ep* ep, dpa_addr_t target) {
-  if (target.nodeId == ep->last_remote_mr.target.nodeId &&
-      target.connectId == ep->last_remote_mr.target.connectId &&
-      ep->last_remote_mr.base)
-    return DPA_ERR_OK;
+void rma_cache_fini(dpa_fid_ep* ep) {
+  if (!ep->rma_cache) return;
+  for (size_t i = 0; i < RMA_CACHE_SLOTS; i++)
+    cache_release(ep->domain, &ep->rma_cache[i]);
+  free(ep->rma_cache);
+  ep->rma_cache = ep->last_remote_mr = NULL;
+}
 
-  if (ep->last_remote_mr.segment)
-    cache_disconnect(&ep->last_remote_mr);
+static inline void cache_flush_all(dpa_fid_ep* ep) {
+  for (size_t i = 0; i < RMA_CACHE_SLOTS; i++)
+    cache_flush(&ep->rma_cache[i]);
+}
 
+/**
+ * Return a window mapping the given segment offset, mapping it on
+ * demand over the least recently used slot.
+ */
+static inline remote_window* cache_window(remote_mr_cache* cache, size_t offset) {
+  remote_window* victim = NULL;
+  for (int i = 0; i < RMA_WINDOW_SLOTS; i++) {
+    remote_window* window = &cache->windows[i];
+    if (window->base && offset >= window->offset &&
+        offset - window->offset < window->len) {
+      window->last_use = ++cache->window_clock;
+      return window;
+    }
+    // first window is pinned, it holds the control area
+    if (i && (!victim || !window->base ||
+              (victim->base && window->last_use < victim->last_use)))
+      victim = window;
+  }
+  if (!victim) return NULL;
+
+  if (victim->base) {
+    if (victim->dirty) dpa_barrier(victim->sequence);
+    window_unmap(victim);
+  }
+  size_t window_offset = (offset / rma_window_size) * rma_window_size;
+  size_t window_len = MIN(rma_window_size, cache->seg_len - window_offset);
+  if (window_map(cache, victim, window_offset, window_len) != DPA_ERR_OK)
+    return NULL;
+  return victim;
+}
+
+/**
+ * Identifies this process and connection among the initiators of a key:
+ * node, pid and a per process counter.
+ */
+static inline uint64_t rma_initiator_id() {
+  static uint64_t next = 0;
+  uint64_t count = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+  return ((uint64_t) (localNodeId & 0xffff) << 32) |
+    ((uint64_t) (getpid() & 0x3fffff) << 10) | (count & 0x3ff);
+}
+
+/**
+ * Segments registered through fi_mr_reg start with an event area;
+ * hide it from RMA offsets and remember where remote CQ data goes.
+ */
+static inline void cache_read_events(remote_mr_cache* cache) {
+  remote_window* window = &cache->windows[0];
+  volatile mr_event_area* events = window->base;
+  cache->data_offset = 0;
+  cache->len = cache->seg_len;
+  if (window->len < sizeof(mr_event_area) || events->magic != MR_EVENT_MAGIC ||
+      events->data_offset > window->len)
+    return;
+  cache->events = events;
+  cache->cq_data_size = events->ring_size;
+  cache->rma_events = events->rma_events;
+  cache->slot_count = events->slot_count;
+  cache->slot_offset = events->slot_offset;
+  cache->slot_stride = events->slot_stride;
+  cache->initiator_id = rma_initiator_id();
+  cache->slot_index = cache->slot_count ? cache->initiator_id % cache->slot_count : 0;
+  cache->hasEventInt = events->hasInterrupt;
+  cache->eventIntRail = events->interruptRail;
+  cache->eventIntId = events->interruptId;
+  cache->data_offset = events->data_offset;
+  cache->len -= events->data_offset;
+  // never past what was registered, even if the segment is larger
+  cache->len = MIN(cache->len, events->data_len);
+}
+
+static dpa_error_t cache_slot_connect(remote_mr_cache* cache, dpa_addr_t target,
+                                      size_t rail) {
   dpa_error_t error = DPA_ERR_OK;
-  DPA_DEBUG("Connecting and mapping segment %u on node %u for RMA\n",
-            target.connectId, target.nodeId);
-  DPAOpen(&ep->last_remote_mr.sd, NO_FLAGS, &error);
+  DPA_DEBUG("Connecting segment %u on node %u for RMA on rail %zu\n",
+            target.connectId, target.nodeId, rail);
+  DPAOpen(&cache->sd, NO_FLAGS, &error);
   DPALIB_CHECK_ERROR(DPAOpen, goto cache_connect_end);
 
-  DPAConnectSegment(ep->last_remote_mr.sd, &ep->last_remote_mr.segment,
-                    target.nodeId, target.connectId, localAdapterNo,
+  DPAConnectSegment(cache->sd, &cache->segment,
+                    rail_node(target.nodeId, rail), target.connectId, dpaRails[rail],
                     NULL, NULL, DPA_INFINITE_TIMEOUT, NO_FLAGS, &error);
   DPALIB_CHECK_ERROR(DPAConnectSegment, goto cache_connect_end);
 
-  ep->last_remote_mr.len = DPAGetRemoteSegmentSize(ep->last_remote_mr.segment);
-
-  ep->last_remote_mr.base = DPAMapRemoteSegment(ep->last_remote_mr.segment,
-                                                &ep->last_remote_mr.map,
-                                                0, ep->last_remote_mr.len,
-                                                NULL, NO_FLAGS, &error);
-  DPALIB_CHECK_ERROR(DPAMapRemoteSegment, goto cache_connect_end);
-  DPACreateMapSequence(ep->last_remote_mr.map, &ep->last_remote_mr.sequence, DPA_FLAG_FAST_BARRIER, &error);
-  DPALIB_CHECK_ERROR(DPACreateMapSequence, goto cache_connect_end);
-  dpa_sequence_status_t status;
-  do {
-    status = DPAStartSequence(ep->last_remote_mr.sequence, NO_FLAGS, &error);
-  } while (status != DPA_SEQ_OK);
+  cache->target = target;
+  cache->rail = rail;
+  cache->seg_len = DPAGetRemoteSegmentSize(cache->segment);
+  // small segments are mapped as a whole
+  error = window_map(cache, &cache->windows[0], 0,
+                     MIN(cache->seg_len, rma_window_size));
+  if (error != DPA_ERR_OK) goto cache_connect_end;
+  cache_read_events(cache);
 
-  ep->last_remote_mr.target = target;
  cache_connect_end:
-  if (error != DPA_ERR_OK) cache_disconnect(&ep->last_remote_mr);
+  if (error != DPA_ERR_OK) {
+    cache_disconnect(cache);
+    cache->last_use = 0;
+  }
   return error;
 }
 
-void cache_disconnect_interrupt(remote_mr_cache* cache) {
-  if (!cache->interrupt) return;
-  dpa_error_t nocheck;
-  DPADisconnectInterrupt(cache->interrupt, NO_FLAGS, &nocheck);
-  cache->interrupt = NULL;
-  cache->interruptId = 0;
+static inline int cache_hit(remote_mr_cache* cache, dpa_addr_t target, size_t rail) {
+  return target.nodeId == cache->target.nodeId &&
+    target.connectId == cache->target.connectId &&
+    rail == cache->rail && cache->windows[0].base;
+}
+
+static inline remote_mr_cache* cache_lookup(dpa_fid_ep* ep, dpa_addr_t target,
+                                            size_t rail) {
+  for (size_t i = 0; i < RMA_CACHE_SLOTS; i++)
+    if (cache_hit(&ep->rma_cache[i], target, rail))
+      return &ep->rma_cache[i];
+  return NULL;
+}
+
+/**
+ * Pick a free slot, or release the least recently used target.
+ * The slot is marked as used, so it is not picked again.
+ */
+static inline remote_mr_cache* cache_victim(dpa_fid_ep* ep) {
+  remote_mr_cache* victim = &ep->rma_cache[0];
+  for (size_t i = 0; i < RMA_CACHE_SLOTS && victim->last_use; i++)
+    if (ep->rma_cache[i].last_use < victim->last_use)
+      victim = &ep->rma_cache[i];
+  cache_release(ep->domain, victim);
+  victim->last_use = ++ep->rma_cache_clock;
+  return victim;
+}
+
+dpa_error_t cache_connect(dpa_fid_ep* ep, dpa_addr_t target, size_t rail) {
+  remote_mr_cache* cache = ep->last_remote_mr;
+  if (!cache_hit(cache, target, rail)) {
+    cache = cache_lookup(ep, target, rail);
+    if (!cache) {
+      cache = cache_victim(ep);
+      dpa_error_t error = cache_slot_connect(cache, target, rail);
+      if (error != DPA_ERR_OK) return error;
+      rail_connected(ep->domain, rail);
+    }
+    ep->last_remote_mr = cache;
+  }
+  cache->last_use = ++ep->rma_cache_clock;
+  return DPA_ERR_OK;
+}
+
+typedef struct prefetch_job {
+  progress_task task;
+  remote_mr_cache* cache;
+  dpa_addr_t target;
+  size_t rail;
+  dpa_error_t error;
+} prefetch_job;
+
+static void prefetch_run(progress_task* task) {
+  prefetch_job* job = container_of(task, prefetch_job, task);
+  job->error = cache_slot_connect(job->cache, job->target, job->rail);
+}
+
+static inline ssize_t resolve_target(dpa_fid_ep* ep, fi_addr_t addr, uint64_t key,
+                                     dpa_addr_t* target) {
+  if (ep->connected) target->nodeId = ep->peer_addr.nodeId;
+  else {
+    size_t addrlen = sizeof(dpa_addr_t);
+    dpa_av_lookup(&ep->av->av, addr, target, &addrlen);
+  }
+  target->connectId = (dpa_intid_t) mr_key_segment(key);
+  if (target->connectId != mr_key_segment(key))
+    return -FI_EINVAL; //truncation occurred, invalid
+  return FI_SUCCESS;
+}
+
+int dpa_rma_prefetch(struct fid_ep* ep, const struct fi_dpa_rma_target* targets,
+                     size_t count, uint64_t flags) {
+  if (!targets && count) return -FI_EINVAL;
+  dpa_fid_ep* ep_priv = container_of(ep, dpa_fid_ep, ep);
+  if (!ep_priv->rma_cache) return -FI_ENOMEM;
+  if (count > RMA_CACHE_SLOTS) {
+    DPA_WARN("Prefetching only %zu of %zu RMA targets, raise FI_DPA_RMA_CACHE_SIZE\n",
+             RMA_CACHE_SLOTS, count);
+    count = RMA_CACHE_SLOTS;
+  }
+
+  prefetch_job* jobs = calloc(count, sizeof(prefetch_job));
+  if (!jobs) return -FI_ENOMEM;
+  size_t njobs = 0;
+  int ret = FI_SUCCESS;
+  for (size_t i = 0; i < count; i++) {
+    dpa_addr_t target;
+    ret = resolve_target(ep_priv, targets[i].addr, targets[i].key, &target);
+    if (ret) goto prefetch_end;
+    remote_mr_cache* cache = cache_lookup(ep_priv, target, ep_priv->rail);
+    if (cache) {
+      cache->last_use = ++ep_priv->rma_cache_clock;
+      continue;
+    }
+    int duplicate = 0;
+    for (size_t j = 0; j < njobs && !duplicate; j++)
+      duplicate = jobs[j].target.nodeId == target.nodeId &&
+        jobs[j].target.connectId == target.connectId;
+    if (duplicate) continue;
+    jobs[njobs].cache = cache_victim(ep_priv);
+    jobs[njobs].target = target;
+    jobs[njobs].rail = ep_priv->rail;
+    njobs++;
+  }
+
+  // overlap the connection handshakes of all targets on provider threads
+  progress_batch batch;
+  progress_batch_init(&batch);
+  for (size_t i = 0; i < njobs; i++) {
+    jobs[i].task.run = prefetch_run;
+    progress_submit(&ep_priv->domain->progress_engine, &batch, &jobs[i].task);
+  }
+  progress_batch_wait(&batch);
+  for (size_t i = 0; i < njobs; i++) {
+    if (jobs[i].error != DPA_ERR_OK)
+      ret = -FI_EREMOTEIO;
+    else
+      rail_connected(ep_priv->domain, jobs[i].rail);
+  }
+
+ prefetch_end:
+  free(jobs);
+  return ret;
 }
 
 dpa_error_t cache_connect_interrupt(remote_mr_cache* cache, dpa_intid_t interruptId) {
@@ -117,18 +483,23 @@ dpa_error_t cache_connect_interrupt(remote_mr_cache* cache, dpa_intid_t interrup
     else
       cache_disconnect_interrupt(cache);
   }
+  // the target may have created it on another rail than our mapping's
+  size_t rail = cache->eventIntRail;
+  if (rail >= dpaRailCount) {
+    DPA_WARN("Target interrupt is on rail %zu, only %zu rail(s) in use\n",
+             rail, dpaRailCount);
+    return DPA_ERR_SYSTEM;
+  }
   dpa_error_t error;
-  DPAConnectInterrupt(cache->sd, &cache->interrupt, cache->target.nodeId,
-                      localAdapterNo, interruptId, DPA_INFINITE_TIMEOUT,
-                      NO_FLAGS, &error);
+  DPAConnectInterrupt(cache->sd, &cache->interrupt,
+                      rail_node(cache->target.nodeId, rail), dpaRails[rail],
+                      interruptId, DPA_INFINITE_TIMEOUT, NO_FLAGS, &error);
   if (error == DPA_ERR_OK)
     cache->interruptId = interruptId;
   return error;
 }
 
-void signal_interrupt(remote_mr_cache* cache, uint64_t data) {
-  dpa_intid_t interruptId = (dpa_intid_t) data;
-  if (interruptId != data) return;
+void signal_interrupt(remote_mr_cache* cache, dpa_intid_t interruptId) {
   dpa_error_t error = cache_connect_interrupt(cache, interruptId);
   DPALIB_CHECK_ERROR(DPAConnectInterrupt, return);
 
@@ -136,17 +507,274 @@ void signal_interrupt(remote_mr_cache* cache, uint64_t data) {
   DPALIB_CHECK_ERROR(DPATriggerInterrupt, );
 }
 
-ssize_t acquire_target(dpa_fid_ep* ep, const struct fi_msg_rma* msg, dpa_addr_t* target) {  
-  if (ep->connected) target->nodeId = ep->peer_addr.nodeId;
-  else {
-    size_t addrlen = sizeof(dpa_addr_t);
-    dpa_av_lookup(&ep->av->av, msg->addr, target, &addrlen);
+// whether our ring on the target is full, looking at its head again if needed
+static inline int cq_data_full(remote_mr_cache* cache) {
+  if (cache->cq_data_tail - cache->cq_data_head < cache->cq_data_size)
+    return 0;
+  cache->cq_data_head = cache->slot->cq_data_head;
+  return cache->cq_data_tail - cache->cq_data_head >= cache->cq_data_size;
+}
+
+/**
+ * Append remote CQ data to our ring on the cached target.
+ * The slot must have been claimed and payload must already be flushed.
+ */
+static inline ssize_t post_cq_data(remote_mr_cache* cache, uint64_t offset,
+                                   size_t len, uint64_t data) {
+  volatile mr_initiator* slot = cache->slot;
+  if (!slot) return -FI_EOPNOTSUPP;
+  if (cq_data_full(cache)) return -FI_EAGAIN;
+  volatile rma_cq_data* cq_data =
+    &slot->cq_data[cache->cq_data_tail % cache->cq_data_size];
+  cq_data->key = cache->target.connectId;
+  cq_data->offset = offset;
+  cq_data->len = len;
+  cq_data->data = data;
+  dpa_barrier(cache->windows[0].sequence);
+  slot->cq_data_tail = ++cache->cq_data_tail;
+  dpa_barrier(cache->windows[0].sequence);
+
+  if (cache->hasEventInt)
+    signal_interrupt(cache, cache->eventIntId);
+  return FI_SUCCESS;
+}
+
+/**
+ * Make sure we own a reporting slot on the target before counting
+ * anything there or posting CQ data. Free slots are requested starting
+ * from our own index; returns -FI_EAGAIN until the target grants one,
+ * which it does when it progresses its events, and -FI_ENOSPC when
+ * every slot is owned by other initiators.
+ */
+static ssize_t cache_claim_slot(remote_mr_cache* cache, uint8_t cq_data) {
+  if (cache->slot) return FI_SUCCESS;
+  if (cq_data) {
+    if (!cache->events || !cache->slot_count) return -FI_EOPNOTSUPP;
+  } else if (!cache->rma_events)
+    return FI_SUCCESS;
+  // the target may have stopped listening since we connected
+  else if (!cache->events->rma_events) {
+    cache->rma_events = 0;
+    return FI_SUCCESS;
   }
-  target->connectId = (dpa_intid_t) msg->rma_iov[0].key;
-  if (target->connectId != msg->rma_iov[0].key)
-    return -FI_EINVAL; //truncation occurred, invalid
+  for (uint32_t probe = 0; probe < cache->slot_count; probe++) {
+    volatile mr_initiator* slot = mr_slot(cache->events, cache->slot_offset,
+                                          cache->slot_stride, cache->slot_index);
+    uint64_t owner = slot->owner;
+    if (owner && owner == cache->slot_request) {
+      cache->slot = slot;
+      cache->write_tail = slot->write_tail;
+      cache->read_tail = slot->read_tail;
+      cache->cq_data_head = slot->cq_data_head;
+      cache->cq_data_tail = slot->cq_data_tail;
+      return FI_SUCCESS;
+    }
+    if (!owner) {
+      uint64_t generation = slot->generation;
+      // ask again if the slot changed hands or another request replaced ours
+      if (!mr_slot_current(cache->slot_request, generation) ||
+          slot->request != cache->slot_request) {
+        if (!mr_slot_current(cache->slot_request, generation))
+          cache->slot_request = mr_slot_request(cache->initiator_id, generation);
+        slot->request = cache->slot_request;
+        dpa_barrier(cache->windows[0].sequence);
+        if (cache->hasEventInt)
+          signal_interrupt(cache, cache->eventIntId);
+      }
+      return -FI_EAGAIN;
+    }
+    cache->slot_request = 0;
+    cache->slot_index = (cache->slot_index + 1) % cache->slot_count;
+  }
+  DPA_WARN("All %u event slots of key %u on node %u are taken, "
+           "raise FI_DPA_MR_EVENT_SLOTS on the target\n",
+           cache->slot_count, cache->target.connectId, cache->target.nodeId);
+  return -FI_ENOSPC;
+}
+
+/**
+ * Report one completed access to a target that asked for RMA events.
+ * The slot must have been claimed.
+ */
+static inline void post_rma_event(remote_mr_cache* cache, uint8_t write) {
+  if (!cache->slot) return;
+  if (write) {
+    cache_flush(cache);
+    cache->slot->write_tail = ++cache->write_tail;
+  } else
+    cache->slot->read_tail = ++cache->read_tail;
+  dpa_barrier(cache->windows[0].sequence);
+  if (cache->hasEventInt)
+    signal_interrupt(cache, cache->eventIntId);
+}
 
-  if (cache_connect(ep, *target) != DPA_ERR_OK) return -FI_EREMOTEIO;
+ssize_t acquire_target(dpa_fid_ep* ep, fi_addr_t addr, uint64_t key) {
+  if (!ep->rma_cache) return -FI_ENOMEM;
+  dpa_addr_t target;
+  ssize_t ret = resolve_target(ep, addr, key, &target);
+  if (ret) return ret;
+
+  if (cache_connect(ep, target, ep->rail) != DPA_ERR_OK) return -FI_EREMOTEIO;
+  return FI_SUCCESS;
+}
+
+/**
+ * Mapping of the target of base through another rail,
+ * falling back to base if that rail cannot reach it.
+ */
+static inline remote_mr_cache* rail_cache(dpa_fid_ep* ep, remote_mr_cache* base,
+                                          size_t rail) {
+  if (rail == base->rail) return base;
+  if (cache_connect(ep, base->target, rail) != DPA_ERR_OK) {
+    ep->last_remote_mr = base;
+    return base;
+  }
+  return ep->last_remote_mr;
+}
+
+// large transfers are split in stripes, dealt round robin over the rails
+static inline int rma_striped(dpa_fid_ep* ep, size_t len) {
+  return ep->domain->rail_count > 1 && RMA_STRIPE_SIZE &&
+    len >= 2 * RMA_STRIPE_SIZE && RMA_CACHE_SLOTS > ep->domain->rail_count;
+}
+
+typedef struct iov_cursor {
+  const struct iovec* iov;
+  size_t count;
+  size_t index;
+  size_t offset;
+} iov_cursor;
+
+static inline size_t iov_total_len(const struct iovec* iov, size_t count) {
+  size_t total_len = 0;
+  for (int i = 0; i < count; i++)
+    total_len += iov[i].iov_len;
+  return total_len;
+}
+
+/**
+ * Copy up to len bytes between remote memory and the local iovecs,
+ * starting where the previous call on the same cursor stopped.
+ */
+static inline size_t iov_copy(iov_cursor* cursor, volatile void* remote,
+                              size_t len, uint8_t write) {
+  size_t copied = 0;
+  while (copied < len && cursor->index < cursor->count) {
+    const struct iovec* iov = &cursor->iov[cursor->index];
+    size_t copy = MIN(len - copied, iov->iov_len - cursor->offset);
+    void* local = iov->iov_base + cursor->offset;
+    if (write)
+      memcpy((void*)remote + copied, local, copy);
+    else
+      memcpy(local, (void*)remote + copied, copy);
+    copied += copy;
+    cursor->offset += copy;
+    if (cursor->offset == iov->iov_len) {
+      cursor->index++;
+      cursor->offset = 0;
+    }
+  }
+  return copied;
+}
+
+/**
+ * Claim what key i of msg needs before anything moves: its slot, and
+ * room in its ring for the CQ data the last key carries.
+ */
+static inline ssize_t rma_claim_key(remote_mr_cache* cache, const struct fi_msg_rma* msg,
+                                    int i, uint64_t flags) {
+  uint8_t cq_data = i == msg->rma_iov_count - 1 && (flags & FI_REMOTE_CQ_DATA);
+  ssize_t ret = cache_claim_slot(cache, cq_data);
+  if (ret) return ret;
+  return cq_data && cq_data_full(cache) ? -FI_EAGAIN : FI_SUCCESS;
+}
+
+/**
+ * Claim every key of msg before anything moves: an operation retried
+ * after -FI_EAGAIN must not report a key twice. Only an eviction from
+ * the RMA cache in the middle of msg can still make a claim fail after
+ * data went out.
+ */
+static inline ssize_t rma_claim_keys(dpa_fid_ep* ep, const struct fi_msg_rma* msg,
+                                     uint64_t flags) {
+  for (int i = 0; i < msg->rma_iov_count; i++) {
+    ssize_t ret = acquire_target(ep, msg->addr, msg->rma_iov[i].key);
+    if (ret) return ret;
+    ret = rma_claim_key(ep->last_remote_mr, msg, i, flags);
+    if (ret) return ret;
+  }
+  return FI_SUCCESS;
+}
+
+/**
+ * Walk all remote segments of msg, connecting to each key in turn,
+ * and copy data from/to the local iovecs. Writes are left unflushed
+ * unless the target wants RMA events.
+ */
+static inline ssize_t rma_transfer(dpa_fid_ep* ep, const struct fi_msg_rma* msg,
+                                   uint8_t write, uint64_t flags, size_t* copied) {
+  iov_cursor cursor = {
+    .iov = msg->msg_iov,
+    .count = msg->iov_count,
+    .index = 0,
+    .offset = 0
+  };
+  *copied = 0;
+  if (msg->rma_iov_count > 1) {
+    ssize_t ret = rma_claim_keys(ep, msg, flags);
+    if (ret) return ret;
+  }
+  for (int i = 0; i < msg->rma_iov_count; i++) {
+    const struct fi_rma_iov* rma_iov = &msg->rma_iov[i];
+    ssize_t ret = acquire_target(ep, msg->addr, rma_iov->key);
+    if (ret) return ret;
+
+    remote_mr_cache* cache = ep->last_remote_mr;
+    ret = rma_claim_key(cache, msg, i, flags);
+    if (ret) return ret;
+    uint64_t addr = rma_iov->addr + mr_key_offset(rma_iov->key);
+    if (addr > cache->len) return -FI_EINVAL;
+    size_t len = MIN(rma_iov->len, cache->len - addr);
+    int striped = rma_striped(ep, len);
+    size_t done = 0;
+    while (done < len) {
+      remote_mr_cache* stripe_cache = cache;
+      size_t stripe_end = len;
+      if (striped) {
+        size_t stripe = done / RMA_STRIPE_SIZE;
+        stripe_cache = rail_cache(ep, cache,
+                                  (cache->rail + stripe) % ep->domain->rail_count);
+        stripe_end = MIN(len, (stripe + 1) * RMA_STRIPE_SIZE);
+      }
+      size_t offset = stripe_cache->data_offset + addr + done;
+      remote_window* window = cache_window(stripe_cache, offset);
+      if (!window) return -FI_EREMOTEIO;
+      size_t chunk = MIN(stripe_end - done, window->offset + window->len - offset);
+      size_t chunk_copied = iov_copy(&cursor, window->base + (offset - window->offset),
+                                     chunk, write);
+      *copied += chunk_copied;
+      rail_account(ep->domain, stripe_cache->rail, chunk_copied);
+      if (write) window->dirty = 1;
+      if (chunk_copied < chunk) break;
+      done += chunk;
+    }
+    // events and CQ data go through the endpoint's own rail
+    ep->last_remote_mr = cache;
+
+    // one event per operation and key; CQ data reports the last one itself
+    uint8_t last = i == msg->rma_iov_count - 1;
+    if (!last && msg->rma_iov[i + 1].key == rma_iov->key) continue;
+    if (!(last && (flags & FI_REMOTE_CQ_DATA)))
+      post_rma_event(cache, write);
+  }
+  return FI_SUCCESS;
+}
+
+static inline int check_rma_msg(const struct fi_msg_rma *msg) {
+  if (!msg) return -FI_EINVAL;
+  if (!msg->rma_iov || !msg->rma_iov_count ||
+      msg->rma_iov_count > DPA_RMA_IOV_LIMIT)
+    return -FI_EINVAL;
   return FI_SUCCESS;
 }
 
@@ -163,6 +791,7 @@ ssize_t dpa_readv(struct fid_ep *ep, const struct iovec *iov, void **desc,
                   void *context){
   const struct fi_rma_iov rma_iov = {
     .addr = addr,
+    .len = iov_total_len(iov, count),
     .key = key
   };
   const struct fi_msg_rma msg = {
@@ -175,47 +804,39 @@ ssize_t dpa_readv(struct fid_ep *ep, const struct iovec *iov, void **desc,
     .context = context,
     .data = 0
   };
-  return dpa_readmsg(ep, &msg, NO_FLAGS);
+  return dpa_readmsg(ep, &msg, ep_tx_op_flags(ep));
 }
     
 ssize_t dpa_readmsg(struct fid_ep *ep, const struct fi_msg_rma *msg,
                     uint64_t flags) {
-  if (!msg) return -FI_EINVAL;
-  if (!msg->rma_iov || msg->rma_iov_count != 1) return -FI_EINVAL;
+  ssize_t ret = check_rma_msg(msg);
+  if (ret) return ret;
 
   dpa_fid_ep* ep_priv = container_of(ep, dpa_fid_ep, ep);
 
-  dpa_addr_t target;
-  ssize_t ret = acquire_target(ep_priv, msg, &target);
+  size_t total_len = iov_total_len(msg->msg_iov, msg->iov_count);
+  size_t copied;
+  ret = rma_transfer(ep_priv, msg, 0, NO_FLAGS, &copied);
   if (ret) return ret;
 
-  volatile void* base = ep_priv->last_remote_mr.base + msg->rma_iov[0].addr;
-  volatile void* top = ep_priv->last_remote_mr.base + ep_priv->last_remote_mr.len;
-  size_t copied = 0;
-  for (int i = 0; i < msg->iov_count && top - base > copied; i++) {
-    size_t copy = MIN(top - base - copied, msg->msg_iov[i].iov_len);
-    memcpy(msg->msg_iov[i].iov_base, (void*)base + copied, copy);
-    copied += copy;
-  }
-
-  if (ep_priv->read_cq) {
+  // a read truncated by the remote region is always reported, as an error
+  if (ep_priv->read_cq &&
+      (total_len != copied || ep_completes(ep_priv, FI_READ, flags))) {
     struct fi_cq_err_entry cq_entry = {
       .op_context = msg->context,
       .flags = FI_RMA | FI_READ,
       .len = copied,
       .buf = msg->iov_count == 1 ? msg->msg_iov[0].iov_base : NULL,
       .data = msg->data,
-      .err = FI_SUCCESS
+      .olen = total_len - copied,
+      .err = total_len == copied ? FI_SUCCESS : FI_ETOOSMALL
     };
     cq_add_src(ep_priv->read_cq, &cq_entry, ep_priv->connected ? 0 : msg->addr);
   }
-  if (ep_priv->read_cntr)
+  if (ep_priv->read_cntr && total_len == copied)
     dpa_cntr_inc(ep_priv->read_cntr);
-  
-
-  if (flags & FI_REMOTE_CQ_DATA) {
-    signal_interrupt(&ep_priv->last_remote_mr, msg->data);
-  }
+  else if (ep_priv->read_cntr)
+    dpa_cntr_err_inc(ep_priv->read_cntr);
   return FI_SUCCESS;
 }
 
@@ -232,6 +853,7 @@ ssize_t dpa_writev(struct fid_ep *ep, const struct iovec *iov, void **desc,
                    void *context){
   const struct fi_rma_iov rma_iov = {
     .addr = addr,
+    .len = iov_total_len(iov, count),
     .key = key
   };
   const struct fi_msg_rma msg = {
@@ -244,17 +866,19 @@ ssize_t dpa_writev(struct fid_ep *ep, const struct iovec *iov, void **desc,
     .context = context,
     .data = 0
   };
-  return dpa_writemsg(ep, &msg, NO_FLAGS);
+  return dpa_writemsg(ep, &msg, ep_tx_op_flags(ep));
 }
-ssize_t dpa_writedata(struct fid_ep *ep, const void *buf, size_t len, void *desc,
-                      uint64_t data, fi_addr_t dest_addr, uint64_t addr, uint64_t key,
-                      void *context) {
+static inline ssize_t write_single(struct fid_ep *ep, const void *buf, size_t len,
+                                   void *desc, uint64_t data, fi_addr_t dest_addr,
+                                   uint64_t addr, uint64_t key, void *context,
+                                   uint64_t flags) {
   const struct iovec iov = {
     .iov_base = (void*) buf,
     .iov_len = len
   };
   const struct fi_rma_iov rma_iov = {
     .addr = addr,
+    .len = len,
     .key = key
   };
   const struct fi_msg_rma msg = {
@@ -267,32 +891,53 @@ ssize_t dpa_writedata(struct fid_ep *ep, const void *buf, size_t len, void *desc
     .context = context,
     .data = data
   };
-  return dpa_writemsg(ep, &msg, FI_REMOTE_CQ_DATA);
+  return dpa_writemsg(ep, &msg, flags | ep_tx_op_flags(ep));
+}
+ssize_t dpa_writedata(struct fid_ep *ep, const void *buf, size_t len, void *desc,
+                      uint64_t data, fi_addr_t dest_addr, uint64_t addr, uint64_t key,
+                      void *context) {
+  return write_single(ep, buf, len, desc, data, dest_addr, addr, key, context,
+                      FI_REMOTE_CQ_DATA);
+}
+ssize_t dpa_inject_write(struct fid_ep *ep, const void *buf, size_t len,
+                         fi_addr_t dest_addr, uint64_t addr, uint64_t key) {
+  return write_single(ep, buf, len, NULL, 0, dest_addr, addr, key, NULL,
+                      FI_INJECT);
+}
+ssize_t dpa_inject_writedata(struct fid_ep *ep, const void *buf, size_t len,
+                             uint64_t data, fi_addr_t dest_addr, uint64_t addr,
+                             uint64_t key) {
+  return write_single(ep, buf, len, NULL, data, dest_addr, addr, key, NULL,
+                      FI_INJECT | FI_REMOTE_CQ_DATA);
 }
 ssize_t dpa_writemsg(struct fid_ep *ep, const struct fi_msg_rma *msg,
                      uint64_t flags) {
-  if (!msg) return -FI_EINVAL;
-  
-  if (!msg->rma_iov || msg->rma_iov_count != 1) return -FI_EINVAL;
+  ssize_t ret = check_rma_msg(msg);
+  if (ret) return ret;
+
+  size_t total_len = iov_total_len(msg->msg_iov, msg->iov_count);
+  if ((flags & FI_INJECT) && total_len > DPA_INJECT_SIZE) return -FI_EMSGSIZE;
+
   dpa_fid_ep* ep_priv = container_of(ep, dpa_fid_ep, ep);
 
-  dpa_addr_t target;
-  ssize_t ret = acquire_target(ep_priv, msg, &target);
+  size_t copied;
+  ret = rma_transfer(ep_priv, msg, 1, flags, &copied);
   if (ret) return ret;
 
-  volatile void* base = ep_priv->last_remote_mr.base + msg->rma_iov[0].addr;
-  volatile void* top = ep_priv->last_remote_mr.base + ep_priv->last_remote_mr.len;
-  size_t copied = 0;
-  for (int i = 0; i < msg->iov_count && top - base > copied; i++) {
-    size_t copy = MIN(top - base - copied, msg->msg_iov[i].iov_len);
-    memcpy((void*)base + copied, msg->msg_iov[i].iov_base, copy);
-    copied += copy;
-  }
-  size_t total_len = 0;
-  for (int i = 0; i < msg->iov_count; i++)
-    total_len += msg->msg_iov[i].iov_len;
+  if (flags & FI_REMOTE_CQ_DATA) {
+    const struct fi_rma_iov* last = &msg->rma_iov[msg->rma_iov_count - 1];
+    remote_mr_cache* cache = ep_priv->last_remote_mr;
+    // stripes may have gone through other rails
+    cache_flush_all(ep_priv);
+    uint64_t addr = last->addr + mr_key_offset(last->key);
+    ret = post_cq_data(cache, addr, MIN(last->len, cache->len - addr), msg->data);
+    if (ret) return ret;
+  } else if (!(flags & FI_MORE))
+    cache_flush_all(ep_priv);
 
-  if (ep_priv->write_cq) {
+  // data is copied synchronously, so injected writes need no completion
+  if (ep_priv->write_cq && !(flags & FI_INJECT) &&
+      (total_len != copied || ep_completes(ep_priv, FI_WRITE, flags))) {
     struct fi_cq_err_entry cq_entry = {
       .op_context = msg->context,
       .flags = FI_RMA | FI_WRITE,
@@ -304,12 +949,11 @@ ssize_t dpa_writemsg(struct fid_ep *ep, const struct fi_msg_rma *msg,
     };
     cq_add_src(ep_priv->write_cq, &cq_entry, ep_priv->connected ? 0 : msg->addr);
   }
-  if (ep_priv->write_cntr)
+  // injected writes included, a truncated write is not a success
+  if (ep_priv->write_cntr && total_len == copied)
     dpa_cntr_inc(ep_priv->write_cntr);
+  else if (ep_priv->write_cntr)
+    dpa_cntr_err_inc(ep_priv->write_cntr);
 
-  if (flags & FI_REMOTE_CQ_DATA)
-    signal_interrupt(&ep_priv->last_remote_mr, msg->data);
-  else if (!(flags & FI_MORE))
-    DPAFlush(ep_priv->last_remote_mr.sequence, DPA_FLAG_FLUSH_CPU_BUFFERS_ONLY);
   return FI_SUCCESS;
 }
@@ -34,6 +34,14 @@
 #define _DPA_RMA_H
 
 #include "dpa.h"
+#include "dpa_ep.h"
+
+void dpa_rma_init();
+void rma_cache_init(dpa_fid_ep* ep);
+void rma_cache_fini(dpa_fid_ep* ep);
+int dpa_rma_prefetch(struct fid_ep* ep, const struct fi_dpa_rma_target* targets,
+                     size_t count, uint64_t flags);
+void rma_reclaim(dpa_fid_domain* domain);
 
 ssize_t dpa_read(struct fid_ep *ep, void *buf, size_t len, void *desc,
                 fi_addr_t src_addr, uint64_t addr, uint64_t key, void *context);
@@ -52,4 +60,9 @@ ssize_t dpa_writemsg(struct fid_ep *ep, const struct fi_msg_rma *msg,
 ssize_t dpa_writedata(struct fid_ep *ep, const void *buf, size_t len, void *desc,
                      uint64_t data, fi_addr_t dest_addr, uint64_t addr, uint64_t key,
                      void *context);
+ssize_t dpa_inject_write(struct fid_ep *ep, const void *buf, size_t len,
+                         fi_addr_t dest_addr, uint64_t addr, uint64_t key);
+ssize_t dpa_inject_writedata(struct fid_ep *ep, const void *buf, size_t len,
+                             uint64_t data, fi_addr_t dest_addr, uint64_t addr,
+                             uint64_t key);
 #endif
@@ -36,6 +36,12 @@ typedef struct local_segment_info local_segment_info;
 
 #include "dpa.h"
 #include "fi_ext_dpa.h"
+#include "dpa_env.h"
+#include "dpa_numa.h"
+#include <sys/mman.h>
+
+/* 0: regular pages, 1: 2 MiB hugepages, 2: also 1 GiB hugepages */
+EXTERN_ENV_CONST(int, SEGMENT_HUGEPAGES);
 
 struct local_segment_info {
   dpa_desc_t sd;
@@ -44,6 +50,9 @@ struct local_segment_info {
   dpa_map_t map;
   volatile void* base;
   size_t size;
+  void* backing;      // hugepage memory owned by the segment, if any
+  size_t backing_len;
+  size_t page_size;   // 0 when backed by regular pages
 };
 
 typedef void (*segment_initializer)(local_segment_info* info);
@@ -52,15 +61,150 @@ static void zero_segment_initializer(local_segment_info* info) {
   memset((void*)info->base, 0, info->size);
 }
 
+#ifdef HAVE_DPA_REGISTER_SEGMENT_MEMORY
+/**
+ * Create a segment backed by existing memory, which must be page aligned.
+ * No local mapping is created: base is the user buffer itself.
+ */
+static inline dpa_error_t dpa_attach_segment(local_segment_info* info,
+                                             dpa_segmid_t segmentId,
+                                             void* buf, size_t size,
+                                             segment_initializer initializer) {
+  info->segmentId = segmentId;
+  info->size = size;
+  info->map = NULL;
+  info->segment = NULL;
+  info->base = buf;
+  info->backing = NULL;
+  info->backing_len = 0;
+  info->page_size = 0;
+  dpa_error_t error;
+  DPA_DEBUG("Opening virtual device\n");
+  DPAOpen(&info->sd, NO_FLAGS, &error);
+  DPALIB_CHECK_ERROR(DPAOpen, return error);
+
+  DPA_DEBUG("Creating empty segment %d\n", segmentId);
+  DPACreateSegment(info->sd, &info->segment, segmentId, size, NULL, NULL, DPA_FLAG_EMPTY, &error);
+  DPALIB_CHECK_ERROR(DPACreateSegment, goto attach_close);
+
+  DPA_DEBUG("Attaching user memory to segment\n");
+  DPARegisterSegmentMemory(buf, size, info->segment, NO_FLAGS, &error);
+  DPALIB_CHECK_ERROR(DPARegisterSegmentMemory, goto attach_remove);
+
+  DPA_DEBUG("Preparing segment for DMA\n");
+  for (size_t rail = 0; rail < dpaRailCount; rail++) {
+    if (!rail_first_use(rail)) continue;
+    DPAPrepareSegment(info->segment, dpaRails[rail], NO_FLAGS, &error);
+    DPALIB_CHECK_ERROR(DPAPrepareSegment, goto attach_remove);
+  }
+
+  if (initializer) {
+    DPA_DEBUG("Initializing segment\n");
+    initializer(info);
+  }
+
+  DPA_DEBUG("Making segment available for DMA\n");
+  for (size_t rail = 0; rail < dpaRailCount; rail++) {
+    if (!rail_first_use(rail)) continue;
+    DPASetSegmentAvailable(info->segment, dpaRails[rail], NO_FLAGS, &error);
+    DPALIB_CHECK_ERROR(DPASetSegmentAvailable, goto attach_remove);
+  }
+  return DPA_ERR_OK;
+
+ attach_remove:
+  {
+    dpa_error_t cleanup;
+    DPARemoveSegment(info->segment, NO_FLAGS, &cleanup);
+  }
+ attach_close:
+  {
+    dpa_error_t cleanup;
+    DPAClose(info->sd, NO_FLAGS, &cleanup);
+  }
+  return error;
+}
+
+#ifdef MAP_HUGETLB
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define HUGEPAGE_2M_SHIFT 21
+#define HUGEPAGE_1G_SHIFT 30
+
+/**
+ * Map anonymous memory on the largest allowed hugepages,
+ * 1 GiB pages are only used for segments of at least one page.
+ */
+static inline void* map_huge_pages(size_t size, int numa_node,
+                                   size_t* page_size, size_t* len) {
+  int shift = SEGMENT_HUGEPAGES > 1 ? HUGEPAGE_1G_SHIFT : HUGEPAGE_2M_SHIFT;
+  for (; shift >= HUGEPAGE_2M_SHIFT; shift -= HUGEPAGE_1G_SHIFT - HUGEPAGE_2M_SHIFT) {
+    size_t page = (size_t) 1 << shift;
+    if (shift == HUGEPAGE_1G_SHIFT && size < page) continue;
+    size_t rounded = (size + page - 1) & ~(page - 1);
+    void* mem = mmap(NULL, rounded, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT),
+                     -1, 0);
+    if (mem != MAP_FAILED) {
+      // nothing touched the pages yet, they are faulted in on numa_node
+      if (numa_node >= 0) numa_bind(mem, rounded, numa_node);
+      *page_size = page;
+      *len = rounded;
+      return mem;
+    }
+  }
+  return NULL;
+}
+
+static inline dpa_error_t alloc_huge_segment(local_segment_info* info,
+                                             dpa_segmid_t segmentId, size_t size,
+                                             segment_initializer initializer,
+                                             int numa_node) {
+  size_t page_size, len;
+  void* mem = map_huge_pages(size, numa_node, &page_size, &len);
+  if (!mem) return DPA_ERR_NOSPC;
+  /* the segment spans whole pages, only size bytes are handed out;
+   * the initializer runs before peers can map it */
+  dpa_error_t error = dpa_attach_segment(info, segmentId, mem, len, initializer);
+  if (error != DPA_ERR_OK) {
+    munmap(mem, len);
+    return error;
+  }
+  info->size = size;
+  info->backing = mem;
+  info->backing_len = len;
+  info->page_size = page_size;
+  return DPA_ERR_OK;
+}
+#endif
+#endif
+
 static inline dpa_error_t dpa_alloc_segment(local_segment_info* info,
                                             dpa_segmid_t segmentId,
                                             size_t size,
                                             segment_initializer initializer,
                                             dpa_cb_local_segment_t segmentCallback,
-                                            void* callbackArg){
+                                            void* callbackArg,
+                                            int numa_node){
   info->segmentId = segmentId;
   info->size = size;
+  info->backing = NULL;
+  info->backing_len = 0;
+  info->page_size = 0;
   dpa_error_t error;
+#if defined(HAVE_DPA_REGISTER_SEGMENT_MEMORY) && defined(MAP_HUGETLB)
+  // hugepage segments are attached memory, they cannot report callbacks
+  if (SEGMENT_HUGEPAGES && !segmentCallback) {
+    error = alloc_huge_segment(info, segmentId, size, initializer, numa_node);
+    if (error == DPA_ERR_OK) {
+      DPA_INFO("Segment %u: %zu bytes on %zu kB pages\n",
+               segmentId, size, info->page_size >> 10);
+      return error;
+    }
+    if (error == DPA_ERR_SEGMENTID_USED) return error;
+    DPA_INFO("Segment %u: no hugepages available, using regular pages\n", segmentId);
+  }
+#endif
   DPA_DEBUG("Opening virtual device\n");
   DPAOpen(&info->sd, NO_FLAGS, &error);
   DPALIB_CHECK_ERROR(DPAOpen, goto alloc_end);
@@ -70,35 +214,72 @@ static inline dpa_error_t dpa_alloc_segment(local_segment_info* info,
   DPACreateSegment(info->sd, &info->segment, segmentId, size, segmentCallback, callbackArg, flags, &error);
   DPALIB_CHECK_ERROR(DPACreateSegment, goto alloc_end);
 
+  // local segments are reachable through every rail
   DPA_DEBUG("Preparing segment for DMA\n");
-  DPAPrepareSegment(info->segment, localAdapterNo, NO_FLAGS, &error);
-  DPALIB_CHECK_ERROR(DPAPrepareSegment, goto alloc_end);
+  for (size_t rail = 0; rail < dpaRailCount; rail++) {
+    if (!rail_first_use(rail)) continue;
+    DPAPrepareSegment(info->segment, dpaRails[rail], NO_FLAGS, &error);
+    DPALIB_CHECK_ERROR(DPAPrepareSegment, goto alloc_end);
+  }
 
   DPA_DEBUG("Mapping segment\n");  
   info->base = DPAMapLocalSegment(info->segment, &info->map, 0, size, NULL, NO_FLAGS, &error);
   DPALIB_CHECK_ERROR(DPAMapLocalSegment, goto alloc_end);
 
+  // adapter memory may already be placed, so this is only a preference
+  if (numa_node >= 0) {
+    if (numa_bind((void*) info->base, size, numa_node) == FI_SUCCESS)
+      DPA_INFO("Segment %u placed on NUMA node %d\n", segmentId, numa_node);
+    else
+      DPA_INFO("Segment %u cannot be moved to NUMA node %d\n", segmentId, numa_node);
+  }
+
   if (initializer) {
     DPA_DEBUG("Initializing segment\n");
     initializer(info);
   }
 
   DPA_DEBUG("Making segment available for DMA\n");
-  DPASetSegmentAvailable(info->segment, localAdapterNo, NO_FLAGS, &error);
-  DPALIB_CHECK_ERROR(DPASetSegmentAvailable, goto alloc_end);
+  for (size_t rail = 0; rail < dpaRailCount; rail++) {
+    if (!rail_first_use(rail)) continue;
+    DPASetSegmentAvailable(info->segment, dpaRails[rail], NO_FLAGS, &error);
+    DPALIB_CHECK_ERROR(DPASetSegmentAvailable, goto alloc_end);
+  }
  alloc_end:
   return error;
 }
 
+// let remote nodes connect to the segment, or stop new connections to it
+static inline dpa_error_t dpa_set_segment_available(const local_segment_info* info,
+                                                    int available) {
+  dpa_error_t error = DPA_ERR_OK;
+  for (size_t rail = 0; rail < dpaRailCount; rail++) {
+    if (!rail_first_use(rail)) continue;
+    if (available) {
+      DPASetSegmentAvailable(info->segment, dpaRails[rail], NO_FLAGS, &error);
+      DPALIB_CHECK_ERROR(DPASetSegmentAvailable, return error);
+    } else {
+      DPASetSegmentUnavailable(info->segment, dpaRails[rail], NO_FLAGS, &error);
+      DPALIB_CHECK_ERROR(DPASetSegmentUnavailable, return error);
+    }
+  }
+  return error;
+}
+
 static inline dpa_error_t dpa_destroy_segment(local_segment_info info) {
   dpa_error_t error;
   DPA_DEBUG("Making segment unavailable\n");
-  DPASetSegmentUnavailable(info.segment, localAdapterNo, NO_FLAGS, &error);
-  DPALIB_CHECK_ERROR(DPASetSegmentUnavailable,);
+  for (size_t rail = 0; rail < dpaRailCount; rail++) {
+    if (!rail_first_use(rail)) continue;
+    DPASetSegmentUnavailable(info.segment, dpaRails[rail], NO_FLAGS, &error);
+    DPALIB_CHECK_ERROR(DPASetSegmentUnavailable,);
+  }
 
-  DPA_DEBUG("Unmapping segment\n");
-  DPAUnmapSegment(info.map, NO_FLAGS, &error);
-  DPALIB_CHECK_ERROR(DPAUnmapSegment,);
+  if (info.map) {
+    DPA_DEBUG("Unmapping segment\n");
+    DPAUnmapSegment(info.map, NO_FLAGS, &error);
+    DPALIB_CHECK_ERROR(DPAUnmapSegment,);
+  }
 
   DPA_DEBUG("Removing segment\n");
   DPARemoveSegment(info.segment, NO_FLAGS, &error);
@@ -107,6 +288,11 @@ static inline dpa_error_t dpa_destroy_segment(local_segment_info info) {
   DPA_DEBUG("Closing descriptor\n");
   DPAClose(info.sd, NO_FLAGS, &error);
   DPALIB_CHECK_ERROR(DPAClose,);
+
+  if (info.backing) {
+    DPA_DEBUG("Releasing hugepages\n");
+    munmap(info.backing, info.backing_len);
+  }
   
   return error;
 }
@@ -47,4 +47,6 @@ static inline void *memdup(const void *src, size_t sz) {
 #define MIN(a,b) ((a)<(b) ? (a) : (b))
 #define MAX(a,b) ((a)>(b) ? (a) : (b))
 
+#define DPA_CACHE_LINE 64
+
 #endif
@@ -0,0 +1,334 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#define LOG_SUBSYS FI_LOG_CORE
+
+#include "dpa.h"
+#include "dpa_wait.h"
+#include "dpa_cq.h"
+#include "dpa_cntr.h"
+#include <poll.h>
+#include <time.h>
+
+// longest block while some member needs application driven progress
+#ifndef WAIT_PROGRESS_SLICE
+#define WAIT_PROGRESS_SLICE 1
+#endif
+
+static int dpa_poll_close(struct fid* fid);
+static int dpa_poll_poll(struct fid_poll* pollset, void** context, int count);
+static int dpa_poll_add(struct fid_poll* pollset, struct fid* event_fid, uint64_t flags);
+static int dpa_poll_del(struct fid_poll* pollset, struct fid* event_fid, uint64_t flags);
+
+static struct fi_ops dpa_fid_poll_ops = {
+  .size = sizeof(struct fi_ops),
+  .close = dpa_poll_close,
+  .bind = fi_no_bind,
+  .control = fi_no_control,
+  .ops_open = fi_no_ops_open
+};
+
+static struct fi_ops_poll dpa_poll_ops = {
+  .size = sizeof(struct fi_ops_poll),
+  .poll = dpa_poll_poll,
+  .poll_add = dpa_poll_add,
+  .poll_del = dpa_poll_del
+};
+
+static int dpa_wait_close(struct fid* fid);
+static int dpa_wait_control(struct fid* fid, int command, void* arg);
+static int dpa_wait_wait(struct fid_wait* waitset, int timeout);
+
+static struct fi_ops dpa_fid_wait_ops = {
+  .size = sizeof(struct fi_ops),
+  .close = dpa_wait_close,
+  .bind = fi_no_bind,
+  .control = dpa_wait_control,
+  .ops_open = fi_no_ops_open
+};
+
+static struct fi_ops_wait dpa_wait_ops = {
+  .size = sizeof(struct fi_ops_wait),
+  .wait = dpa_wait_wait
+};
+
+static void poll_set_init(dpa_fid_poll* set) {
+  fastlock_init(&set->lock);
+  set->members = NULL;
+  set->count = set->capacity = 0;
+}
+
+static void poll_set_destroy(dpa_fid_poll* set) {
+  free(set->members);
+  fastlock_destroy(&set->lock);
+}
+
+static int poll_set_add(dpa_fid_poll* set, struct fid* fid) {
+  if (fid->fclass != FI_CLASS_CQ && fid->fclass != FI_CLASS_CNTR)
+    return -FI_EINVAL;
+  int ret = FI_SUCCESS;
+  fastlock_acquire(&set->lock);
+  if (set->count == set->capacity) {
+    size_t capacity = set->capacity ? 2 * set->capacity : 8;
+    poll_member* members = realloc(set->members, capacity * sizeof(poll_member));
+    if (!members) {
+      ret = -FI_ENOMEM;
+      goto add_end;
+    }
+    set->members = members;
+    set->capacity = capacity;
+  }
+  set->members[set->count++] = (poll_member) {
+    .fid = fid,
+    .seen = 0
+  };
+ add_end:
+  fastlock_release(&set->lock);
+  return ret;
+}
+
+static int poll_set_del(dpa_fid_poll* set, struct fid* fid) {
+  int ret = -FI_EINVAL;
+  fastlock_acquire(&set->lock);
+  for (size_t i = 0; i < set->count; i++)
+    if (set->members[i].fid == fid) {
+      set->members[i] = set->members[--set->count];
+      ret = FI_SUCCESS;
+      break;
+    }
+  fastlock_release(&set->lock);
+  return ret;
+}
+
+/**
+ * Progress a member once, reporting whether it has something to read.
+ * A counter stays ready until its change is consumed by a caller that
+ * was handed the member's context.
+ */
+static inline int member_ready(poll_member* member, int consume) {
+  if (member->fid->fclass == FI_CLASS_CQ)
+    return cq_ready(container_of(member->fid, dpa_fid_cq, cq.fid));
+
+  struct fid_cntr* cntr = container_of(member->fid, struct fid_cntr, fid);
+  uint64_t events = cntr->ops->read(cntr) + cntr->ops->readerr(cntr);
+  if (events == member->seen) return 0;
+  if (consume) member->seen = events;
+  return 1;
+}
+
+static int poll_set_poll(dpa_fid_poll* set, void** context, int count, int consume) {
+  int ready = 0;
+  fastlock_acquire(&set->lock);
+  // every member is progressed, even when fewer contexts fit
+  for (size_t i = 0; i < set->count; i++)
+    if (member_ready(&set->members[i], consume && ready < count) && ready < count)
+      context[ready++] = set->members[i].fid->context;
+  fastlock_release(&set->lock);
+  return ready;
+}
+
+static int poll_set_manual(dpa_fid_poll* set) {
+  int manual = 0;
+  fastlock_acquire(&set->lock);
+  for (size_t i = 0; i < set->count && !manual; i++) {
+    struct fid* fid = set->members[i].fid;
+    if (fid->fclass == FI_CLASS_CQ)
+      manual = queue_progress_bound(&container_of(fid, dpa_fid_cq, cq.fid)->progress);
+    else
+      manual = queue_progress_bound(&container_of(fid, dpa_fid_cntr, cntr.fid)->progress);
+  }
+  fastlock_release(&set->lock);
+  return manual;
+}
+
+int dpa_poll_open(struct fid_domain* domain, struct fi_poll_attr* attr,
+                  struct fid_poll** pollset) {
+  if (attr && attr->flags) return -FI_EINVAL;
+  DPA_DEBUG("Building poll set\n");
+  dpa_fid_poll* poll_priv = ALLOC_INIT(dpa_fid_poll, {
+      .poll = {
+        .fid = {
+          .fclass = FI_CLASS_POLL,
+          .context = NULL,
+          .ops = &dpa_fid_poll_ops,
+        },
+        .ops = &dpa_poll_ops
+      },
+    });
+  if (!poll_priv) return -FI_ENOMEM;
+  poll_set_init(poll_priv);
+  *pollset = &poll_priv->poll;
+  return FI_SUCCESS;
+}
+
+static int dpa_poll_close(struct fid* fid) {
+  DPA_DEBUG("Closing poll set\n");
+  dpa_fid_poll* poll_priv = container_of(fid, dpa_fid_poll, poll.fid);
+  poll_set_destroy(poll_priv);
+  free(poll_priv);
+  return FI_SUCCESS;
+}
+
+static int dpa_poll_poll(struct fid_poll* pollset, void** context, int count) {
+  return poll_set_poll(container_of(pollset, dpa_fid_poll, poll), context, count, 1);
+}
+
+static int dpa_poll_add(struct fid_poll* pollset, struct fid* event_fid, uint64_t flags) {
+  return poll_set_add(container_of(pollset, dpa_fid_poll, poll), event_fid);
+}
+
+static int dpa_poll_del(struct fid_poll* pollset, struct fid* event_fid, uint64_t flags) {
+  return poll_set_del(container_of(pollset, dpa_fid_poll, poll), event_fid);
+}
+
+int dpa_wait_open(struct fid_fabric* fabric, struct fi_wait_attr* attr,
+                  struct fid_wait** waitset) {
+  if (!attr || attr->flags) return -FI_EINVAL;
+  switch (attr->wait_obj) {
+  case FI_WAIT_UNSPEC:
+  case FI_WAIT_FD:
+    break;
+  default:
+    VERIFY_FAIL(attr->wait_obj, FI_WAIT_FD);
+  }
+
+  DPA_DEBUG("Building wait set\n");
+  dpa_fid_wait* wait_priv = ALLOC_INIT(dpa_fid_wait, {
+      .wait = {
+        .fid = {
+          .fclass = FI_CLASS_WAIT,
+          .context = NULL,
+          .ops = &dpa_fid_wait_ops,
+        },
+        .ops = &dpa_wait_ops
+      },
+      .wait_obj = attr->wait_obj,
+    });
+  if (!wait_priv) return -FI_ENOMEM;
+  // blocking always goes through the fd, whatever the wait object
+  wait_fd_init(&wait_priv->wait_fd);
+  if (wait_fd_open(&wait_priv->wait_fd)) {
+    DPA_WARN("Cannot create wait set fd\n");
+    free(wait_priv);
+    return -FI_ENOSYS;
+  }
+  poll_set_init(&wait_priv->set);
+  *waitset = &wait_priv->wait;
+  return FI_SUCCESS;
+}
+
+static int dpa_wait_close(struct fid* fid) {
+  DPA_DEBUG("Closing wait set\n");
+  dpa_fid_wait* wait_priv = container_of(fid, dpa_fid_wait, wait.fid);
+  if (wait_priv->set.count) return -FI_EBUSY;
+  poll_set_destroy(&wait_priv->set);
+  wait_fd_close(&wait_priv->wait_fd);
+  free(wait_priv);
+  return FI_SUCCESS;
+}
+
+static int dpa_wait_control(struct fid* fid, int command, void* arg) {
+  dpa_fid_wait* wait_priv = container_of(fid, dpa_fid_wait, wait.fid);
+  switch (command) {
+  case FI_GETWAIT:
+    if (wait_priv->wait_obj != FI_WAIT_FD) return -FI_ENOSYS;
+    return wait_fd_get(&wait_priv->wait_fd, arg);
+  default:
+    return -FI_ENOSYS;
+  }
+}
+
+static inline int elapsed_millis(struct timespec* since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1000 +
+    (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static int dpa_wait_wait(struct fid_wait* waitset, int timeout) {
+  dpa_fid_wait* wait_priv = container_of(waitset, dpa_fid_wait, wait);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int manual = poll_set_manual(&wait_priv->set);
+  void* context;
+  for (;;) {
+    // armed before checking, so that nothing added afterwards is missed
+    wait_fd_arm(&wait_priv->wait_fd);
+    // returning is what tells the application, so that member is consumed
+    if (poll_set_poll(&wait_priv->set, &context, 1, 1)) return FI_SUCCESS;
+
+    int remaining = timeout < 0 ? -1 : timeout - elapsed_millis(&start);
+    if (timeout >= 0 && remaining <= 0) return -FI_ETIMEDOUT;
+    if (manual)
+      remaining = remaining < 0 ? WAIT_PROGRESS_SLICE : MIN(remaining, WAIT_PROGRESS_SLICE);
+    struct pollfd fd = {
+      .fd = wait_priv->wait_fd.fd,
+      .events = POLLIN
+    };
+    poll(&fd, 1, remaining);
+  }
+}
+
+int wait_set_add(struct fid_wait* waitset, struct fid* fid, dpa_fid_wait** wait) {
+  if (!waitset) return -FI_EINVAL;
+  dpa_fid_wait* wait_priv = container_of(waitset, dpa_fid_wait, wait);
+  int ret = poll_set_add(&wait_priv->set, fid);
+  if (!ret) *wait = wait_priv;
+  return ret;
+}
+
+// whether every member is progressed while the application sleeps
+static int poll_set_async(dpa_fid_poll* set) {
+  int async = 1;
+  fastlock_acquire(&set->lock);
+  for (size_t i = 0; i < set->count && async; i++) {
+    struct fid* fid = set->members[i].fid;
+    async = domain_async_progress(fid->fclass == FI_CLASS_CQ
+                                  ? container_of(fid, dpa_fid_cq, cq.fid)->domain
+                                  : container_of(fid, dpa_fid_cntr, cntr.fid)->domain);
+  }
+  fastlock_release(&set->lock);
+  return async;
+}
+
+int wait_set_trywait(dpa_fid_wait* wait) {
+  void* context;
+  // nothing would signal the fd for members progressed by polling only
+  if (!poll_set_async(&wait->set)) return -FI_EAGAIN;
+  wait_fd_arm(&wait->wait_fd);
+  // only a peek, the application still has to wait or read
+  return poll_set_poll(&wait->set, &context, 1, 0) ? -FI_EAGAIN : FI_SUCCESS;
+}
+
+void wait_set_del(dpa_fid_wait* wait, struct fid* fid) {
+  if (wait) poll_set_del(&wait->set, fid);
+}
@@ -0,0 +1,76 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+typedef struct dpa_fid_poll dpa_fid_poll;
+typedef struct dpa_fid_wait dpa_fid_wait;
+
+#ifndef DPA_WAIT_H
+#define DPA_WAIT_H
+#include "dpa.h"
+#include "dpa_eq.h"
+
+typedef struct poll_member {
+  struct fid* fid;
+  // counters: value reported by the last poll
+  uint64_t seen;
+} poll_member;
+
+struct dpa_fid_poll {
+  struct fid_poll poll;
+  fastlock_t lock;
+  poll_member* members;
+  size_t count;
+  size_t capacity;
+};
+
+/* A wait set is a poll set over its members plus an eventfd
+ * that any member signals when it gets new entries. */
+struct dpa_fid_wait {
+  struct fid_wait wait;
+  enum fi_wait_obj wait_obj;
+  dpa_fid_poll set;
+  queue_wait_fd wait_fd;
+};
+
+int dpa_poll_open(struct fid_domain* domain, struct fi_poll_attr* attr,
+                  struct fid_poll** pollset);
+int dpa_wait_open(struct fid_fabric* fabric, struct fi_wait_attr* attr,
+                  struct fid_wait** waitset);
+int wait_set_add(struct fid_wait* waitset, struct fid* fid, dpa_fid_wait** wait);
+void wait_set_del(dpa_fid_wait* wait, struct fid* fid);
+int wait_set_trywait(dpa_fid_wait* wait);
+
+static inline void wait_set_signal(dpa_fid_wait* wait) {
+  if (wait) wait_fd_signal(&wait->wait_fd);
+}
+
+#endif
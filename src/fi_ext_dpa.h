@@ -49,11 +49,53 @@ struct dpa_addr_t {
   dpa_intid_t connectId;
 };
 
+/* fi_mr_reg flag: ignore requested_key and let the provider pick a free key,
+ * read it back with fi_mr_key */
+#define FI_DPA_MR_PROV_KEY (1ULL << 60)
+
+#define FI_DPA_DOMAIN_OPS_OPEN "FI_DPA_DOMAIN_OPS_OPEN"
+
+/* NUMA policy values: a node number or one of these */
+#define FI_DPA_NUMA_ANY (-1)   /* leave placement to the kernel */
+#define FI_DPA_NUMA_LOCAL (-2) /* node of the thread opening the object */
+
+struct fi_dpa_numa_policy {
+  int ring_node;  /* message rings and MR segments, best near the adapter */
+  int queue_node; /* completion and message queue storage */
+};
+
+struct fi_dpa_ops_domain {
+  size_t size;
+  /* applies to objects opened or rings created afterwards */
+  int (*set_numa_policy)(struct fid_domain* domain,
+                         const struct fi_dpa_numa_policy* policy);
+  int (*get_numa_policy)(struct fid_domain* domain,
+                         struct fi_dpa_numa_policy* policy);
+};
+
 #define FI_DPA_CQ_OPS_OPEN "FI_DPA_CQ_OPS_OPEN"
 
+/* fi_cq_attr flag: a single thread adds completions and a single one reads them */
+#define FI_DPA_CQ_SPSC (1ULL << 61)
+
 struct fi_dpa_ops_cq {
   size_t size;
   int (*wait_data)(struct fid_cq* cq, uint64_t* data, uint64_t flags);
 };
 
+#define FI_DPA_EP_OPS_OPEN "FI_DPA_EP_OPS_OPEN"
+
+struct fi_dpa_rma_target {
+  fi_addr_t addr;
+  uint64_t key;
+};
+
+struct fi_dpa_ops_ep {
+  size_t size;
+  /* connect and map the given remote keys ahead of time, so that the
+   * first RMA operation to each of them finds a warm cache */
+  int (*rma_prefetch)(struct fid_ep* ep, const struct fi_dpa_rma_target* targets,
+                      size_t count, uint64_t flags);
+};
+
 #endif
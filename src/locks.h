@@ -41,6 +41,8 @@
 #include <string.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <errno.h>
+#include <time.h>
 
 
 #ifdef HAVE_ATOMICS
@@ -51,6 +53,36 @@
 extern "C" {
 #endif
 
+  /* Tell the CPU we are busy waiting, so it can back off and let a
+   * sibling hyperthread run. */
+  static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+  }
+
+  static inline int64_t clock_usec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+  }
+
+  // milliseconds to microseconds, negative timeouts meaning forever
+  static inline int64_t deadline_usec(int timeout) {
+    return timeout < 0 ? INT64_MAX : clock_usec() + timeout * 1000LL;
+  }
+
+  // milliseconds left, rounded up so that waits never end early
+  static inline int remaining_msec(int64_t deadline) {
+    if (deadline == INT64_MAX) return -1;
+    int64_t left = deadline - clock_usec();
+    return left > 0 ? (int) ((left + 999) / 1000) : 0;
+  }
+
 #if PT_LOCK_SPIN == 1
 
   typedef struct spinlock_cond {
@@ -66,13 +98,25 @@ extern "C" {
 #define fastlock_acquire_(lock) pthread_spin_lock(lock)
 #define fastlock_release_(lock) pthread_spin_unlock(lock)
 
-  static inline int spin_wait(fastlock_cond_t_* cond, pthread_spinlock_t* lock) {
+  static inline int spin_wait_timeout(fastlock_cond_t_* cond, pthread_spinlock_t* lock,
+                                      int timeout) {
+    int64_t deadline = deadline_usec(timeout);
     uint64_t wait = cond->locked;
     cond->locked++;
     fastlock_release_(lock);
-    while (cond->released <= wait);
+    int result = 0;
+    for (unsigned i = 1; __atomic_load_n(&cond->released, __ATOMIC_ACQUIRE) <= wait; i++) {
+      cpu_relax();
+      if (i % 64 == 0 && deadline != INT64_MAX && clock_usec() >= deadline) {
+        result = ETIMEDOUT;
+        break;
+      }
+    }
     fastlock_acquire_(lock);
-    return 0;
+    return result;
+  }
+  static inline int spin_wait(fastlock_cond_t_* cond, pthread_spinlock_t* lock) {
+    return spin_wait_timeout(cond, lock, -1);
   }
   static inline int spin_signal(fastlock_cond_t_* cond) {
     fastlock_acquire_(&cond->lock);
@@ -89,13 +133,38 @@ extern "C" {
   }
     
 #define fastlock_cond_init_(cond) do { (cond)->locked = (cond)->released = 0; fastlock_init_(&(cond)->lock); } while (0)
-#define fastlock_cond_destroy_(cond) slist_destroy(cond, cond_entry, list_entry, NULL)
+#define fastlock_cond_destroy_(cond) fastlock_destroy_(&(cond)->lock)
 #define fastlock_wait_(cond, lock) spin_wait(cond, lock)
+#define fastlock_wait_timeout_(cond, lock, timeout) spin_wait_timeout(cond, lock, timeout)
 #define fastlock_signal_(cond) spin_signal(cond)
 #define fastlock_signal_all_(cond) spin_signal_all(cond)
 
 #else
 
+  // deadlines are computed on the monotonic clock, so the condition must use it
+  static inline int cond_init(pthread_cond_t* cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int result = pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return result;
+  }
+
+  static inline int cond_wait_timeout(pthread_cond_t* cond, pthread_mutex_t* lock,
+                                      int timeout) {
+    if (timeout < 0) return pthread_cond_wait(cond, lock);
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    return pthread_cond_timedwait(cond, lock, &deadline);
+  }
+
 #define fastlock_t_ pthread_mutex_t
 #define fastlock_cond_t_ pthread_cond_t
 #define fastlock_init_(lock) pthread_mutex_init(lock, NULL)
@@ -103,9 +172,10 @@ extern "C" {
 #define fastlock_acquire_(lock) pthread_mutex_lock(lock)
 #define fastlock_release_(lock) pthread_mutex_unlock(lock)
 
-#define fastlock_cond_init_(cond) pthread_cond_init(cond, NULL)
+#define fastlock_cond_init_(cond) cond_init(cond)
 #define fastlock_cond_destroy_(cond) pthread_cond_destroy(cond)
 #define fastlock_wait_(cond, lock) pthread_cond_wait(cond, lock)
+#define fastlock_wait_timeout_(cond, lock, timeout) cond_wait_timeout(cond, lock, timeout)
 #define fastlock_signal_(cond) pthread_cond_signal(cond)
 #define fastlock_signal_all_(cond) pthread_cond_broadcast(cond)
 
@@ -121,10 +191,38 @@ extern "C" {
 #define fastlock_cond_init(cond) fastlock_cond_init_(cond)
 #define fastlock_cond_destroy(cond) fastlock_cond_destroy_(cond)
 #define fastlock_wait(cond, lock) fastlock_wait_(cond, lock)
-#define fastlock_wait_timeout(cond, lock, timeout) fastlock_wait_(cond, lock)
+#define fastlock_wait_timeout(cond, lock, timeout) fastlock_wait_timeout_(cond, lock, timeout)
 #define fastlock_signal(cond) fastlock_signal_(cond)
 #define fastlock_signal_all(cond) fastlock_signal_all_(cond)
 
+  /**
+   * Spin phase of a hybrid wait: poll ready(arg) for at most spin_usec
+   * microseconds, and never beyond *timeout milliseconds (negative means
+   * forever). Returns nonzero as soon as ready holds; otherwise takes the
+   * time spent off *timeout, so that the blocking phase that follows
+   * still honours the caller's deadline.
+   */
+  static inline int fastlock_spin(int (*ready)(void*), void* arg, long spin_usec,
+                                  int* timeout) {
+    if (ready(arg)) return 1;
+    if (!*timeout || spin_usec <= 0) return 0;
+    int64_t start = clock_usec();
+    int64_t budget = *timeout < 0 || spin_usec < *timeout * 1000LL
+      ? spin_usec : *timeout * 1000LL;
+    int64_t elapsed = 0;
+    // reading the clock costs far more than a pause, so only do it now and then
+    for (unsigned i = 1; elapsed < budget; i++) {
+      cpu_relax();
+      if (ready(arg)) return 1;
+      if (i % 16 == 0) elapsed = clock_usec() - start;
+    }
+    if (*timeout > 0) {
+      int spent = (int) (elapsed / 1000);
+      *timeout = spent < *timeout ? *timeout - spent : 0;
+    }
+    return 0;
+  }
+
 #if ENABLE_DEBUG
 #define ATOMIC_IS_INITIALIZED(atomic) assert(atomic->is_initialized)
 #else
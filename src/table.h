@@ -0,0 +1,261 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#ifndef _TABLE_H
+#define _TABLE_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+
+#include "locks.h"
+
+/* Open addressing table from integer keys to object pointers.
+ * Lookups take no lock: writers serialize on the table lock, publish
+ * slots with release stores and retire grown arrays only once no
+ * reader is still walking them. A slot key, once written, never
+ * changes until the array is rebuilt, so a reader can never see the
+ * value of another key in the slot it matched: removal only clears
+ * the value, leaving a tombstone that rebuilds drop.
+ *
+ * Readers register on the counter of the current epoch parity in their
+ * stripe. A grace period flips the epoch and waits for the counters of
+ * the previous parity only, so readers arriving meanwhile never hold
+ * it back: it waits for readers that entered before the flip. */
+
+#define TABLE_EMPTY_KEY UINT64_MAX
+#define TABLE_MIN_SIZE 16
+#define TABLE_READER_STRIPES 16
+
+typedef struct table_slot {
+  uint64_t key;
+  void* value;
+} table_slot;
+
+typedef struct table_array {
+  size_t mask;
+  size_t used; // live entries and tombstones
+  table_slot slots[0];
+} table_array;
+
+// the counter a reader registered on, to be released by table_read_unlock
+typedef size_t table_readers;
+
+typedef struct table_stripe {
+  table_readers count[2];
+  char pad[64 - 2 * sizeof(table_readers)];
+} table_stripe;
+
+typedef struct table {
+  table_array* array;
+  size_t live;
+  fastlock_t lock;
+  // serializes grace periods, so epochs only advance one at a time
+  fastlock_t sync_lock;
+  size_t epoch;
+  table_stripe stripes[TABLE_READER_STRIPES];
+} table;
+
+static inline size_t table_hash(uint64_t key) {
+  // fibonacci hashing spreads sequential ids over the whole array
+  return (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static inline table_array* table_array_create(size_t size) {
+  size_t capacity = TABLE_MIN_SIZE;
+  while (capacity < size) capacity <<= 1;
+  table_array* array = malloc(sizeof(table_array) + capacity * sizeof(table_slot));
+  if (!array) return NULL;
+  array->mask = capacity - 1;
+  array->used = 0;
+  for (size_t i = 0; i < capacity; i++) {
+    array->slots[i].key = TABLE_EMPTY_KEY;
+    array->slots[i].value = NULL;
+  }
+  return array;
+}
+
+static inline table* table_create(size_t size) {
+  table* t = calloc(1, sizeof(table));
+  if (!t) return NULL;
+  t->array = table_array_create(size);
+  if (!t->array) {
+    free(t);
+    return NULL;
+  }
+  fastlock_init(&t->lock);
+  fastlock_init(&t->sync_lock);
+  return t;
+}
+
+static inline void table_destroy(table* t) {
+  free(t->array);
+  fastlock_destroy(&t->lock);
+  fastlock_destroy(&t->sync_lock);
+  free(t);
+}
+
+/**
+ * A reader that loaded the epoch just before a flip may register on
+ * the previous parity after the grace period stopped looking at it.
+ * It then registered after everything the writer retired was
+ * unpublished, so it cannot reach it.
+ */
+static inline table_readers* table_read_lock(table* t) {
+  size_t stripe = (((uintptr_t) pthread_self()) * 0x9E3779B97F4A7C15ULL) >> 60;
+  size_t parity = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST) & 1;
+  table_readers* readers = &t->stripes[stripe % TABLE_READER_STRIPES].count[parity];
+  __atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+  return readers;
+}
+
+static inline void table_read_unlock(table_readers* readers) {
+  __atomic_sub_fetch(readers, 1, __ATOMIC_RELEASE);
+}
+
+static inline void table_wait_readers(table* t, size_t parity) {
+  for (int i = 0; i < TABLE_READER_STRIPES; i++)
+    while (__atomic_load_n(&t->stripes[i].count[parity], __ATOMIC_SEQ_CST))
+      sched_yield();
+}
+
+/**
+ * Wait until every reader that could have seen something unpublished
+ * before the call is gone. Late readers of the previous epoch are
+ * drained first: they may have registered on the parity that is about
+ * to become the old one before this writer unpublished anything.
+ */
+static inline void table_synchronize(table* t) {
+  fastlock_acquire(&t->sync_lock);
+  size_t epoch = t->epoch;
+  table_wait_readers(t, (epoch + 1) & 1);
+  __atomic_store_n(&t->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+  table_wait_readers(t, epoch & 1);
+  fastlock_release(&t->sync_lock);
+}
+
+// reader side, read lock held
+static inline void* table_lookup(table* t, uint64_t key) {
+  table_array* array = __atomic_load_n(&t->array, __ATOMIC_SEQ_CST);
+  for (size_t i = table_hash(key) & array->mask; ; i = (i + 1) & array->mask) {
+    uint64_t slot_key = __atomic_load_n(&array->slots[i].key, __ATOMIC_ACQUIRE);
+    if (slot_key == key)
+      return __atomic_load_n(&array->slots[i].value, __ATOMIC_ACQUIRE);
+    if (slot_key == TABLE_EMPTY_KEY)
+      return NULL;
+  }
+}
+
+static inline void* table_get(table* t, uint64_t key) {
+  table_readers* readers = table_read_lock(t);
+  void* value = table_lookup(t, key);
+  table_read_unlock(readers);
+  return value;
+}
+
+/**
+ * Look key up and keep holding the read side: a value its owner frees
+ * only after table_remove and table_synchronize stays valid until
+ * table_read_unlock(*readers).
+ */
+static inline void* table_get_held(table* t, uint64_t key, table_readers** readers) {
+  *readers = table_read_lock(t);
+  return table_lookup(t, key);
+}
+
+// writer side, table lock held
+static inline table_slot* table_find_slot(table_array* array, uint64_t key) {
+  for (size_t i = table_hash(key) & array->mask; ; i = (i + 1) & array->mask) {
+    table_slot* slot = &array->slots[i];
+    if (slot->key == key || slot->key == TABLE_EMPTY_KEY)
+      return slot;
+  }
+}
+
+// writer side, table lock held
+static inline int table_rebuild(table* t, size_t size) {
+  table_array* old = t->array;
+  table_array* array = table_array_create(size);
+  if (!array) return -1;
+  for (size_t i = 0; i <= old->mask; i++) {
+    table_slot* slot = &old->slots[i];
+    if (slot->key == TABLE_EMPTY_KEY || !slot->value) continue;
+    table_slot* target = table_find_slot(array, slot->key);
+    *target = *slot;
+    array->used++;
+  }
+  __atomic_store_n(&t->array, array, __ATOMIC_SEQ_CST);
+  table_synchronize(t);
+  free(old);
+  return 0;
+}
+
+/**
+ * Insert or replace the value of key, a NULL value removes it.
+ * Returns -1 if the table could not grow.
+ */
+static inline int table_put(table* t, uint64_t key, void* value) {
+  if (key == TABLE_EMPTY_KEY) return -1;
+  int ret = 0;
+  fastlock_acquire(&t->lock);
+  table_slot* slot = table_find_slot(t->array, key);
+  if (slot->key == TABLE_EMPTY_KEY) {
+    if (!value) goto put_end;
+    // keep at most half of the slots used, so probe sequences stay short
+    if (2 * (t->array->used + 1) > t->array->mask + 1) {
+      if (table_rebuild(t, 4 * (t->live + 1))) {
+        ret = -1;
+        goto put_end;
+      }
+      slot = table_find_slot(t->array, key);
+    }
+    slot->value = value;
+    __atomic_store_n(&slot->key, key, __ATOMIC_RELEASE);
+    t->array->used++;
+    t->live++;
+  } else {
+    if (!slot->value && value) t->live++;
+    else if (slot->value && !value) t->live--;
+    __atomic_store_n(&slot->value, value, __ATOMIC_RELEASE);
+  }
+ put_end:
+  fastlock_release(&t->lock);
+  return ret;
+}
+
+static inline void table_remove(table* t, uint64_t key) {
+  table_put(t, key, NULL);
+}
+
+#endif
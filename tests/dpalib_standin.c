@@ -0,0 +1,742 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dpalib_api.h>
+#include "dpalib_standin.h"
+
+#define STANDIN_ADAPTERS_DEFAULT 1
+#define STANDIN_NODEID_DEFAULT 4
+#define STANDIN_NODEID_STRIDE_DEFAULT 4
+// interrupt numbers handed out stay clear of the fixed ones asked for
+#define STANDIN_FIRST_INTNO 0x10000
+
+typedef struct standin_segment standin_segment;
+typedef struct standin_payload standin_payload;
+typedef struct standin_interrupt standin_interrupt;
+
+struct standin_segment {
+  standin_segment* next;
+  unsigned int segmentId;
+  size_t size;
+  void* mem;
+  int owned;
+  // adapters, one bit each
+  unsigned int prepared;
+  unsigned int available;
+  int removed;
+  size_t connections;
+};
+
+struct standin_payload {
+  standin_payload* next;
+  unsigned int len;
+  char data[];
+};
+
+struct standin_interrupt {
+  standin_interrupt* next;
+  unsigned int intno;
+  unsigned int adapterNo;
+  int with_data;
+  dpa_cb_interrupt_t callback;
+  dpa_cb_data_interrupt_t data_callback;
+  void* arg;
+  pthread_cond_t cond;
+  size_t pending;
+  // data interrupts queue one payload per trigger
+  standin_payload* head;
+  standin_payload** tail;
+  int removed;
+  int dispatching;
+  pthread_t dispatcher;
+};
+
+typedef struct {
+  standin_segment* segment;
+} standin_handle;
+
+typedef struct {
+  standin_interrupt* interrupt;
+} standin_remote_interrupt;
+
+/* Removed segments and interrupts stay listed, and allocated, until
+ * DPATerminate: waiters and stale handles may still look at them.
+ * Segment memory goes as soon as nobody is connected to it. */
+static struct {
+  pthread_mutex_t lock;
+  unsigned int adapters;
+  unsigned int nodeId;
+  unsigned int stride;
+  unsigned int next_intno;
+  standin_segment* segments;
+  standin_interrupt* interrupts;
+  size_t segment_connects[STANDIN_MAX_ADAPTERS];
+  size_t interrupt_connects[STANDIN_MAX_ADAPTERS];
+  size_t refused;
+} standin = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .adapters = STANDIN_ADAPTERS_DEFAULT,
+  .nodeId = STANDIN_NODEID_DEFAULT,
+  .stride = STANDIN_NODEID_STRIDE_DEFAULT,
+};
+
+static unsigned int env_uint(const char* name, unsigned int value) {
+  const char* str = getenv(name);
+  return str && *str ? (unsigned int) strtoul(str, NULL, 0) : value;
+}
+
+unsigned int standin_node_id(unsigned int adapterNo) {
+  return standin.nodeId + adapterNo * standin.stride;
+}
+
+// only the process itself answers, through the adapter that has its node id
+static inline int route_ok(unsigned int nodeId, unsigned int adapterNo) {
+  return adapterNo < standin.adapters && nodeId == standin_node_id(adapterNo);
+}
+
+size_t standin_segment_connects(unsigned int adapterNo) {
+  pthread_mutex_lock(&standin.lock);
+  size_t result = adapterNo < STANDIN_MAX_ADAPTERS ? standin.segment_connects[adapterNo] : 0;
+  pthread_mutex_unlock(&standin.lock);
+  return result;
+}
+
+size_t standin_interrupt_connects(unsigned int adapterNo) {
+  pthread_mutex_lock(&standin.lock);
+  size_t result = adapterNo < STANDIN_MAX_ADAPTERS ? standin.interrupt_connects[adapterNo] : 0;
+  pthread_mutex_unlock(&standin.lock);
+  return result;
+}
+
+size_t standin_refused_connects(void) {
+  pthread_mutex_lock(&standin.lock);
+  size_t result = standin.refused;
+  pthread_mutex_unlock(&standin.lock);
+  return result;
+}
+
+void DPAInitialize(unsigned int flags, dpa_error_t* error) {
+  pthread_mutex_lock(&standin.lock);
+  standin.adapters = env_uint("DPA_STANDIN_ADAPTERS", STANDIN_ADAPTERS_DEFAULT);
+  if (standin.adapters > STANDIN_MAX_ADAPTERS)
+    standin.adapters = STANDIN_MAX_ADAPTERS;
+  standin.nodeId = env_uint("DPA_STANDIN_NODEID", STANDIN_NODEID_DEFAULT);
+  standin.stride = env_uint("DPA_STANDIN_NODEID_STRIDE", STANDIN_NODEID_STRIDE_DEFAULT);
+  standin.next_intno = STANDIN_FIRST_INTNO;
+  memset(standin.segment_connects, 0, sizeof(standin.segment_connects));
+  memset(standin.interrupt_connects, 0, sizeof(standin.interrupt_connects));
+  standin.refused = 0;
+  pthread_mutex_unlock(&standin.lock);
+  *error = DPA_ERR_OK;
+}
+
+static void free_payloads(standin_interrupt* interrupt) {
+  while (interrupt->head) {
+    standin_payload* payload = interrupt->head;
+    interrupt->head = payload->next;
+    free(payload);
+  }
+  interrupt->tail = &interrupt->head;
+}
+
+void DPATerminate(void) {
+  pthread_mutex_lock(&standin.lock);
+  standin_segment* segments = standin.segments;
+  standin_interrupt* interrupts = standin.interrupts;
+  standin.segments = NULL;
+  standin.interrupts = NULL;
+  for (standin_interrupt* i = interrupts; i; i = i->next) {
+    i->removed = 1;
+    pthread_cond_broadcast(&i->cond);
+  }
+  pthread_mutex_unlock(&standin.lock);
+
+  while (interrupts) {
+    standin_interrupt* interrupt = interrupts;
+    interrupts = interrupt->next;
+    if (interrupt->dispatching)
+      pthread_join(interrupt->dispatcher, NULL);
+    free_payloads(interrupt);
+    pthread_cond_destroy(&interrupt->cond);
+    free(interrupt);
+  }
+  while (segments) {
+    standin_segment* segment = segments;
+    segments = segment->next;
+    if (segment->owned) free(segment->mem);
+    free(segment);
+  }
+}
+
+void DPAOpen(dpa_desc_t* sd, unsigned int flags, dpa_error_t* error) {
+  *sd = (dpa_desc_t) malloc(sizeof(int));
+  *error = *sd ? DPA_ERR_OK : DPA_ERR_NOSPC;
+}
+
+void DPAClose(dpa_desc_t sd, unsigned int flags, dpa_error_t* error) {
+  free(sd);
+  *error = DPA_ERR_OK;
+}
+
+void DPAGetLocalNodeId(unsigned int adapterNo, unsigned int* nodeId,
+                       unsigned int flags, dpa_error_t* error) {
+  if (adapterNo >= standin.adapters) {
+    *error = DPA_ERR_ILLEGAL_PARAMETER;
+    return;
+  }
+  *nodeId = standin_node_id(adapterNo);
+  *error = DPA_ERR_OK;
+}
+
+// adapter names are node ids here, anything else is the first adapter's node
+void DPAGetNodeIdByAdapterName(char* name, a3c_nodeId_list_t* nodeIdList,
+                               a3c_adapter_type_t* type, unsigned int flags,
+                               dpa_error_t* error) {
+  char* end;
+  unsigned long nodeId = strtoul(name, &end, 0);
+  (*nodeIdList)[0] = end != name && !*end ? (unsigned int) nodeId : standin_node_id(0);
+  *type = 0;
+  *error = DPA_ERR_OK;
+}
+
+/*
+ * Local segments
+ */
+
+static standin_segment* find_segment(unsigned int segmentId) {
+  for (standin_segment* s = standin.segments; s; s = s->next)
+    if (!s->removed && s->segmentId == segmentId) return s;
+  return NULL;
+}
+
+// memory outlives removal while remote mappings may still use it
+static void release_segment(standin_segment* segment) {
+  if (!segment->removed || segment->connections) return;
+  if (segment->owned) free(segment->mem);
+  segment->mem = NULL;
+  segment->owned = 0;
+}
+
+void DPACreateSegment(dpa_desc_t sd, dpa_local_segment_t* segment,
+                      unsigned int segmentId, size_t size,
+                      dpa_cb_local_segment_t callback, void* callbackArg,
+                      unsigned int flags, dpa_error_t* error) {
+  pthread_mutex_lock(&standin.lock);
+  if (find_segment(segmentId)) {
+    *error = DPA_ERR_SEGMENTID_USED;
+    goto create_end;
+  }
+  standin_segment* result = calloc(1, sizeof(standin_segment));
+  if (!result) {
+    *error = DPA_ERR_NOSPC;
+    goto create_end;
+  }
+  result->segmentId = segmentId;
+  result->size = size;
+  // connection callbacks are never reported, nothing remote ever goes away
+  if (!(flags & DPA_FLAG_EMPTY)) {
+    if (posix_memalign(&result->mem, sysconf(_SC_PAGESIZE), size ? size : 1)) {
+      free(result);
+      *error = DPA_ERR_NOSPC;
+      goto create_end;
+    }
+    memset(result->mem, 0, size);
+    result->owned = 1;
+  }
+  result->next = standin.segments;
+  standin.segments = result;
+  *segment = (dpa_local_segment_t) result;
+  *error = DPA_ERR_OK;
+ create_end:
+  pthread_mutex_unlock(&standin.lock);
+}
+
+void DPARegisterSegmentMemory(void* addr, size_t size, dpa_local_segment_t segment,
+                              unsigned int flags, dpa_error_t* error) {
+  standin_segment* s = (standin_segment*) segment;
+  pthread_mutex_lock(&standin.lock);
+  if (s->mem) {
+    *error = DPA_ERR_ILLEGAL_PARAMETER;
+  } else {
+    s->mem = addr;
+    s->size = size;
+    *error = DPA_ERR_OK;
+  }
+  pthread_mutex_unlock(&standin.lock);
+}
+
+void DPAPrepareSegment(dpa_local_segment_t segment, unsigned int adapterNo,
+                       unsigned int flags, dpa_error_t* error) {
+  standin_segment* s = (standin_segment*) segment;
+  pthread_mutex_lock(&standin.lock);
+  if (adapterNo >= standin.adapters) {
+    *error = DPA_ERR_ILLEGAL_PARAMETER;
+  } else {
+    s->prepared |= 1u << adapterNo;
+    *error = DPA_ERR_OK;
+  }
+  pthread_mutex_unlock(&standin.lock);
+}
+
+static volatile void* map_segment(standin_segment* s, dpa_map_t* map,
+                                  size_t offset, size_t size, dpa_error_t* error) {
+  if (!s->mem || offset > s->size || size > s->size - offset) {
+    *error = DPA_ERR_ILLEGAL_PARAMETER;
+    return NULL;
+  }
+  standin_handle* handle = malloc(sizeof(standin_handle));
+  if (!handle) {
+    *error = DPA_ERR_NOSPC;
+    return NULL;
+  }
+  handle->segment = s;
+  *map = (dpa_map_t) handle;
+  *error = DPA_ERR_OK;
+  return (char*) s->mem + offset;
+}
+
+volatile void* DPAMapLocalSegment(dpa_local_segment_t segment, dpa_map_t* map,
+                                  size_t offset, size_t size, void* addr,
+                                  unsigned int flags, dpa_error_t* error) {
+  pthread_mutex_lock(&standin.lock);
+  volatile void* result = map_segment((standin_segment*) segment, map, offset, size, error);
+  pthread_mutex_unlock(&standin.lock);
+  return result;
+}
+
+void DPASetSegmentAvailable(dpa_local_segment_t segment, unsigned int adapterNo,
+                            unsigned int flags, dpa_error_t* error) {
+  standin_segment* s = (standin_segment*) segment;
+  pthread_mutex_lock(&standin.lock);
+  // only through adapters it was prepared for
+  if (adapterNo >= standin.adapters || !(s->prepared & (1u << adapterNo))) {
+    *error = DPA_ERR_ILLEGAL_PARAMETER;
+  } else {
+    s->available |= 1u << adapterNo;
+    *error = DPA_ERR_OK;
+  }
+  pthread_mutex_unlock(&standin.lock);
+}
+
+void DPASetSegmentUnavailable(dpa_local_segment_t segment, unsigned int adapterNo,
+                              unsigned int flags, dpa_error_t* error) {
+  standin_segment* s = (standin_segment*) segment;
+  pthread_mutex_lock(&standin.lock);
+  if (adapterNo >= standin.adapters) {
+    *error = DPA_ERR_ILLEGAL_PARAMETER;
+  } else {
+    s->available &= ~(1u << adapterNo);
+    *error = DPA_ERR_OK;
+  }
+  pthread_mutex_unlock(&standin.lock);
+}
+
+void DPAUnmapSegment(dpa_map_t map, unsigned int flags, dpa_error_t* error) {
+  free(map);
+  *error = DPA_ERR_OK;
+}
+
+void DPARemoveSegment(dpa_local_segment_t segment, unsigned int flags, dpa_error_t* error) {
+  standin_segment* s = (standin_segment*) segment;
+  pthread_mutex_lock(&standin.lock);
+  s->removed = 1;
+  s->available = 0;
+  release_segment(s);
+  pthread_mutex_unlock(&standin.lock);
+  *error = DPA_ERR_OK;
+}
+
+/*
+ * Remote segments
+ */
+
+// a connect nobody answers would wait forever, it times out at once instead
+void DPAConnectSegment(dpa_desc_t sd, dpa_remote_segment_t* segment,
+                       unsigned int nodeId, unsigned int segmentId,
+                       unsigned int adapterNo, dpa_cb_remote_segment_t callback,
+                       void* callbackArg, unsigned int timeout,
+                       unsigned int flags, dpa_error_t* error) {
+  pthread_mutex_lock(&standin.lock);
+  standin_segment* s = route_ok(nodeId, adapterNo) ? find_segment(segmentId) : NULL;
+  if (!s || !(s->available & (1u << adapterNo))) {
+    standin.refused++;
+    *error = DPA_ERR_TIMEOUT;
+    goto connect_end;
+  }
+  standin_handle* handle = malloc(sizeof(standin_handle));
+  if (!handle) {
+    *error = DPA_ERR_NOSPC;
+    goto connect_end;
+  }
+  handle->segment = s;
+  s->connections++;
+  standin.segment_connects[adapterNo]++;
+  *segment = (dpa_remote_segment_t) handle;
+  *error = DPA_ERR_OK;
+ connect_end:
+  pthread_mutex_unlock(&standin.lock);
+}
+
+void DPADisconnectSegment(dpa_remote_segment_t segment, unsigned int flags,
+                          dpa_error_t* error) {
+  standin_handle* handle = (standin_handle*) segment;
+  pthread_mutex_lock(&standin.lock);
+  handle->segment->connections--;
+  release_segment(handle->segment);
+  pthread_mutex_unlock(&standin.lock);
+  free(handle);
+  *error = DPA_ERR_OK;
+}
+
+size_t DPAGetRemoteSegmentSize(dpa_remote_segment_t segment) {
+  return ((standin_handle*) segment)->segment->size;
+}
+
+volatile void* DPAMapRemoteSegment(dpa_remote_segment_t segment, dpa_map_t* map,
+                                   size_t offset, size_t size, void* addr,
+                                   unsigned int flags, dpa_error_t* error) {
+  pthread_mutex_lock(&standin.lock);
+  volatile void* result = map_segment(((standin_handle*) segment)->segment,
+                                      map, offset, size, error);
+  pthread_mutex_unlock(&standin.lock);
+  return result;
+}
+
+/*
+ * Sequences: stores to a mapping land in memory, only ordering is left
+ */
+
+void DPACreateMapSequence(dpa_map_t map, dpa_sequence_t* sequence,
+                          unsigned int flags, dpa_error_t* error) {
+  *sequence = (dpa_sequence_t) malloc(sizeof(int));
+  *error = *sequence ? DPA_ERR_OK : DPA_ERR_NOSPC;
+}
+
+dpa_sequence_status_t DPAStartSequence(dpa_sequence_t sequence, unsigned int flags,
+                                       dpa_error_t* error) {
+  *error = DPA_ERR_OK;
+  return DPA_SEQ_OK;
+}
+
+void DPARemoveSequence(dpa_sequence_t sequence, unsigned int flags, dpa_error_t* error) {
+  free(sequence);
+  *error = DPA_ERR_OK;
+}
+
+void DPAFlush(dpa_sequence_t sequence, unsigned int flags) {
+  __sync_synchronize();
+}
+
+/*
+ * Interrupts, with and without data
+ */
+
+static standin_interrupt* find_interrupt(unsigned int intno, int with_data) {
+  for (standin_interrupt* i = standin.interrupts; i; i = i->next)
+    if (!i->removed && i->intno == intno && i->with_data == with_data) return i;
+  return NULL;
+}
+
+// callbacks run on a thread of their own, as DPAlib does
+static void* dispatch_interrupt(void* arg) {
+  standin_interrupt* interrupt = arg;
+  pthread_mutex_lock(&standin.lock);
+  for (;;) {
+    while (!interrupt->pending && !interrupt->removed)
+      pthread_cond_wait(&interrupt->cond, &standin.lock);
+    if (interrupt->removed) break;
+    interrupt->pending--;
+    standin_payload* payload = interrupt->head;
+    if (payload && !(interrupt->head = payload->next))
+      interrupt->tail = &interrupt->head;
+    pthread_mutex_unlock(&standin.lock);
+
+    dpa_callback_action_t action;
+    if (interrupt->with_data)
+      action = interrupt->data_callback(interrupt->arg, (dpa_local_data_interrupt_t) interrupt,
+                                        payload->data, payload->len, DPA_ERR_OK);
+    else
+      action = interrupt->callback(interrupt->arg, (dpa_local_interrupt_t) interrupt,
+                                   DPA_ERR_OK);
+    free(payload);
+
+    pthread_mutex_lock(&standin.lock);
+    if (action == DPA_CALLBACK_CANCEL) break;
+  }
+  pthread_mutex_unlock(&standin.lock);
+  return NULL;
+}
+
+static dpa_error_t create_interrupt(standin_interrupt** result, unsigned int adapterNo,
+                                    unsigned int* intno, int with_data,
+                                    dpa_cb_interrupt_t callback,
+                                    dpa_cb_data_interrupt_t data_callback,
+                                    void* callbackArg, unsigned int flags) {
+  if (adapterNo >= standin.adapters) return DPA_ERR_ILLEGAL_PARAMETER;
+  unsigned int number;
+  if (flags & DPA_FLAG_FIXED_INTNO) {
+    number = *intno;
+    // reported like a used segment id, which is what the provider checks for
+    if (find_interrupt(number, with_data)) return DPA_ERR_SEGMENTID_USED;
+  } else {
+    do {
+      number = standin.next_intno++;
+    } while (find_interrupt(number, with_data));
+  }
+  standin_interrupt* interrupt = calloc(1, sizeof(standin_interrupt));
+  if (!interrupt) return DPA_ERR_NOSPC;
+  interrupt->intno = number;
+  interrupt->adapterNo = adapterNo;
+  interrupt->with_data = with_data;
+  interrupt->arg = callbackArg;
+  interrupt->tail = &interrupt->head;
+  pthread_cond_init(&interrupt->cond, NULL);
+  if ((flags & DPA_FLAG_USE_CALLBACK) && (callback || data_callback)) {
+    interrupt->callback = callback;
+    interrupt->data_callback = data_callback;
+    // it waits for the lock we hold before looking at anything
+    if (pthread_create(&interrupt->dispatcher, NULL, dispatch_interrupt, interrupt)) {
+      pthread_cond_destroy(&interrupt->cond);
+      free(interrupt);
+      return DPA_ERR_SYSTEM;
+    }
+    interrupt->dispatching = 1;
+  }
+  interrupt->next = standin.interrupts;
+  standin.interrupts = interrupt;
+  *intno = number;
+  *result = interrupt;
+  return DPA_ERR_OK;
+}
+
+static void remove_interrupt(standin_interrupt* interrupt) {
+  pthread_mutex_lock(&standin.lock);
+  interrupt->removed = 1;
+  pthread_cond_broadcast(&interrupt->cond);
+  int dispatching = interrupt->dispatching;
+  interrupt->dispatching = 0;
+  pthread_mutex_unlock(&standin.lock);
+  if (!dispatching) return;
+  // a callback may remove its own interrupt
+  if (pthread_equal(interrupt->dispatcher, pthread_self()))
+    pthread_detach(interrupt->dispatcher);
+  else
+    pthread_join(interrupt->dispatcher, NULL);
+}
+
+static dpa_error_t wait_interrupt(standin_interrupt* interrupt, unsigned int timeout,
+                                  standin_payload** payload) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (long) (timeout % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  dpa_error_t error = DPA_ERR_OK;
+  pthread_mutex_lock(&standin.lock);
+  if (interrupt->dispatching) {
+    // callback interrupts cannot be waited for
+    error = DPA_ERR_ILLEGAL_PARAMETER;
+    goto wait_end;
+  }
+  while (!interrupt->pending && !interrupt->removed) {
+    if (timeout == DPA_INFINITE_TIMEOUT)
+      pthread_cond_wait(&interrupt->cond, &standin.lock);
+    else if (pthread_cond_timedwait(&interrupt->cond, &standin.lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+  if (interrupt->pending) {
+    interrupt->pending--;
+    if (payload && (*payload = interrupt->head) &&
+        !(interrupt->head = (*payload)->next))
+      interrupt->tail = &interrupt->head;
+  } else
+    error = interrupt->removed ? DPA_ERR_SYSTEM : DPA_ERR_TIMEOUT;
+ wait_end:
+  pthread_mutex_unlock(&standin.lock);
+  return error;
+}
+
+static dpa_error_t connect_interrupt(standin_remote_interrupt** result, unsigned int nodeId,
+                                     unsigned int adapterNo, unsigned int intno,
+                                     int with_data) {
+  pthread_mutex_lock(&standin.lock);
+  dpa_error_t error = DPA_ERR_OK;
+  standin_interrupt* interrupt = route_ok(nodeId, adapterNo)
+    ? find_interrupt(intno, with_data) : NULL;
+  // interrupts are only reachable through the adapter they were created on
+  if (!interrupt || interrupt->adapterNo != adapterNo) {
+    standin.refused++;
+    error = DPA_ERR_TIMEOUT;
+    goto connect_end;
+  }
+  standin_remote_interrupt* remote = malloc(sizeof(standin_remote_interrupt));
+  if (!remote) {
+    error = DPA_ERR_NOSPC;
+    goto connect_end;
+  }
+  remote->interrupt = interrupt;
+  standin.interrupt_connects[adapterNo]++;
+  *result = remote;
+ connect_end:
+  pthread_mutex_unlock(&standin.lock);
+  return error;
+}
+
+static dpa_error_t trigger_interrupt(standin_interrupt* interrupt, const void* data,
+                                     unsigned int len) {
+  standin_payload* payload = NULL;
+  if (interrupt->with_data) {
+    payload = malloc(sizeof(standin_payload) + len);
+    if (!payload) return DPA_ERR_NOSPC;
+    payload->next = NULL;
+    payload->len = len;
+    memcpy(payload->data, data, len);
+  }
+  dpa_error_t error = DPA_ERR_OK;
+  pthread_mutex_lock(&standin.lock);
+  if (interrupt->removed) {
+    error = DPA_ERR_SYSTEM;
+    free(payload);
+  } else {
+    if (payload) {
+      *interrupt->tail = payload;
+      interrupt->tail = &payload->next;
+    }
+    interrupt->pending++;
+    pthread_cond_broadcast(&interrupt->cond);
+  }
+  pthread_mutex_unlock(&standin.lock);
+  return error;
+}
+
+void DPACreateInterrupt(dpa_desc_t sd, dpa_local_interrupt_t* interrupt,
+                        unsigned int adapterNo, unsigned int* intno,
+                        dpa_cb_interrupt_t callback, void* callbackArg,
+                        unsigned int flags, dpa_error_t* error) {
+  standin_interrupt* result;
+  pthread_mutex_lock(&standin.lock);
+  *error = create_interrupt(&result, adapterNo, intno, 0, callback, NULL, callbackArg, flags);
+  pthread_mutex_unlock(&standin.lock);
+  if (*error == DPA_ERR_OK)
+    *interrupt = (dpa_local_interrupt_t) result;
+}
+
+void DPARemoveInterrupt(dpa_local_interrupt_t interrupt, unsigned int flags,
+                        dpa_error_t* error) {
+  remove_interrupt((standin_interrupt*) interrupt);
+  *error = DPA_ERR_OK;
+}
+
+void DPAWaitForInterrupt(dpa_local_interrupt_t interrupt, unsigned int timeout,
+                         unsigned int flags, dpa_error_t* error) {
+  *error = wait_interrupt((standin_interrupt*) interrupt, timeout, NULL);
+}
+
+void DPAConnectInterrupt(dpa_desc_t sd, dpa_remote_interrupt_t* interrupt,
+                         unsigned int nodeId, unsigned int adapterNo,
+                         unsigned int intno, unsigned int timeout,
+                         unsigned int flags, dpa_error_t* error) {
+  standin_remote_interrupt* result;
+  *error = connect_interrupt(&result, nodeId, adapterNo, intno, 0);
+  if (*error == DPA_ERR_OK)
+    *interrupt = (dpa_remote_interrupt_t) result;
+}
+
+void DPADisconnectInterrupt(dpa_remote_interrupt_t interrupt, unsigned int flags,
+                            dpa_error_t* error) {
+  free(interrupt);
+  *error = DPA_ERR_OK;
+}
+
+void DPATriggerInterrupt(dpa_remote_interrupt_t interrupt, unsigned int flags,
+                         dpa_error_t* error) {
+  *error = trigger_interrupt(((standin_remote_interrupt*) interrupt)->interrupt, NULL, 0);
+}
+
+void DPACreateDataInterrupt(dpa_desc_t sd, dpa_local_data_interrupt_t* interrupt,
+                            unsigned int adapterNo, unsigned int* intno,
+                            dpa_cb_data_interrupt_t callback, void* callbackArg,
+                            unsigned int flags, dpa_error_t* error) {
+  standin_interrupt* result;
+  pthread_mutex_lock(&standin.lock);
+  *error = create_interrupt(&result, adapterNo, intno, 1, NULL, callback, callbackArg, flags);
+  pthread_mutex_unlock(&standin.lock);
+  if (*error == DPA_ERR_OK)
+    *interrupt = (dpa_local_data_interrupt_t) result;
+}
+
+void DPARemoveDataInterrupt(dpa_local_data_interrupt_t interrupt, unsigned int flags,
+                            dpa_error_t* error) {
+  remove_interrupt((standin_interrupt*) interrupt);
+  *error = DPA_ERR_OK;
+}
+
+void DPAWaitForDataInterrupt(dpa_local_data_interrupt_t interrupt, void* data,
+                             unsigned int* len, unsigned int timeout,
+                             unsigned int flags, dpa_error_t* error) {
+  standin_payload* payload = NULL;
+  *error = wait_interrupt((standin_interrupt*) interrupt, timeout, &payload);
+  if (*error != DPA_ERR_OK) return;
+  memcpy(data, payload->data, payload->len < *len ? payload->len : *len);
+  *len = payload->len;
+  free(payload);
+}
+
+void DPAConnectDataInterrupt(dpa_desc_t sd, dpa_remote_data_interrupt_t* interrupt,
+                             unsigned int nodeId, unsigned int adapterNo,
+                             unsigned int intno, unsigned int timeout,
+                             unsigned int flags, dpa_error_t* error) {
+  standin_remote_interrupt* result;
+  *error = connect_interrupt(&result, nodeId, adapterNo, intno, 1);
+  if (*error == DPA_ERR_OK)
+    *interrupt = (dpa_remote_data_interrupt_t) result;
+}
+
+void DPADisconnectDataInterrupt(dpa_remote_data_interrupt_t interrupt, unsigned int flags,
+                                dpa_error_t* error) {
+  free(interrupt);
+  *error = DPA_ERR_OK;
+}
+
+void DPATriggerDataInterrupt(dpa_remote_data_interrupt_t interrupt, void* data,
+                             unsigned int len, unsigned int flags, dpa_error_t* error) {
+  *error = trigger_interrupt(((standin_remote_interrupt*) interrupt)->interrupt, data, len);
+}
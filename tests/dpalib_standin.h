@@ -0,0 +1,57 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#ifndef DPALIB_STANDIN_H
+#define DPALIB_STANDIN_H
+
+#include <stddef.h>
+
+/* An in-process DPAlib, to run the provider without Ronnie hardware.
+ * Each simulated adapter is a loopback port of this process: adapter a
+ * has node id DPA_STANDIN_NODEID + a * DPA_STANDIN_NODEID_STRIDE and
+ * reaches only that node, so connecting through the wrong adapter, or
+ * to a segment or interrupt living on another adapter, is refused.
+ * DPA_STANDIN_ADAPTERS sets how many adapters are present. */
+
+#define STANDIN_MAX_ADAPTERS 8
+
+// node id of the process as seen through the adapter
+unsigned int standin_node_id(unsigned int adapterNo);
+
+// successful connects through the adapter since DPAInitialize
+size_t standin_segment_connects(unsigned int adapterNo);
+size_t standin_interrupt_connects(unsigned int adapterNo);
+
+// connects refused because of the node, adapter or availability
+size_t standin_refused_connects(void);
+
+#endif
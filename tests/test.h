@@ -0,0 +1,92 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#ifndef DPA_TEST_H
+#define DPA_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// seconds before a hung case is killed
+#ifndef TEST_TIMEOUT
+#define TEST_TIMEOUT 30
+#endif
+
+#define CHECK(cond) do {                                                \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      return 1;                                                         \
+    }                                                                   \
+  } while (0)
+
+// libfabric calls return 0 or a negative error code
+#define CHECK_OK(call) do {                                             \
+    long _ret = (long) (call);                                          \
+    if (_ret) {                                                         \
+      fprintf(stderr, "%s:%d: %s returned %ld\n", __FILE__, __LINE__, #call, _ret); \
+      return 1;                                                         \
+    }                                                                   \
+  } while (0)
+
+typedef int (*test_case)(void);
+
+/**
+ * Run a case in a child process of its own: the provider reads the
+ * environment once at fi_prov_ini and keeps global state from then on.
+ */
+static inline int run_case(const char* name, test_case test) {
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return 1;
+  }
+  if (!pid) {
+    alarm(TEST_TIMEOUT);
+    _exit(test());
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0) {
+    perror("waitpid");
+    return 1;
+  }
+  int failed = !WIFEXITED(status) || WEXITSTATUS(status);
+  printf("%s: %s\n", failed ? "FAIL" : "PASS", name);
+  return failed;
+}
+
+#define RUN_CASE(test) run_case(#test, test)
+
+#endif
@@ -0,0 +1,467 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <rdma/fabric.h>
+#include <rdma/fi_domain.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_eq.h>
+#include <rdma/fi_errno.h>
+#include "dpa.h"
+#include "dpa_cq.h"
+#include "fi_ext_dpa.h"
+#include "test.h"
+
+struct fi_provider* fi_prov_ini(void);
+
+#define RING_SIZE 4
+#define STRESS_COUNT 200000
+#define STRESS_RING 64
+#define DELAY_MS 20
+#define WAIT_MS 100
+// generous, so that loaded machines do not fail the waits
+#define LONG_WAIT_MS 5000
+
+static struct fid_domain* domain;
+
+static int open_domain(void) {
+  struct fi_provider* prov = fi_prov_ini();
+  CHECK(prov);
+  struct fi_ep_attr ep_attr = { .type = FI_EP_RDM };
+  struct fi_info hints = { .ep_attr = &ep_attr };
+  struct fi_info* info;
+  CHECK_OK(prov->getinfo(FI_VERSION(FI_MAJOR_VERSION, FI_MINOR_VERSION),
+                         NULL, NULL, 0, &hints, &info));
+  struct fid_fabric* fabric;
+  CHECK_OK(prov->fabric(info->fabric_attr, &fabric, NULL));
+  CHECK_OK(fi_domain(fabric, info, &domain, NULL));
+  return 0;
+}
+
+static int open_cq(struct fi_cq_attr* attr, struct fid_cq** cq) {
+  CHECK_OK(open_domain());
+  CHECK_OK(fi_cq_open(domain, attr, cq, NULL));
+  return 0;
+}
+
+// completions as the provider adds them, data tells them apart
+static void add(struct fid_cq* cq, uint64_t data) {
+  struct fi_cq_err_entry entry = {
+    .op_context = (void*) (uintptr_t) data,
+    .flags = FI_RECV,
+    .len = data,
+    .data = data
+  };
+  cq_add_src(container_of(cq, dpa_fid_cq, cq), &entry, (fi_addr_t) data);
+}
+
+static void add_error(struct fid_cq* cq, uint64_t data) {
+  struct fi_cq_err_entry entry = {
+    .op_context = (void*) (uintptr_t) data,
+    .data = data,
+    .err = FI_EIO
+  };
+  cq_add(container_of(cq, dpa_fid_cq, cq), &entry);
+}
+
+static int64_t now_msec(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void sleep_ms(long ms) {
+  struct timespec delay = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+  nanosleep(&delay, NULL);
+}
+
+typedef struct {
+  struct fid_cq* cq;
+  int count;
+  int error;
+} delayed_adds;
+
+// count completions DELAY_MS apart, then an error if asked for
+static void* add_later(void* arg) {
+  delayed_adds* adds = arg;
+  for (int i = 0; i < adds->count; i++) {
+    sleep_ms(DELAY_MS);
+    add(adds->cq, i);
+  }
+  if (adds->error) {
+    sleep_ms(DELAY_MS);
+    add_error(adds->cq, adds->count);
+  }
+  return NULL;
+}
+
+static int start_adds(pthread_t* thread, delayed_adds* adds) {
+  CHECK(!pthread_create(thread, NULL, add_later, adds));
+  return 0;
+}
+
+static int ring_keeps_order_across_wrap(void) {
+  struct fi_cq_attr attr = { .format = FI_CQ_FORMAT_DATA, .size = RING_SIZE };
+  struct fid_cq* cq;
+  CHECK_OK(open_cq(&attr, &cq));
+  struct fi_cq_data_entry entries[RING_SIZE];
+  fi_addr_t src[RING_SIZE];
+  CHECK(fi_cq_read(cq, entries, RING_SIZE) == -FI_EAGAIN);
+  uint64_t next = 0, expected = 0;
+  for (int round = 0; round < 3 * RING_SIZE; round++) {
+    add(cq, next++);
+    add(cq, next++);
+    add(cq, next++);
+    // reads one short of what was added, so head and tail wrap apart
+    for (ssize_t count = 0; count < 2; ) {
+      ssize_t ret = fi_cq_readfrom(cq, entries, 2 - count, src);
+      CHECK(ret > 0);
+      for (ssize_t i = 0; i < ret; i++, expected++) {
+        CHECK(entries[i].data == expected);
+        CHECK(entries[i].len == expected);
+        CHECK(entries[i].op_context == (void*) (uintptr_t) expected);
+        CHECK(entries[i].flags == FI_RECV);
+        CHECK(src[i] == expected);
+      }
+      count += ret;
+    }
+  }
+  // what is left comes out in one read, split where the ring wraps
+  ssize_t left = next - expected;
+  struct fi_cq_data_entry* rest = calloc(left, sizeof(*rest));
+  CHECK(rest);
+  CHECK(fi_cq_read(cq, rest, left) == left);
+  for (ssize_t i = 0; i < left; i++)
+    CHECK(rest[i].data == expected + i);
+  CHECK(fi_cq_read(cq, entries, 1) == -FI_EAGAIN);
+  free(rest);
+  return 0;
+}
+
+// a locked ring doubles instead of dropping completions
+static int locked_ring_grows(void) {
+  struct fi_cq_attr attr = { .format = FI_CQ_FORMAT_DATA, .size = RING_SIZE };
+  struct fid_cq* cq;
+  CHECK_OK(open_cq(&attr, &cq));
+  dpa_fid_cq* cq_priv = container_of(cq, dpa_fid_cq, cq);
+  CHECK(!cq_priv->spsc);
+  CHECK(cq_priv->ring_mask + 1 == RING_SIZE);
+  struct fi_cq_data_entry entries[4 * RING_SIZE];
+  // start off the ring origin, so the pending entries wrap when it grows
+  add(cq, 0);
+  CHECK(fi_cq_read(cq, entries, 1) == 1);
+  for (uint64_t data = 1; data <= 4 * RING_SIZE; data++)
+    add(cq, data);
+  CHECK(cq_priv->ring_mask + 1 == 4 * RING_SIZE);
+  CHECK(fi_cq_read(cq, entries, 4 * RING_SIZE) == 4 * RING_SIZE);
+  for (int i = 0; i < 4 * RING_SIZE; i++)
+    CHECK(entries[i].data == i + 1);
+  CHECK(!cq_priv->overruns);
+  return 0;
+}
+
+// entries are as wide as the format asks, nothing past them is touched
+static int entries_match_format(void) {
+  struct fi_cq_attr attr = { .format = FI_CQ_FORMAT_CONTEXT, .size = RING_SIZE };
+  struct fid_cq* cq;
+  CHECK_OK(open_cq(&attr, &cq));
+  CHECK(container_of(cq, dpa_fid_cq, cq)->entry_size == sizeof(struct fi_cq_entry));
+  struct fi_cq_entry entries[RING_SIZE + 1];
+  memset(entries, 0xff, sizeof(entries));
+  add(cq, 1);
+  add(cq, 2);
+  CHECK(fi_cq_read(cq, entries, RING_SIZE) == 2);
+  CHECK(entries[0].op_context == (void*) 1);
+  CHECK(entries[1].op_context == (void*) 2);
+  CHECK(entries[2].op_context == (void*) UINTPTR_MAX);
+  return 0;
+}
+
+static int errors_are_reported_apart(void) {
+  struct fi_cq_attr attr = { .format = FI_CQ_FORMAT_DATA, .size = RING_SIZE };
+  struct fid_cq* cq;
+  CHECK_OK(open_cq(&attr, &cq));
+  struct fi_cq_data_entry entry;
+  struct fi_cq_err_entry error;
+  add(cq, 1);
+  add_error(cq, 2);
+  // completions come first, then the reader learns of the error
+  CHECK(fi_cq_read(cq, &entry, 1) == 1);
+  CHECK(entry.data == 1);
+  CHECK(fi_cq_read(cq, &entry, 1) == -FI_EAVAIL);
+  CHECK(fi_cq_readerr(cq, &error, 0) == 1);
+  CHECK(error.err == FI_EIO);
+  CHECK(error.op_context == (void*) 2);
+  CHECK(fi_cq_readerr(cq, &error, 0) == -FI_EAGAIN);
+  CHECK(fi_cq_read(cq, &entry, 1) == -FI_EAGAIN);
+  return 0;
+}
+
+// a lock-free ring cannot grow, extra completions become overrun errors
+static int spsc_overflow_is_reported(void) {
+  struct fi_cq_attr attr = {
+    .format = FI_CQ_FORMAT_DATA,
+    .size = RING_SIZE,
+    .flags = FI_DPA_CQ_SPSC
+  };
+  struct fid_cq* cq;
+  CHECK_OK(open_cq(&attr, &cq));
+  dpa_fid_cq* cq_priv = container_of(cq, dpa_fid_cq, cq);
+  CHECK(cq_priv->spsc);
+  for (uint64_t data = 0; data < RING_SIZE + 2; data++)
+    add(cq, data);
+  CHECK(cq_priv->ring_mask + 1 == RING_SIZE);
+  CHECK(cq_priv->overruns == 2);
+
+  struct fi_cq_data_entry entries[RING_SIZE + 2];
+  CHECK(fi_cq_read(cq, entries, RING_SIZE + 2) == RING_SIZE);
+  for (int i = 0; i < RING_SIZE; i++)
+    CHECK(entries[i].data == i);
+  CHECK(fi_cq_read(cq, entries, 1) == -FI_EAVAIL);
+  // the overrun completions still hand their context back
+  struct fi_cq_err_entry error;
+  for (uint64_t data = RING_SIZE; data < RING_SIZE + 2; data++) {
+    CHECK(fi_cq_readerr(cq, &error, 0) == 1);
+    CHECK(error.err == FI_EOVERFLOW);
+    CHECK(error.op_context == (void*) (uintptr_t) data);
+    CHECK(error.data == data);
+  }
+  CHECK(fi_cq_read(cq, entries, 1) == -FI_EAGAIN);
+  return 0;
+}
+
+static void* produce(void* arg) {
+  struct fid_cq* cq = arg;
+  for (uint64_t data = 0; data < STRESS_COUNT; data++)
+    add(cq, data);
+  return NULL;
+}
+
+// every completion reaches the consumer once, in order or as an overrun
+static int spsc_producer_consumer(void) {
+  struct fi_cq_attr attr = {
+    .format = FI_CQ_FORMAT_DATA,
+    .size = STRESS_RING,
+    .flags = FI_DPA_CQ_SPSC
+  };
+  struct fid_cq* cq;
+  CHECK_OK(open_cq(&attr, &cq));
+  CHECK(container_of(cq, dpa_fid_cq, cq)->spsc);
+  uint8_t* seen = calloc(STRESS_COUNT, 1);
+  CHECK(seen);
+  pthread_t producer;
+  CHECK(!pthread_create(&producer, NULL, produce, cq));
+
+  struct fi_cq_data_entry entries[STRESS_RING];
+  struct fi_cq_err_entry error;
+  uint64_t total = 0, next = 0;
+  while (total < STRESS_COUNT) {
+    ssize_t ret = fi_cq_read(cq, entries, STRESS_RING);
+    if (ret == -FI_EAVAIL) {
+      CHECK(fi_cq_readerr(cq, &error, 0) == 1);
+      CHECK(error.err == FI_EOVERFLOW);
+      CHECK(error.data < STRESS_COUNT && !seen[error.data]);
+      seen[error.data] = 1;
+      total++;
+      continue;
+    }
+    if (ret == -FI_EAGAIN) continue;
+    CHECK(ret > 0);
+    for (ssize_t i = 0; i < ret; i++) {
+      // the ring keeps producer order, overruns only leave gaps
+      CHECK(entries[i].data >= next && entries[i].data < STRESS_COUNT);
+      CHECK(!seen[entries[i].data]);
+      seen[entries[i].data] = 1;
+      next = entries[i].data + 1;
+    }
+    total += ret;
+  }
+  pthread_join(producer, NULL);
+  CHECK(fi_cq_read(cq, entries, 1) == -FI_EAGAIN);
+  free(seen);
+  return 0;
+}
+
+static int threshold_cq(struct fid_cq** cq) {
+  struct fi_cq_attr attr = {
+    .format = FI_CQ_FORMAT_DATA,
+    .size = RING_SIZE,
+    .wait_cond = FI_CQ_COND_THRESHOLD
+  };
+  CHECK_OK(open_cq(&attr, cq));
+  return 0;
+}
+
+static int threshold_waits_for_entries(void) {
+  struct fid_cq* cq;
+  CHECK_OK(threshold_cq(&cq));
+  delayed_adds adds = { .cq = cq, .count = RING_SIZE };
+  pthread_t thread;
+  CHECK_OK(start_adds(&thread, &adds));
+  size_t threshold = RING_SIZE;
+  struct fi_cq_data_entry entries[2 * RING_SIZE];
+  CHECK(fi_cq_sread(cq, entries, 2 * RING_SIZE, &threshold, LONG_WAIT_MS) == RING_SIZE);
+  for (int i = 0; i < RING_SIZE; i++)
+    CHECK(entries[i].data == i);
+  pthread_join(thread, NULL);
+  return 0;
+}
+
+// a threshold larger than the caller's buffer would never be met
+static int threshold_capped_by_count(void) {
+  struct fid_cq* cq;
+  CHECK_OK(threshold_cq(&cq));
+  delayed_adds adds = { .cq = cq, .count = 2 };
+  pthread_t thread;
+  CHECK_OK(start_adds(&thread, &adds));
+  size_t threshold = 2 * RING_SIZE;
+  struct fi_cq_data_entry entries[2];
+  int64_t start = now_msec();
+  CHECK(fi_cq_sread(cq, entries, 2, &threshold, LONG_WAIT_MS) == 2);
+  CHECK(now_msec() - start < LONG_WAIT_MS);
+  pthread_join(thread, NULL);
+  return 0;
+}
+
+static int threshold_timeout_returns_partial(void) {
+  struct fid_cq* cq;
+  CHECK_OK(threshold_cq(&cq));
+  add(cq, 0);
+  size_t threshold = RING_SIZE;
+  struct fi_cq_data_entry entries[RING_SIZE];
+  int64_t start = now_msec();
+  CHECK(fi_cq_sread(cq, entries, RING_SIZE, &threshold, WAIT_MS) == 1);
+  CHECK(now_msec() - start >= WAIT_MS - 1);
+  CHECK(entries[0].data == 0);
+  return 0;
+}
+
+// an error is not held back until the threshold is met
+static int error_ends_threshold_wait(void) {
+  struct fid_cq* cq;
+  CHECK_OK(threshold_cq(&cq));
+  delayed_adds adds = { .cq = cq, .count = 1, .error = 1 };
+  pthread_t thread;
+  CHECK_OK(start_adds(&thread, &adds));
+  size_t threshold = RING_SIZE;
+  struct fi_cq_data_entry entries[RING_SIZE];
+  int64_t start = now_msec();
+  CHECK(fi_cq_sread(cq, entries, RING_SIZE, &threshold, LONG_WAIT_MS) == 1);
+  CHECK(now_msec() - start < LONG_WAIT_MS);
+  pthread_join(thread, NULL);
+  CHECK(fi_cq_read(cq, entries, RING_SIZE) == -FI_EAVAIL);
+  return 0;
+}
+
+// queues opened without FI_CQ_COND_THRESHOLD ignore the condition
+static int threshold_needs_wait_cond(void) {
+  struct fi_cq_attr attr = { .format = FI_CQ_FORMAT_DATA, .size = RING_SIZE };
+  struct fid_cq* cq;
+  CHECK_OK(open_cq(&attr, &cq));
+  delayed_adds adds = { .cq = cq, .count = RING_SIZE };
+  pthread_t thread;
+  CHECK_OK(start_adds(&thread, &adds));
+  size_t threshold = RING_SIZE;
+  struct fi_cq_data_entry entries[RING_SIZE];
+  ssize_t ret = fi_cq_sread(cq, entries, RING_SIZE, &threshold, LONG_WAIT_MS);
+  CHECK(ret >= 1 && ret < RING_SIZE);
+  pthread_join(thread, NULL);
+  return 0;
+}
+
+static int sread_times_out(void) {
+  struct fi_cq_attr attr = { .format = FI_CQ_FORMAT_DATA };
+  struct fid_cq* cq;
+  CHECK_OK(open_cq(&attr, &cq));
+  struct fi_cq_data_entry entry;
+  int64_t start = now_msec();
+  CHECK(fi_cq_sread(cq, &entry, 1, NULL, 0) == -FI_EAGAIN);
+  CHECK(fi_cq_sread(cq, &entry, 1, NULL, WAIT_MS) == -FI_EAGAIN);
+  int64_t elapsed = now_msec() - start;
+  CHECK(elapsed >= WAIT_MS - 1 && elapsed < LONG_WAIT_MS);
+  return 0;
+}
+
+// waits past the spin phase are woken by the producer
+static int sread_wakes_on_completion(void) {
+  struct fi_cq_attr attr = { .format = FI_CQ_FORMAT_DATA };
+  struct fid_cq* cq;
+  CHECK_OK(open_cq(&attr, &cq));
+  delayed_adds adds = { .cq = cq, .count = 1 };
+  pthread_t thread;
+  CHECK_OK(start_adds(&thread, &adds));
+  struct fi_cq_data_entry entry;
+  CHECK(fi_cq_sread(cq, &entry, 1, NULL, -1) == 1);
+  CHECK(entry.data == 0);
+  pthread_join(thread, NULL);
+  return 0;
+}
+
+static void* signal_later(void* arg) {
+  sleep_ms(DELAY_MS);
+  fi_cq_signal(arg);
+  return NULL;
+}
+
+static int signal_ends_wait(void) {
+  struct fi_cq_attr attr = { .format = FI_CQ_FORMAT_DATA };
+  struct fid_cq* cq;
+  CHECK_OK(open_cq(&attr, &cq));
+  pthread_t thread;
+  CHECK(!pthread_create(&thread, NULL, signal_later, cq));
+  struct fi_cq_data_entry entry;
+  CHECK(fi_cq_sread(cq, &entry, 1, NULL, -1) == -FI_EAGAIN);
+  pthread_join(thread, NULL);
+  return 0;
+}
+
+int main() {
+  int failed = 0;
+  failed += RUN_CASE(ring_keeps_order_across_wrap);
+  failed += RUN_CASE(locked_ring_grows);
+  failed += RUN_CASE(entries_match_format);
+  failed += RUN_CASE(errors_are_reported_apart);
+  failed += RUN_CASE(spsc_overflow_is_reported);
+  failed += RUN_CASE(spsc_producer_consumer);
+  failed += RUN_CASE(threshold_waits_for_entries);
+  failed += RUN_CASE(threshold_capped_by_count);
+  failed += RUN_CASE(threshold_timeout_returns_partial);
+  failed += RUN_CASE(error_ends_threshold_wait);
+  failed += RUN_CASE(threshold_needs_wait_cond);
+  failed += RUN_CASE(sread_times_out);
+  failed += RUN_CASE(sread_wakes_on_completion);
+  failed += RUN_CASE(signal_ends_wait);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,231 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#include <string.h>
+#include <rdma/fabric.h>
+#include <rdma/fi_domain.h>
+#include <rdma/fi_endpoint.h>
+#include <rdma/fi_eq.h>
+#include <rdma/fi_rma.h>
+#include <rdma/fi_errno.h>
+#include "dpa.h"
+#include "dpa_ep.h"
+#include "dpalib_standin.h"
+#include "test.h"
+
+struct fi_provider* fi_prov_ini(void);
+
+#define NODEID_STRIDE "16"
+#define MR_KEY 0x100
+#define STRIPE_SIZE 4096
+#define XFER_SIZE (16 * STRIPE_SIZE)
+// 1 ms apart, so a few seconds before giving up
+#define POLL_LIMIT 5000
+
+typedef struct {
+  struct fi_provider* prov;
+  struct fi_info* info;
+  struct fid_fabric* fabric;
+  struct fid_domain* domain;
+  struct fid_av* av;
+  fi_addr_t self;
+} rdm_setup;
+
+// present adapters are simulated, used ones are what the provider asks for
+static void use_adapters(const char* present, const char* used, const char* stride) {
+  setenv("DPA_STANDIN_ADAPTERS", present, 1);
+  setenv("DPA_STANDIN_NODEID_STRIDE", stride, 1);
+  setenv("FI_DPA_ADAPTER_COUNT", used, 1);
+  setenv("FI_DPA_RAIL_NODEID_STRIDE", stride, 1);
+}
+
+// a domain whose address vector holds the process itself
+static int rdm_open(rdm_setup* setup, uint64_t caps, enum fi_progress progress) {
+  setup->prov = fi_prov_ini();
+  CHECK(setup->prov);
+  struct fi_ep_attr ep_attr = { .type = FI_EP_RDM };
+  struct fi_domain_attr domain_attr = { .data_progress = progress };
+  struct fi_info hints = {
+    .caps = caps,
+    .ep_attr = &ep_attr,
+    .domain_attr = &domain_attr,
+  };
+  CHECK_OK(setup->prov->getinfo(FI_VERSION(FI_MAJOR_VERSION, FI_MINOR_VERSION),
+                                NULL, NULL, 0, &hints, &setup->info));
+  dpa_addr_t* self = malloc(sizeof(dpa_addr_t));
+  CHECK(self);
+  *self = *(dpa_addr_t*) setup->info->src_addr;
+  CHECK(self->nodeId == standin_node_id(0));
+  setup->info->dest_addr = self;
+  setup->info->dest_addrlen = sizeof(dpa_addr_t);
+
+  CHECK_OK(setup->prov->fabric(setup->info->fabric_attr, &setup->fabric, NULL));
+  CHECK_OK(fi_domain(setup->fabric, setup->info, &setup->domain, NULL));
+  struct fi_av_attr av_attr = { .type = FI_AV_TABLE, .count = 1 };
+  CHECK_OK(fi_av_open(setup->domain, &av_attr, &setup->av, NULL));
+  CHECK(fi_av_insert(setup->av, self, 1, &setup->self, 0, NULL) == 1);
+  return 0;
+}
+
+static int rdm_endpoint(rdm_setup* setup, struct fid_ep** ep, struct fid_cq** cq) {
+  struct fi_cq_attr cq_attr = { .format = FI_CQ_FORMAT_DATA };
+  CHECK_OK(fi_cq_open(setup->domain, &cq_attr, cq, NULL));
+  CHECK_OK(fi_endpoint(setup->domain, setup->info, ep, NULL));
+  CHECK_OK(fi_ep_bind(*ep, &(*cq)->fid, FI_SEND | FI_RECV));
+  CHECK_OK(fi_ep_bind(*ep, &setup->av->fid, 0));
+  CHECK_OK(fi_enable(*ep));
+  return 0;
+}
+
+static ssize_t poll_cq(struct fid_cq* cq, struct fi_cq_data_entry* entry) {
+  for (int i = 0; i < POLL_LIMIT; i++) {
+    ssize_t ret = fi_cq_read(cq, entry, 1);
+    if (ret != -FI_EAGAIN) return ret;
+    usleep(1000);
+  }
+  return -FI_EAGAIN;
+}
+
+static int rails_on_two_adapters(void) {
+  use_adapters("2", "2", NODEID_STRIDE);
+  CHECK(fi_prov_ini());
+  CHECK(dpaRailCount == 2);
+  CHECK(dpaRails[0] == 0 && dpaRails[1] == 1);
+  return 0;
+}
+
+static int missing_rail_is_skipped(void) {
+  use_adapters("1", "2", NODEID_STRIDE);
+  CHECK(fi_prov_ini());
+  CHECK(dpaRailCount == 1);
+  return 0;
+}
+
+static int missing_rail_is_emulated(void) {
+  use_adapters("1", "2", "0");
+  setenv("FI_DPA_RAIL_EMULATE", "1", 1);
+  CHECK(fi_prov_ini());
+  CHECK(dpaRailCount == 2);
+  CHECK(dpaRails[0] == 0 && dpaRails[1] == 0);
+  return 0;
+}
+
+// large writes are striped, every rail maps the target through its own adapter
+static int striped_write_uses_every_rail(void) {
+  use_adapters("2", "2", NODEID_STRIDE);
+  char stripe[32];
+  snprintf(stripe, sizeof(stripe), "%d", STRIPE_SIZE);
+  setenv("FI_DPA_RMA_STRIPE_SIZE", stripe, 1);
+  rdm_setup setup;
+  if (rdm_open(&setup, DPA_RMA_CAP & ~FI_RMA_EVENT, FI_PROGRESS_MANUAL)) return 1;
+  struct fid_ep* ep;
+  struct fid_cq* cq;
+  if (rdm_endpoint(&setup, &ep, &cq)) return 1;
+
+  static char target[XFER_SIZE], source[XFER_SIZE], back[XFER_SIZE];
+  for (size_t i = 0; i < XFER_SIZE; i++)
+    source[i] = (char) (i * 7 + 1);
+  struct fid_mr* mr;
+  CHECK_OK(fi_mr_reg(setup.domain, target, sizeof(target),
+                     FI_REMOTE_READ | FI_REMOTE_WRITE, 0, MR_KEY, 0, &mr, NULL));
+
+  struct fi_cq_data_entry entry;
+  CHECK_OK(fi_write(ep, source, sizeof(source), NULL, setup.self, 0,
+                    fi_mr_key(mr), source));
+  CHECK(poll_cq(cq, &entry) == 1);
+  CHECK(entry.op_context == source);
+  CHECK(!memcmp(fi_mr_desc(mr), source, sizeof(source)));
+
+  CHECK_OK(fi_read(ep, back, sizeof(back), NULL, setup.self, 0, fi_mr_key(mr), back));
+  CHECK(poll_cq(cq, &entry) == 1);
+  CHECK(entry.op_context == back);
+  CHECK(!memcmp(back, source, sizeof(source)));
+
+  CHECK(standin_segment_connects(0) > 0);
+  CHECK(standin_segment_connects(1) > 0);
+  CHECK(standin_refused_connects() == 0);
+  return 0;
+}
+
+/* MR event interrupts only exist on the first rail: an initiator on
+ * another rail must still connect to them through the first one. */
+static int event_interrupt_on_first_rail(void) {
+  use_adapters("2", "2", NODEID_STRIDE);
+  rdm_setup setup;
+  if (rdm_open(&setup, DPA_RMA_CAP, FI_PROGRESS_AUTO)) return 1;
+  struct fid_ep *ep0, *ep1;
+  struct fid_cq *cq0, *cq1;
+  // endpoints are dealt round robin over the rails
+  if (rdm_endpoint(&setup, &ep0, &cq0) || rdm_endpoint(&setup, &ep1, &cq1)) return 1;
+  CHECK(container_of(ep1, dpa_fid_ep, ep)->rail == 1);
+
+  static char target[STRIPE_SIZE], source[STRIPE_SIZE];
+  memset(source, 0x5a, sizeof(source));
+  struct fid_mr* mr;
+  CHECK_OK(fi_mr_reg(setup.domain, target, sizeof(target),
+                     FI_REMOTE_WRITE, 0, MR_KEY, FI_RMA_EVENT, &mr, NULL));
+  struct fid_cq* event_cq;
+  struct fi_cq_attr cq_attr = { .format = FI_CQ_FORMAT_DATA };
+  CHECK_OK(fi_cq_open(setup.domain, &cq_attr, &event_cq, NULL));
+  CHECK_OK(fi_mr_bind(mr, &event_cq->fid, FI_REMOTE_WRITE));
+
+  // the target grants a reporting slot when the interrupt wakes it up
+  ssize_t ret;
+  for (int i = 0; i < POLL_LIMIT; i++) {
+    ret = fi_writedata(ep1, source, sizeof(source), NULL, 0xcafe, setup.self,
+                       0, fi_mr_key(mr), source);
+    if (ret != -FI_EAGAIN) break;
+    usleep(1000);
+  }
+  CHECK_OK(ret);
+  struct fi_cq_data_entry entry;
+  CHECK(poll_cq(event_cq, &entry) == 1);
+  CHECK(entry.flags & FI_REMOTE_CQ_DATA);
+  CHECK(entry.data == 0xcafe);
+  CHECK(entry.len == sizeof(source));
+  CHECK(!memcmp(fi_mr_desc(mr), source, sizeof(source)));
+
+  CHECK(standin_interrupt_connects(0) > 0);
+  CHECK(standin_interrupt_connects(1) == 0);
+  CHECK(standin_refused_connects() == 0);
+  return 0;
+}
+
+int main() {
+  int failed = 0;
+  failed += RUN_CASE(rails_on_two_adapters);
+  failed += RUN_CASE(missing_rail_is_skipped);
+  failed += RUN_CASE(missing_rail_is_emulated);
+  failed += RUN_CASE(striped_write_uses_every_rail);
+  failed += RUN_CASE(event_interrupt_on_first_rail);
+  return failed ? 1 : 0;
+}
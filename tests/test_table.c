@@ -0,0 +1,246 @@
+/* A libfabric provider for the A3CUBE Ronnie network.
+ *
+ * (C) Copyright 2015 - University of Torino, Italy
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * This work is a part of Paolo Inaudi's MSc thesis at Computer Science
+ * Department of University of Torino, under the supervision of Prof.
+ * Marco Aldinucci. This is work has been made possible thanks to
+ * the Memorandum of Understanding (2014) between University of Torino and 
+ * A3CUBE Inc. that established a joint research lab at
+ * Computer Science Department of University of Torino, Italy.
+ *
+ * Author: Paolo Inaudi <p91paul@gmail.com>  
+ *       
+ * Contributors: 
+ * 
+ *     Emilio Billi (A3Cube Inc. CSO): hardware and DPAlib support
+ *     Paola Pisano (UniTO-A3Cube CEO): testing environment
+ *     Marco Aldinucci (UniTO-A3Cube CSO): code design supervision"
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include "table.h"
+#include "test.h"
+
+#define KEYS 1000
+#define STRESS_KEYS 20000
+#define READERS 4
+// 1 ms apart, so a few seconds before giving up
+#define POLL_LIMIT 5000
+
+// values are never dereferenced, any distinct non NULL pointer does
+static inline void* value_of(uint64_t key) {
+  return (void*) (uintptr_t) (2 * key + 1);
+}
+
+static void sleep_ms(long ms) {
+  struct timespec delay = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 };
+  nanosleep(&delay, NULL);
+}
+
+static int put_get_remove(void) {
+  table* t = table_create(0);
+  CHECK(t);
+  CHECK(table_put(t, TABLE_EMPTY_KEY, value_of(0)) == -1);
+  // enough keys for the array to grow several times
+  for (uint64_t key = 0; key < KEYS; key++)
+    CHECK(!table_put(t, key, value_of(key)));
+  CHECK(t->live == KEYS);
+  for (uint64_t key = 0; key < KEYS; key++)
+    CHECK(table_get(t, key) == value_of(key));
+  CHECK(!table_get(t, KEYS));
+
+  CHECK(!table_put(t, 7, value_of(KEYS)));
+  CHECK(table_get(t, 7) == value_of(KEYS));
+  CHECK(t->live == KEYS);
+
+  for (uint64_t key = 0; key < KEYS; key += 2)
+    table_remove(t, key);
+  CHECK(t->live == KEYS / 2);
+  for (uint64_t key = 0; key < KEYS; key++)
+    CHECK(table_get(t, key) == (key % 2 ? (key == 7 ? value_of(KEYS) : value_of(key)) : NULL));
+
+  // removing a missing key inserts nothing
+  size_t used = t->array->used;
+  table_remove(t, 2 * KEYS);
+  CHECK(t->array->used == used);
+  CHECK(t->live == KEYS / 2);
+
+  // a removed key can come back
+  CHECK(!table_put(t, 0, value_of(0)));
+  CHECK(table_get(t, 0) == value_of(0));
+  table_destroy(t);
+  return 0;
+}
+
+// rebuilds drop tombstones, so churn on few live keys keeps the array small
+static int tombstones_are_dropped(void) {
+  table* t = table_create(0);
+  CHECK(t);
+  for (uint64_t key = 0; key < STRESS_KEYS; key++) {
+    CHECK(!table_put(t, key, value_of(key)));
+    table_remove(t, key);
+  }
+  CHECK(t->live == 0);
+  CHECK(t->array->mask + 1 <= 4 * TABLE_MIN_SIZE);
+  CHECK(2 * t->array->used <= t->array->mask + 1);
+  table_destroy(t);
+  return 0;
+}
+
+typedef struct {
+  table* t;
+  volatile int held;
+  volatile int release;
+  volatile int done;
+} reader_state;
+
+// holds the read side until told to let go
+static void* hold_reader(void* arg) {
+  reader_state* state = arg;
+  table_readers* readers;
+  table_get_held(state->t, 0, &readers);
+  __atomic_store_n(&state->held, 1, __ATOMIC_SEQ_CST);
+  while (!__atomic_load_n(&state->release, __ATOMIC_SEQ_CST))
+    sched_yield();
+  __atomic_store_n(&state->done, 1, __ATOMIC_SEQ_CST);
+  table_read_unlock(readers);
+  return NULL;
+}
+
+static void* synchronize(void* arg) {
+  reader_state* state = arg;
+  table_synchronize(state->t);
+  __atomic_store_n(&state->done, 1, __ATOMIC_SEQ_CST);
+  return NULL;
+}
+
+static int wait_flag(volatile int* flag) {
+  for (int i = 0; i < POLL_LIMIT && !__atomic_load_n(flag, __ATOMIC_SEQ_CST); i++)
+    sleep_ms(1);
+  return __atomic_load_n(flag, __ATOMIC_SEQ_CST);
+}
+
+static int grace_period_waits_for_readers(void) {
+  table* t = table_create(0);
+  CHECK(t);
+  reader_state reader = { .t = t };
+  pthread_t thread;
+  CHECK(!pthread_create(&thread, NULL, hold_reader, &reader));
+  CHECK(wait_flag(&reader.held));
+
+  reader_state sync = { .t = t };
+  pthread_t sync_thread;
+  CHECK(!pthread_create(&sync_thread, NULL, synchronize, &sync));
+  sleep_ms(50);
+  CHECK(!sync.done);
+  reader.release = 1;
+  CHECK(wait_flag(&sync.done));
+  // the reader let go before the grace period ended
+  CHECK(reader.done);
+  pthread_join(thread, NULL);
+  pthread_join(sync_thread, NULL);
+  table_destroy(t);
+  return 0;
+}
+
+// readers that arrive once the grace period started do not hold it back
+static int grace_period_ignores_later_readers(void) {
+  table* t = table_create(0);
+  CHECK(t);
+  reader_state early = { .t = t };
+  pthread_t early_thread;
+  CHECK(!pthread_create(&early_thread, NULL, hold_reader, &early));
+  CHECK(wait_flag(&early.held));
+  size_t epoch = t->epoch;
+
+  reader_state sync = { .t = t };
+  pthread_t sync_thread;
+  CHECK(!pthread_create(&sync_thread, NULL, synchronize, &sync));
+  for (int i = 0; i < POLL_LIMIT && __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST) == epoch; i++)
+    sleep_ms(1);
+  CHECK(t->epoch == epoch + 1);
+
+  reader_state late = { .t = t };
+  pthread_t late_thread;
+  CHECK(!pthread_create(&late_thread, NULL, hold_reader, &late));
+  CHECK(wait_flag(&late.held));
+  early.release = 1;
+  CHECK(wait_flag(&sync.done));
+  CHECK(!late.done);
+
+  late.release = 1;
+  pthread_join(early_thread, NULL);
+  pthread_join(late_thread, NULL);
+  pthread_join(sync_thread, NULL);
+  table_destroy(t);
+  return 0;
+}
+
+typedef struct {
+  table* t;
+  volatile int stop;
+  int errors;
+} lookup_state;
+
+// keys below KEYS are always there, with their own value
+static void* lookup_loop(void* arg) {
+  lookup_state* state = arg;
+  uint64_t key = 0;
+  while (!__atomic_load_n(&state->stop, __ATOMIC_SEQ_CST)) {
+    if (table_get(state->t, key) != value_of(key))
+      state->errors++;
+    key = (key + 1) % KEYS;
+  }
+  return NULL;
+}
+
+static int lookups_while_growing(void) {
+  table* t = table_create(0);
+  CHECK(t);
+  for (uint64_t key = 0; key < KEYS; key++)
+    CHECK(!table_put(t, key, value_of(key)));
+  lookup_state state[READERS];
+  pthread_t threads[READERS];
+  for (int i = 0; i < READERS; i++) {
+    state[i] = (lookup_state) { .t = t };
+    CHECK(!pthread_create(&threads[i], NULL, lookup_loop, &state[i]));
+  }
+  // grow the array under the readers, and churn tombstones into rebuilds
+  for (uint64_t key = KEYS; key < STRESS_KEYS; key++) {
+    CHECK(!table_put(t, key, value_of(key)));
+    if (key % 3) table_remove(t, key);
+  }
+  for (int i = 0; i < READERS; i++) {
+    state[i].stop = 1;
+    pthread_join(threads[i], NULL);
+    CHECK(!state[i].errors);
+  }
+  table_destroy(t);
+  return 0;
+}
+
+int main() {
+  int failed = 0;
+  failed += RUN_CASE(put_get_remove);
+  failed += RUN_CASE(tombstones_are_dropped);
+  failed += RUN_CASE(grace_period_waits_for_readers);
+  failed += RUN_CASE(grace_period_ignores_later_readers);
+  failed += RUN_CASE(lookups_while_growing);
+  return failed ? 1 : 0;
+}